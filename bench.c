@@ -0,0 +1,413 @@
+// Copyright © 2023 Michael Thornburgh
+// SPDX-License-Identifier: MIT
+
+// Benchmarks for the Pikchr formatter. Each benchmark renders a diagram made
+// by a generator that scales one dimension of the input (object count,
+// nesting depth, label length, macro fan-out, layer count, or path length),
+// or a real document scaled up, a fixed number of times with pikchr(), and
+// reports throughput, latency percentiles, and allocations per call.
+// The timed calls use the default allocator, so that large diagrams are
+// rendered on several threads as they would be in use. Allocations are then
+// counted in one more call with pikchr_use_allocator(), which renders on one
+// thread.
+
+#include <iso646.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pikchr.h"
+
+typedef struct {
+	char   *buf;
+	size_t  capacity;
+	size_t  offset;
+} buffer_t;
+
+static unsigned long allocCount = 0;
+static size_t allocBytes = 0;
+
+static void *countingMalloc(void *ctx, size_t size)
+{
+	allocCount++;
+	allocBytes += size;
+	return malloc(size);
+}
+
+static void *countingRealloc(void *ctx, void *ptr, size_t size)
+{
+	allocCount++;
+	allocBytes += size;
+	return realloc(ptr, size);
+}
+
+static void countingFree(void *ctx, void *ptr)
+{
+	free(ptr);
+}
+
+static const pikchr_allocator countingAllocator = { countingMalloc, countingRealloc, countingFree, NULL };
+
+static void bufferInit(buffer_t *buffer)
+{
+	buffer->capacity = 8192;
+	buffer->offset = 0;
+	buffer->buf = (char *)malloc(buffer->capacity);
+	buffer->buf[0] = 0;
+}
+
+static void bufferAppend(buffer_t *buffer, const char *str, size_t len)
+{
+	if(buffer->offset + len >= buffer->capacity)
+	{
+		while(buffer->offset + len >= buffer->capacity)
+			buffer->capacity *= 2;
+		buffer->buf = (char *)realloc(buffer->buf, buffer->capacity);
+		if(not buffer->buf)
+			abort();
+	}
+
+	memcpy(buffer->buf + buffer->offset, str, len);
+	buffer->offset += len;
+	buffer->buf[buffer->offset] = 0;
+}
+
+static void bufferString(buffer_t *buffer, const char *str)
+{
+	bufferAppend(buffer, str, strlen(str));
+}
+
+static void bufferPrintf(buffer_t *buffer, const char *fmt, ...)
+{
+	char tmp[256];
+	va_list args;
+	va_start(args, fmt);
+	int len = vsnprintf(tmp, sizeof(tmp), fmt, args);
+	va_end(args);
+	bufferAppend(buffer, tmp, len);
+}
+
+// --- Generators. Each answers Pikchr source in memory from malloc().
+
+// n boxes joined by arrows, turning every 20 objects.
+static char * genObjects(int n, const char *doc)
+{
+	static const char *directions[] = { "right", "down", "left", "down" };
+	buffer_t src;
+	bufferInit(&src);
+	for(int i = 0; i < n; i++)
+	{
+		if(i % 20 == 0)
+			bufferPrintf(&src, "%s\n", directions[(i / 20) % 4]);
+		bufferPrintf(&src, "B%d: box \"b%d\" wid 0.4 ht 0.3\narrow 0.2\n", i, i);
+	}
+	(void)doc;
+	return src.buf;
+}
+
+// [...] blocks nested depth deep, each with a box and a circle.
+static char * genNesting(int depth, const char *doc)
+{
+	buffer_t src;
+	bufferInit(&src);
+	for(int i = 0; i < depth; i++)
+		bufferPrintf(&src, "[ box \"d%d\"; circle rad 0.1\n", i);
+	for(int i = 0; i < depth; i++)
+		bufferString(&src, "]\n");
+	(void)doc;
+	return src.buf;
+}
+
+// 20 boxes sized to fit labels of len characters.
+static char * genLabels(int len, const char *doc)
+{
+	buffer_t src;
+	bufferInit(&src);
+	char *label = (char *)malloc(len + 1);
+	for(int i = 0; i < len; i++)
+		label[i] = "pikchr labels & <text> "[i % 23];
+	label[len] = 0;
+	for(int i = 0; i < 20; i++)
+	{
+		bufferString(&src, "box \"");
+		bufferAppend(&src, label, len);
+		bufferString(&src, "\" fit\ndown\n");
+	}
+	free(label);
+	(void)doc;
+	return src.buf;
+}
+
+// A macro that calls another macro fanout times, called fanout times.
+static char * genMacros(int fanout, const char *doc)
+{
+	buffer_t src;
+	bufferInit(&src);
+	bufferString(&src, "define leaf { box wid 0.1 ht 0.1 $1 }\ndefine mid {\n");
+	for(int i = 0; i < fanout; i++)
+		bufferPrintf(&src, "  leaf(\"%d\")\n", i);
+	bufferString(&src, "  down\n}\n");
+	for(int i = 0; i < fanout; i++)
+		bufferString(&src, "mid\n");
+	(void)doc;
+	return src.buf;
+}
+
+// 1000 overlapping objects spread over the given number of layers.
+static char * genLayers(int layers, const char *doc)
+{
+	buffer_t src;
+	bufferInit(&src);
+	for(int i = 0; i < 1000; i++)
+		bufferPrintf(&src, "layer = %d\nbox fill 0x%06x at (0.01*%d, 0)\n",
+			i % layers, (unsigned int)(i * 2654435761u) & 0xffffff, i % 100);
+	(void)doc;
+	return src.buf;
+}
+
+// A line and a spline with length segments each.
+static char * genPaths(int length, const char *doc)
+{
+	static const char *steps[] = { " then right 0.1", " then up 0.1", " then right 0.1", " then down 0.1" };
+	buffer_t src;
+	bufferInit(&src);
+	for(int kind = 0; kind < 2; kind++)
+	{
+		bufferString(&src, kind ? "spline ->" : "line ->");
+		bufferString(&src, " right 0.1");
+		for(int i = 1; i < length; i++)
+			bufferString(&src, steps[i % 4]);
+		bufferString(&src, "\n");
+	}
+	(void)doc;
+	return src.buf;
+}
+
+// Every diagram in a real document, each as a [...] block, copies times.
+static char * genDocument(int copies, const char *doc)
+{
+	buffer_t src;
+	bufferInit(&src);
+	for(int i = 0; i < copies; i++)
+	{
+		const char *cursor = doc;
+		bool inDiagram = false;
+		while(*cursor)
+		{
+			const char *eol = strchr(cursor, '\n');
+			size_t len = eol ? (size_t)(eol - cursor) + 1 : strlen(cursor);
+			bool fence = (0 == strncmp(cursor, "```", 3)) or (0 == strncmp(cursor, "~~~", 3));
+			if(inDiagram)
+			{
+				if(fence or (0 == strncmp(cursor, ".PE", 3)))
+				{
+					inDiagram = false;
+					bufferString(&src, "]\n");
+				}
+				else
+					bufferAppend(&src, cursor, len);
+			}
+			else if((fence and strstr(cursor, "pikchr") and strstr(cursor, "pikchr") < cursor + len) or (0 == strncmp(cursor, ".PS", 3)))
+			{
+				inDiagram = true;
+				bufferString(&src, "[\n");
+			}
+			cursor += len;
+		}
+		if(inDiagram)
+			bufferString(&src, "]\n");
+	}
+	return src.buf;
+}
+
+typedef struct {
+	const char *name;
+	char * (*generate)(int param, const char *doc);
+	int params[4];
+} benchmark_t;
+
+static const benchmark_t benchmarks[] = {
+	{ "objects",  genObjects,  { 10, 100, 1000, 5000 } },
+	{ "nesting",  genNesting,  { 1, 10, 50, 200 } },
+	{ "labels",   genLabels,   { 10, 100, 1000, 10000 } },
+	{ "macros",   genMacros,   { 2, 8, 32, 64 } },
+	{ "layers",   genLayers,   { 1, 10, 100, 1000 } },
+	{ "paths",    genPaths,    { 10, 100, 500, 990 } },
+	{ "document", genDocument, { 1, 10, 100, 500 } },
+};
+
+static int compareDoubles(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double percentile(const double *sorted, int n, double pct)
+{
+	int i = (int)(pct / 100.0 * (n - 1) + 0.5);
+	return sorted[i];
+}
+
+static int usage(const char *name, int rv, const char *msg)
+{
+	if(msg)
+		printf("%s\n", msg);
+
+	printf("Usage: %s [options] [document]\n", name);
+	printf("  -n count    -- render each diagram count times, default: 20\n");
+	printf("  -f name     -- only run benchmarks whose name starts with name\n");
+	printf("  -F flags    -- mFlags for pikchr(), default: 0\n");
+	printf("  -j threads  -- also render count copies at once with pikchr_batch()\n");
+	printf("                 on threads threads (0 for one per CPU), default: off\n");
+	printf("  -h          -- print this help\n");
+	printf("\n");
+	printf("The document (default README.md.in) is scaled up for the \"document\" benchmark.\n");
+
+	return rv;
+}
+
+int main(int argc, char **argv)
+{
+	int ch;
+	int iterations = 20;
+	const char *filter = "";
+	unsigned int flags = 0;
+	int threads = -1;
+
+	pikchr_limit(PIKCHR_LIMIT_RENDER_THREADS, 0); // large diagrams on one thread per CPU
+
+	while((ch = getopt(argc, argv, "n:f:F:j:h")) != -1)
+	{
+		switch(ch)
+		{
+		case 'n':
+			iterations = atoi(optarg);
+			if(iterations < 1)
+				return usage(argv[0], 1, "-n takes a positive count");
+			break;
+
+		case 'f':
+			filter = optarg;
+			break;
+
+		case 'F':
+			flags = (unsigned int)strtoul(optarg, NULL, 0);
+			break;
+
+		case 'j':
+			threads = atoi(optarg);
+			if(threads < 0)
+				return usage(argv[0], 1, "-j takes a thread count");
+			break;
+
+		case 'h':
+		default:
+			return usage(argv[0], 'h' != ch, NULL);
+		}
+	}
+
+	if(optind + 1 < argc)
+		return usage(argv[0], 1, "at most one document");
+
+	const char *docName = optind < argc ? argv[optind] : "README.md.in";
+	buffer_t doc;
+	bufferInit(&doc);
+	FILE *docFile = fopen(docName, "r");
+	if(docFile)
+	{
+		char chunk[8192];
+		size_t len;
+		while((len = fread(chunk, 1, sizeof(chunk), docFile)) > 0)
+			bufferAppend(&doc, chunk, len);
+		fclose(docFile);
+	}
+	else
+		perror(docName);
+
+	double *latency = (double *)malloc(sizeof(double) * iterations);
+	pikchr_job *jobs = (pikchr_job *)calloc(iterations, sizeof(pikchr_job));
+
+	printf("%-9s %6s %7s %9s %8s %8s %9s %9s %9s %9s %8s %9s %9s\n",
+		"benchmark", "param", "in KB", "diagram/s", "in MB/s", "out KB",
+		"p50 us", "p90 us", "p99 us", "max us", "allocs", "alloc KB", "batch/s");
+
+	for(size_t b = 0; b < sizeof(benchmarks) / sizeof(benchmarks[0]); b++)
+	{
+		const benchmark_t *bench = &benchmarks[b];
+		if(strncmp(bench->name, filter, strlen(filter)))
+			continue;
+
+		for(int k = 0; k < 4; k++)
+		{
+			char *src = bench->generate(bench->params[k], doc.buf);
+			size_t srcLen = strlen(src);
+			size_t outLen = 0;
+			int width = 0;
+			int height = 0;
+
+			free(pikchr(src, NULL, flags, &width, &height)); // warm up
+			if(width < 0)
+				fprintf(stderr, "%s %d: diagram has errors\n", bench->name, bench->params[k]);
+
+			double total = 0.0;
+			for(int i = 0; i < iterations; i++)
+			{
+				double started = now();
+				char *out = pikchr(src, NULL, flags, &width, &height);
+				latency[i] = now() - started;
+				total += latency[i];
+				outLen = out ? strlen(out) : 0;
+				free(out);
+			}
+			qsort(latency, iterations, sizeof(double), compareDoubles);
+
+			unsigned long allocCountBefore = allocCount;
+			size_t allocBytesBefore = allocBytes;
+			pikchr_use_allocator(&countingAllocator);
+			free(pikchr(src, NULL, flags, &width, &height));
+			pikchr_use_allocator(NULL);
+			unsigned long allocs = allocCount - allocCountBefore;
+			double allocKB = (allocBytes - allocBytesBefore) / 1024.0;
+
+			double batchRate = 0.0;
+			if(threads >= 0)
+			{
+				for(int i = 0; i < iterations; i++)
+				{
+					jobs[i].zText = src;
+					jobs[i].mFlags = flags;
+				}
+				double started = now();
+				pikchr_batch_free(pikchr_batch(jobs, iterations, threads), iterations);
+				batchRate = iterations / (now() - started);
+			}
+
+			printf("%-9s %6d %7.1f %9.1f %8.2f %8.1f %9.1f %9.1f %9.1f %9.1f %8lu %9.1f %9.1f\n",
+				bench->name, bench->params[k], srcLen / 1024.0,
+				iterations / total, srcLen * iterations / total / 1e6, outLen / 1024.0,
+				percentile(latency, iterations, 50) * 1e6, percentile(latency, iterations, 90) * 1e6,
+				percentile(latency, iterations, 99) * 1e6, latency[iterations - 1] * 1e6,
+				allocs, allocKB, batchRate);
+			fflush(stdout);
+			free(src);
+		}
+	}
+
+	free(jobs);
+	free(latency);
+	free(doc.buf);
+
+	return 0;
+}
@@ -3,20 +3,31 @@
 
 // A pipeline-friendly command-line driver for the Pikchr C reference
 // implementation pikchr.c by Richard Hipp <drh@sqlite.org>.
-// Reads from stdin, writes to stdout.
+// Reads from stdin or a file, writes to stdout or a file.
 
 // Pikchr's home page: https://pikchr.org/
 // GitHub mirror: https://github.com/drhsqlite/pikchr
 
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <iso646.h>
+#include <pthread.h>
+#include <poll.h>
 #include <regex.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
 #include "pikchr.h"
 #include "version.h"
 
@@ -27,9 +38,76 @@ typedef struct {
 } buffer_t;
 
 const char *svgAttrs = "style='font-size:initial;'";
+const char *extractAttrs = NULL;
 const char *summaryText = "Pikchr Source";
 const char *summaryAttrs = "";
 
+// Settings from the command line that apply to every document.
+const char *svgClass = NULL;
+const char *onlyModifier = NULL;
+bool bareMode = false;
+bool includeDocument = true;
+bool includeDiagrams = true;
+unsigned int plaintextErrors = 0;
+unsigned int flags = 0;
+bool requoteAllDiagrams = false;
+bool detailsAllDiagrams = false;
+bool pngAllDiagrams = false;
+bool verbose = false;
+const char *extractDir = NULL;
+bool useReferences = false;
+const char *assetDir = NULL;
+const char *assetPrefix = NULL;
+
+// The prelude compiled from the -P file, which every document starts with.
+pikchr_prelude *basePrelude = NULL;
+buffer_t basePreludeText;
+
+regex_t startPattern;
+regex_t endPattern;
+
+// Guards tempCounter.
+pthread_mutex_t tempMutex = PTHREAD_MUTEX_INITIALIZER;
+unsigned long tempCounter = 0;
+
+// Totals for -v.
+pthread_mutex_t statsMutex = PTHREAD_MUTEX_INITIALIZER;
+pikchr_stats statsAllDiagrams;
+unsigned long diagramCount = 0;
+double slowestTime = -1.0;
+const char *slowestName = "";
+size_t slowestLine = 0;
+bool multipleFiles = false;
+
+// Rendered diagrams and compiled preludes, keyed by everything that affects them,
+// so that a document processed again only renders what changed, and documents
+// processed together share the work. Entries don't change once added.
+typedef struct cacheEntry {
+	struct cacheEntry *next;
+	uint64_t hash;
+	char   *key;
+	size_t  keyLen;
+	unsigned long lastUsed;   // run that last found or added this entry
+	char   *svg;              // answer of pikchr(), or prelude errors
+	int     width;
+	int     height;
+	pikchr_prelude *prelude;  // compiled prelude, for prelude entries
+	unsigned long serial;     // identifies a prelude in the keys of diagrams
+} cacheEntry_t;
+
+typedef struct {
+	pthread_mutex_t mutex;
+	cacheEntry_t **buckets;
+	size_t  nBuckets;
+	size_t  count;
+	size_t  bytes;            // of rendered diagrams
+	size_t  maxBytes;         // stop adding rendered diagrams after this many bytes
+	unsigned long run;
+	unsigned long nextSerial;
+	unsigned long hits;       // in this run
+	unsigned long misses;     // in this run
+} cache_t;
+
 static bool bufferAppend(buffer_t *buffer, char *str, size_t len)
 {
 	if(buffer->offset + len >= buffer->capacity)
@@ -88,7 +166,25 @@ static const char * strword(const char *haystack, const char *needle)
 	return NULL;
 }
 
-static void printIndented(const char *str)
+static bool bufferAppendFile(buffer_t *buffer, const char *path)
+{
+	FILE *file = fopen(path, "r");
+	if(not file)
+		return false;
+
+	char chunk[8192];
+	size_t len;
+	bool ok = true;
+	while(ok and (len = fread(chunk, 1, sizeof(chunk), file)) > 0)
+		ok = bufferAppend(buffer, chunk, len);
+	if(ferror(file))
+		ok = false;
+	fclose(file);
+
+	return ok;
+}
+
+static void printIndented(FILE *out, const char *str)
 {
 	int ch;
 	bool need_indent = true;
@@ -96,21 +192,436 @@ static void printIndented(const char *str)
 	{
 		if(need_indent)
 		{
-			printf("    ");
+			fprintf(out, "    ");
 			need_indent = false;
 		}
-		fputc(ch, stdout);
+		fputc(ch, out);
 		if('\n' == ch)
 			need_indent = true;
 	}
 }
 
+// Print svg with attrs, and id if it isn't NULL, added to its <svg> start tag.
+static void printSvg(FILE *out, const char *svg, const char *attrs, const char *id)
+{
+	const char *afterFirstElement = strstr(svg, "<svg");
+	if(afterFirstElement)
+		afterFirstElement = strchr(afterFirstElement, '>');
+	if(afterFirstElement and id)
+		fprintf(out, "%.*s id=\"%s\" %s%s", (int)(afterFirstElement - svg), svg, id, attrs, afterFirstElement);
+	else if(afterFirstElement)
+		fprintf(out, "%.*s %s%s", (int)(afterFirstElement - svg), svg, attrs, afterFirstElement);
+	else
+		fprintf(out, "%s", svg); // will only happen if pikchr() doesn't answer a complete SVG element
+}
+
+// Print an <svg> with the same start tag as svg, showing the earlier copy of svg
+// that has the given id with <use>.
+static void printSvgReference(FILE *out, const char *svg, const char *attrs, const char *id)
+{
+	const char *afterFirstElement = strstr(svg, "<svg");
+	if(afterFirstElement)
+		afterFirstElement = strchr(afterFirstElement, '>');
+	if(afterFirstElement)
+		fprintf(out, "%.*s %s><use href=\"#%s\"/></svg>\n", (int)(afterFirstElement - svg), svg, attrs, id);
+	else
+		fprintf(out, "%s", svg);
+}
+
+// The diagrams given an id for -U so far in a document are recorded in referenced as
+// the hash of each one's key, the key's length, and the key. Answer true if key was
+// recorded. Otherwise record it, unless a different diagram has the same hash (and so
+// the same id), in which case set *taken.
+static bool referenceSeen(buffer_t *referenced, char *key, size_t len, uint64_t hash, bool *taken)
+{
+	*taken = false;
+	for(size_t i = 0; i < referenced->offset; )
+	{
+		uint64_t otherHash;
+		size_t otherLen;
+		memcpy(&otherHash, referenced->buf + i, sizeof(otherHash));
+		i += sizeof(otherHash);
+		memcpy(&otherLen, referenced->buf + i, sizeof(otherLen));
+		i += sizeof(otherLen);
+		if(otherHash == hash)
+		{
+			if((otherLen == len) and (0 == memcmp(referenced->buf + i, key, len)))
+				return true;
+			*taken = true;
+			return false;
+		}
+		i += otherLen;
+	}
+
+	bufferAppend(referenced, (char *)&hash, sizeof(hash));
+	bufferAppend(referenced, (char *)&len, sizeof(len));
+	bufferAppend(referenced, key, len);
+	return false;
+}
+
+// Make a name for a temporary file next to path, unique among processes and threads.
+static bool makeTempPath(char *dst, size_t size, const char *path)
+{
+	pthread_mutex_lock(&tempMutex);
+	unsigned long counter = tempCounter++;
+	pthread_mutex_unlock(&tempMutex);
+
+	if(snprintf(dst, size, "%s.%ld-%lu.tmp", path, (long)getpid(), counter) < (int)size)
+		return true;
+	fprintf(stderr, "%s: name too long\n", path);
+	return false;
+}
+
+// Collect the @name modifiers of a start line into names, each followed by a NUL.
+static void collectTargets(buffer_t *names, const char *line)
+{
+	bufferErase(names);
+	while(*line)
+	{
+		size_t len = strcspn(line, " \t\r\n\v\f");
+		if(('@' == line[0]) and (len > 1))
+		{
+			bufferAppend(names, (char *)line + 1, len - 1);
+			bufferAppend(names, "", 1);
+		}
+		line += len;
+		line += strspn(line, " \t\r\n\v\f");
+	}
+}
+
+// Write svg, with extractAttrs added, as a standalone SVG file at path, replacing the
+// file only when it's complete.
+static bool writeSvgFile(const char *path, const char *svg)
+{
+	char tmpPath[4200];
+	if(not makeTempPath(tmpPath, sizeof(tmpPath), path))
+		return false;
+
+	FILE *file = fopen(tmpPath, "w");
+	if(not file)
+	{
+		perror(tmpPath);
+		return false;
+	}
+	printSvg(file, svg, extractAttrs, NULL);
+	fprintf(file, "\n");
+	bool writeFailed = ferror(file);
+	writeFailed = (0 != fclose(file)) or writeFailed;
+	if(writeFailed or (0 != rename(tmpPath, path)))
+	{
+		perror(writeFailed ? tmpPath : path);
+		remove(tmpPath);
+		return false;
+	}
+
+	return true;
+}
+
+// Write svg to name.svg in extractDir.
+static bool writeTarget(const char *name, const char *svg)
+{
+	char path[4096];
+	if(strchr(name, '/') or (0 == strcmp(name, ".")) or (0 == strcmp(name, "..")))
+	{
+		fprintf(stderr, "@%s: not a file name\n", name);
+		return false;
+	}
+	if(snprintf(path, sizeof(path), "%s/%s.svg", extractDir, name) >= (int)sizeof(path))
+	{
+		fprintf(stderr, "@%s: name too long\n", name);
+		return false;
+	}
+
+	return writeSvgFile(path, svg);
+}
+
+static const uint64_t fnv64Offset = 14695981039346656037ull;
+
+// Continue the 64-bit FNV-1a hash, which starts as fnv64Offset, over str.
+static uint64_t fnv64(uint64_t hash, const char *str, size_t len)
+{
+	for(size_t i = 0; i < len; i++)
+		hash = (hash ^ (unsigned char)str[i]) * 1099511628211ull;
+	return hash;
+}
+
+// Write svg to a file in assetDir named for the hash of its contents, unless that file
+// already exists, and print an <img> for it. Identical diagrams share one file.
+static bool printAsset(FILE *out, const char *svg, int width, int height)
+{
+	// Hash the text that writeSvgFile() writes.
+	uint64_t hash = fnv64Offset;
+	const char *afterFirstElement = strstr(svg, "<svg");
+	if(afterFirstElement)
+		afterFirstElement = strchr(afterFirstElement, '>');
+	if(afterFirstElement)
+	{
+		hash = fnv64(hash, svg, afterFirstElement - svg);
+		hash = fnv64(hash, " ", 1);
+		hash = fnv64(hash, extractAttrs, strlen(extractAttrs));
+		hash = fnv64(hash, afterFirstElement, strlen(afterFirstElement));
+	}
+	else
+		hash = fnv64(hash, svg, strlen(svg));
+	hash = fnv64(hash, "\n", 1);
+
+	char name[32];
+	char path[4096];
+	struct stat st;
+	snprintf(name, sizeof(name), "%016llx.svg", (unsigned long long)hash);
+	if(snprintf(path, sizeof(path), "%s/%s", assetDir, name) >= (int)sizeof(path))
+	{
+		fprintf(stderr, "%s: name too long\n", assetDir);
+		return false;
+	}
+	if((0 != stat(path, &st)) and not writeSvgFile(path, svg))
+		return false;
+
+	fprintf(out, "<img src=\"%s%s\" width=\"%d\" height=\"%d\" loading=\"lazy\" alt=\"\"", assetPrefix, name, width, height);
+	if(svgClass)
+		fprintf(out, " class=\"%s\"", svgClass);
+	fprintf(out, ">\n");
+
+	return true;
+}
+
+static void cacheInit(cache_t *cache, size_t maxBytes)
+{
+	memset(cache, 0, sizeof(*cache));
+	pthread_mutex_init(&cache->mutex, NULL);
+	cache->maxBytes = maxBytes;
+	cache->nBuckets = 256;
+	cache->buckets = (cacheEntry_t **)calloc(cache->nBuckets, sizeof(cacheEntry_t *));
+	if(not cache->buckets)
+		abort();
+}
+
+static uint64_t cacheHash(const char *key, size_t len)
+{
+	return fnv64(fnv64Offset, key, len);
+}
+
+static void cacheEntryFree(cacheEntry_t *entry)
+{
+	free(entry->key);
+	free(entry->svg);
+	pikchr_prelude_free(entry->prelude);
+	free(entry);
+}
+
+// Answer the entry for key and mark it used in this run, or NULL if there is none.
+static cacheEntry_t * cacheFind(cache_t *cache, const char *key, size_t len)
+{
+	uint64_t hash = cacheHash(key, len);
+	cacheEntry_t *found = NULL;
+
+	pthread_mutex_lock(&cache->mutex);
+	for(cacheEntry_t *each = cache->buckets[hash % cache->nBuckets]; each; each = each->next)
+	{
+		if((each->hash == hash) and (each->keyLen == len) and (0 == memcmp(each->key, key, len)))
+		{
+			each->lastUsed = cache->run;
+			cache->hits++;
+			found = each;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&cache->mutex);
+
+	return found;
+}
+
+// Add an entry for key holding a rendered diagram or a compiled prelude, which then
+// belong to the cache. Answers NULL, taking nothing, if the cache is full; preludes
+// are always taken.
+static cacheEntry_t * cacheAdd(cache_t *cache, const char *key, size_t len, char *svg, int width, int height, pikchr_prelude *prelude)
+{
+	size_t svgBytes = svg ? strlen(svg) : 0;
+
+	pthread_mutex_lock(&cache->mutex);
+	cache->misses++;
+	if((not prelude) and (cache->bytes + svgBytes > cache->maxBytes))
+	{
+		pthread_mutex_unlock(&cache->mutex);
+		return NULL;
+	}
+
+	if(cache->count >= cache->nBuckets)
+	{
+		size_t nBuckets = cache->nBuckets * 2;
+		cacheEntry_t **buckets = (cacheEntry_t **)calloc(nBuckets, sizeof(cacheEntry_t *));
+		if(not buckets)
+			abort();
+		for(size_t i = 0; i < cache->nBuckets; i++)
+		{
+			cacheEntry_t *next;
+			for(cacheEntry_t *each = cache->buckets[i]; each; each = next)
+			{
+				next = each->next;
+				each->next = buckets[each->hash % nBuckets];
+				buckets[each->hash % nBuckets] = each;
+			}
+		}
+		free(cache->buckets);
+		cache->buckets = buckets;
+		cache->nBuckets = nBuckets;
+	}
+
+	cacheEntry_t *entry = (cacheEntry_t *)calloc(1, sizeof(cacheEntry_t));
+	if((not entry) or not (entry->key = (char *)malloc(len)))
+		abort();
+	memcpy(entry->key, key, len);
+	entry->keyLen = len;
+	entry->hash = cacheHash(key, len);
+	entry->lastUsed = cache->run;
+	entry->svg = svg;
+	entry->width = width;
+	entry->height = height;
+	entry->prelude = prelude;
+	entry->serial = ++cache->nextSerial;
+	entry->next = cache->buckets[entry->hash % cache->nBuckets];
+	cache->buckets[entry->hash % cache->nBuckets] = entry;
+	cache->count++;
+	cache->bytes += svgBytes;
+	pthread_mutex_unlock(&cache->mutex);
+
+	return entry;
+}
+
+// Start a run. Entries not used since the start of the previous run are dropped.
+static void cacheNewRun(cache_t *cache)
+{
+	for(size_t i = 0; i < cache->nBuckets; i++)
+	{
+		cacheEntry_t **link = &cache->buckets[i];
+		while(*link)
+		{
+			cacheEntry_t *entry = *link;
+			if(entry->lastUsed < cache->run)
+			{
+				*link = entry->next;
+				if(not entry->prelude)
+					cache->bytes -= entry->svg ? strlen(entry->svg) : 0;
+				cacheEntryFree(entry);
+				cache->count--;
+			}
+			else
+				link = &entry->next;
+		}
+	}
+	cache->run++;
+	cache->hits = 0;
+	cache->misses = 0;
+}
+
+static void cacheFree(cache_t *cache)
+{
+	for(size_t i = 0; i < cache->nBuckets; i++)
+	{
+		cacheEntry_t *next;
+		for(cacheEntry_t *each = cache->buckets[i]; each; each = next)
+		{
+			next = each->next;
+			cacheEntryFree(each);
+		}
+	}
+	free(cache->buckets);
+	cache->buckets = NULL;
+	pthread_mutex_destroy(&cache->mutex);
+}
+
+// Render a diagram to PNG and answer an <img> element with the image in a data: URL,
+// in the same style as pikchr(): on error *width is negative and the answer is the
+// error message. The PNG has twice the pixels of the SVG for high density screens.
+static char * pikchrPng(const pikchr_prelude *prelude, const char *text, const char *svgClass, unsigned int flags, int *width, int *height)
+{
+	static const char base64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	int nbytes = 0;
+	unsigned char *png = pikchr_prelude_png(prelude, text, flags, 2.0, &nbytes, width, height);
+	if((not png) or (*width < 0))
+		return (char *)png;
+
+	buffer_t img;
+	bufferInit(&img, nbytes / 3 * 4 + 256);
+	bufferAppend(&img, "<img src=\"data:image/png;base64,", 32);
+	for(int i = 0; i < nbytes; i += 3)
+	{
+		unsigned long triple = (unsigned long)png[i] << 16;
+		if(i + 1 < nbytes)
+			triple |= (unsigned long)png[i + 1] << 8;
+		if(i + 2 < nbytes)
+			triple |= png[i + 2];
+
+		char quad[4];
+		quad[0] = base64[(triple >> 18) & 63];
+		quad[1] = base64[(triple >> 12) & 63];
+		quad[2] = (i + 1 < nbytes) ? base64[(triple >> 6) & 63] : '=';
+		quad[3] = (i + 2 < nbytes) ? base64[triple & 63] : '=';
+		bufferAppend(&img, quad, 4);
+	}
+	free(png);
+
+	*width = (*width + 1) / 2;
+	*height = (*height + 1) / 2;
+	char attrs[64];
+	int len = snprintf(attrs, sizeof(attrs), "\" width=\"%d\" height=\"%d\" alt=\"\"", *width, *height);
+	bufferAppend(&img, attrs, len);
+	if(svgClass)
+	{
+		bufferAppend(&img, " class=\"", 8);
+		bufferAppend(&img, (char *)svgClass, strlen(svgClass));
+		bufferAppend(&img, "\"", 1);
+	}
+	bufferAppend(&img, ">\n", 2);
+
+	return img.buf;
+}
+
+static double monotonicNow(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static double statsTotal(const pikchr_stats *stats)
+{
+	return stats->rTokenize + stats->rParse + stats->rLayout + stats->rBbox + stats->rRender;
+}
+
+static void statsAdd(pikchr_stats *sum, const pikchr_stats *stats)
+{
+	sum->rTokenize += stats->rTokenize;
+	sum->rParse += stats->rParse;
+	sum->rLayout += stats->rLayout;
+	sum->rBbox += stats->rBbox;
+	sum->rRender += stats->rRender;
+	sum->nToken += stats->nToken;
+	sum->nObj += stats->nObj;
+	sum->nMacro += stats->nMacro;
+	sum->nVarLookup += stats->nVarLookup;
+	sum->nOut += stats->nOut;
+	if(stats->nPeakEst > sum->nPeakEst)
+		sum->nPeakEst = stats->nPeakEst;
+}
+
+static void statsPrint(const char *label, const pikchr_stats *stats)
+{
+	fprintf(stderr, "%s: %.3f ms: tokenize %.3f, parse %.3f, layout %.3f, bbox %.3f, render %.3f; "
+		"%u tokens, %u objects, %u macros, %u lookups; %zu bytes out, ~%zu bytes peak\n",
+		label, statsTotal(stats) * 1000.0,
+		stats->rTokenize * 1000.0, stats->rParse * 1000.0, stats->rLayout * 1000.0,
+		stats->rBbox * 1000.0, stats->rRender * 1000.0,
+		stats->nToken, stats->nObj, stats->nMacro, stats->nVarLookup, stats->nOut, stats->nPeakEst);
+}
+
 static int usage(const char *name, int rv, const char *msg)
 {
 	if(msg)
 		printf("%s\n", msg);
 
 	printf("Usage: %s [options]\n", name);
+	printf("       %s [options] -o outdir file...\n", name);
 	printf("  -c aClass   -- add class=\"aClass\" to <svg> tags\n");
 	printf("  -a attrs    -- add attrs to <svg> tags, default: %s\n", svgAttrs);
 	printf("  -s summary  -- summary text for <details>, default: %s\n", summaryText);
@@ -119,11 +630,33 @@ static int usage(const char *name, int rv, const char *msg)
 	printf("  -p          -- output plaintext error messages instead of HTML\n");
 	printf("  -d          -- set dark mode (but consider using -C instead)\n");
 	printf("  -C          -- set x-current-color for all diagrams\n");
+	printf("  -t          -- set x-css-colors for all diagrams\n");
+	printf("  -k          -- set x-css-classes for all diagrams\n");
+	printf("  -m          -- set x-arrow-markers for all diagrams\n");
+	printf("  -u          -- set x-symbols for all diagrams\n");
+	printf("  -z          -- set x-compact for all diagrams\n");
+	printf("  -Z digits   -- decimal places (0-6) for x-compact, default: 2\n");
+	printf("  -g          -- set x-png for all diagrams\n");
+	printf("  -P file     -- compile the macros and variables in file once for all diagrams\n");
 	printf("  -R          -- requote all diagram source\n");
 	printf("  -D          -- put all requoted diagram source in <details>\n");
 	printf("  -q          -- don't copy non-diagram input to output\n");
 	printf("  -Q          -- remove all diagrams\n");
 	printf("  -N mod      -- only translate diagrams that have modifier mod\n");
+	printf("  -v          -- print timings and counts for each diagram to stderr\n");
+	printf("  -o file     -- write to file instead of stdout, replacing it only when done;\n");
+	printf("                 with files, write each to the same path under directory file\n");
+	printf("  -w file     -- read file instead of stdin, and process it again each time\n");
+	printf("                 it changes, rendering only changed diagrams (needs -o)\n");
+	printf("  -j threads  -- process files on this many threads, default: one per CPU;\n");
+	printf("                 under make -j, threads also need a job slot from make\n");
+	printf("  -x dir      -- also write each diagram with an @name modifier to dir/name.svg\n");
+	printf("  -A attrs    -- add attrs to <svg> tags in -x and -e files, default: the -a attrs\n");
+	printf("  -U          -- show repeats of a diagram with <use> instead of copying it\n");
+	printf("  -e dir      -- write each diagram to dir/hash.svg, named for its contents, and\n");
+	printf("                 output an <img> for it with its width and height\n");
+	printf("  -E prefix   -- src of -e images is prefix followed by the file name,\n");
+	printf("                 default: dir/\n");
 	printf("  -h          -- print this help\n");
 	printf("\n");
 	printf("Zero or more modifiers can follow the start delimiter. Unrecognized\n");
@@ -135,8 +668,21 @@ static int usage(const char *name, int rv, const char *msg)
 	printf("  details     -- if requoting, put source in a <details> element\n");
 	printf("  open        -- default <details> to visible/open\n");
 	printf("  svg-only    -- synonym for bare-svg (for compatibility with old documents)\n");
+	printf("  prelude     -- don't draw this diagram, add its macros and variables to the\n");
+	printf("                 prelude of all following diagrams\n");
 	printf("  x-current-color -- Experimental, use \"currentColor\" instead of \"rgb(0,0,0)\"\n");
 	printf("                     for black (0), to paint with the inherited foreground color.\n");
+	printf("  x-css-colors -- Experimental, follow the viewer's light or dark color scheme\n");
+	printf("                  using CSS custom properties and a prefers-color-scheme query.\n");
+	printf("  x-css-classes -- Experimental, share repeated styles through CSS classes\n");
+	printf("                   instead of an inline style on every element.\n");
+	printf("  x-arrow-markers -- Experimental, draw arrowheads with shared <marker> elements.\n");
+	printf("  x-symbols   -- Experimental, draw repeated shapes once in <defs> and place\n");
+	printf("                 each copy with <use>.\n");
+	printf("  x-compact   -- Experimental, make the SVG smaller with rounded numbers,\n");
+	printf("                 relative path commands, and less whitespace.\n");
+	printf("  x-png       -- Experimental, draw the diagram as an inline PNG <img> instead\n");
+	printf("                 of SVG, for mail and chat clients that cannot show SVG.\n");
 	printf("\n");
 	printf("Version: %s\n", PIKCHR_CMD_VERSION);
 	printf("\n");
@@ -144,95 +690,19 @@ static int usage(const char *name, int rv, const char *msg)
 	return rv;
 }
 
-int main(int argc, char **argv)
+// Translate the document read from in, writing the result to out. If cache isn't NULL,
+// diagrams and preludes found in it are reused instead of being rendered again.
+static int processDocument(FILE *in, const char *inName, FILE *out, cache_t *cache)
 {
-	int ch;
-	const char *svgClass = NULL;
-	const char *onlyModifier = NULL;
-	bool bareMode = false;
-	bool includeDocument = true;
-	bool includeDiagrams = true;
-	unsigned int plaintextErrors = 0;
-	unsigned int darkmode = 0;
-	unsigned int flags = 0;
-	bool requoteAllDiagrams = false;
-	bool detailsAllDiagrams = false;
 	int rv = 0;
 
-	while((ch = getopt(argc, argv, "c:a:s:S:bpdCRDqQN:h")) != -1)
-	{
-		switch(ch)
-		{
-		case 'c':
-			svgClass = optarg;
-			break;
-
-		case 'a':
-			svgAttrs = optarg;
-			break;
-
-		case 's':
-			summaryText = optarg;
-			break;
-
-		case 'S':
-			summaryAttrs = optarg;
-			break;
-
-		case 'b':
-			bareMode = true;
-			break;
-
-		case 'p':
-			plaintextErrors = PIKCHR_PLAINTEXT_ERRORS;
-			break;
-
-		case 'd':
-			darkmode |= PIKCHR_DARK_MODE;
-			break;
-
-		case 'C':
-			darkmode |= PIKCHR_CURRENTCOLOR_FOR_BLACK;
-			break;
-
-		case 'R':
-			requoteAllDiagrams = true;
-			break;
-
-		case 'D':
-			detailsAllDiagrams = true;
-			break;
-
-		case 'q':
-			includeDocument = false;
-			break;
-
-		case 'Q':
-			includeDiagrams = false;
-			break;
-
-		case 'N':
-			onlyModifier = optarg;
-			break;
-
-		case 'h':
-		default:
-			return usage(argv[0], 'h' != ch, NULL);
-		}
-	}
-
-	if(optind < argc)
-		return usage(argv[0], 1, "reads from stdin, writes to stdout");
-
-	flags = flags | plaintextErrors | darkmode;
-
-	regex_t startPattern;
-	regex_t endPattern;
-
-	if( regcomp(&startPattern, "^((\\.PS)|(((```+)|(~~~+))[[:space:]]*pikchr))([[:space:]].*)?$", REG_EXTENDED | REG_NOSUB)
-	 or regcomp(&endPattern, "^((\\.PE)|(```+)|(~~~+))[[:space:]]*$", REG_EXTENDED | REG_NOSUB)
-	)
-		abort();
+	// The prelude is the text of the -P file and of all prelude diagrams so far.
+	pikchr_prelude *prelude = basePrelude;
+	bool ownPrelude = false;
+	unsigned long preludeSerial = 0;
+	buffer_t preludeText;
+	bufferInit(&preludeText, basePreludeText.offset + 8192);
+	bufferAppend(&preludeText, basePreludeText.buf, basePreludeText.offset);
 
 	size_t linecapp = 8192;
 	char *line = (char *)malloc(linecapp);
@@ -241,22 +711,39 @@ int main(int argc, char **argv)
 	buffer_t accumulator;
 	bufferInit(&accumulator, 8192);
 
+	buffer_t key;
+	bufferInit(&key, 8192);
+
+	buffer_t targets;
+	bufferInit(&targets, 256);
+
+	// The diagrams given an id for -U so far, for referenceSeen().
+	buffer_t referenced;
+	bufferInit(&referenced, 256);
+
 	bool includeThisDiagram = false;
+	bool extractThisDiagram = false;
 	bool bareModeThisDiagram = false;
 	bool requoteThisDiagram = false;
 	bool includeDelimitersThisDiagram = false;
 	bool detailsThisDiagram = false;
 	bool detailsOpenThisDiagram = false;
+	bool pngThisDiagram = false;
+	bool preludeThisDiagram = false;
 	int flagsThisDiagram = flags;
 	size_t pikchrOffset = 0;
 
+	size_t lineNumber = 0;
+	size_t diagramLine = 0;
+
 	while(true)
 	{
-		ssize_t linelen = getline(&line, &linecapp, stdin);
+		ssize_t linelen = getline(&line, &linecapp, in);
+		lineNumber++;
 
-		if(ferror(stdin))
+		if(ferror(in))
 		{
-			perror("reading from stdin");
+			fprintf(stderr, "reading from %s: %s\n", inName, strerror(errno));
 			rv = 1;
 			break;
 		}
@@ -267,55 +754,198 @@ int main(int argc, char **argv)
 			{
 				accumulating = false;
 
-				if(includeThisDiagram)
+				if(preludeThisDiagram)
+				{
+					size_t preludeLength = preludeText.offset;
+					if(preludeLength and ('\n' != preludeText.buf[preludeLength - 1]))
+						bufferAppend(&preludeText, "\n", 1);
+					bufferAppend(&preludeText, accumulator.buf + pikchrOffset, accumulator.offset - pikchrOffset);
+
+					char *errors = NULL;
+					pikchr_prelude *newPrelude = NULL;
+					cacheEntry_t *entry = NULL;
+					if(cache)
+					{
+						bufferErase(&key);
+						bufferAppend(&key, "P\n", 2);
+						bufferAppend(&key, preludeText.buf, preludeText.offset);
+						entry = cacheFind(cache, key.buf, key.offset);
+					}
+					if(entry)
+					{
+						newPrelude = entry->prelude;
+						errors = entry->svg;
+					}
+					else
+					{
+						newPrelude = pikchr_prelude_new(preludeText.buf, plaintextErrors, &errors);
+						if(cache)
+							entry = cacheAdd(cache, key.buf, key.offset, errors, 0, 0, newPrelude);
+					}
+
+					if(newPrelude)
+					{
+						if(ownPrelude)
+							pikchr_prelude_free(prelude);
+						prelude = newPrelude;
+						ownPrelude = not entry;
+						preludeSerial = entry ? entry->serial : 0;
+					}
+					else
+					{
+						rv = 1;
+						if(errors)
+							fprintf(out, "%s\n\n", errors);
+						preludeText.offset = preludeLength;
+						preludeText.buf[preludeLength] = 0;
+					}
+					if(not entry)
+						free(errors);
+				}
+				else if(includeThisDiagram or extractThisDiagram)
 				{
 					int width = 0;
 					int height = 0;
+					char *svg = NULL;
+					const char *source = accumulator.buf + pikchrOffset;
+
+					cacheEntry_t *entry = NULL;
+					char header[64];
+					int len = snprintf(header, sizeof(header), "D %d %d %lu\n", flagsThisDiagram, pngThisDiagram, preludeSerial);
+					bufferErase(&key);
+					bufferAppend(&key, header, len);
+					bufferAppend(&key, (char *)source, accumulator.offset - pikchrOffset);
+					if(cache)
+						entry = cacheFind(cache, key.buf, key.offset);
 
-					char * svg = pikchr(accumulator.buf + pikchrOffset, svgClass, flagsThisDiagram, &width, &height);
-					if(svg)
+					if(entry)
 					{
-						if(width < 0)
-						{
-							rv = 1;
-							printf("%s\n\n", svg);
-						}
-						else
-						{
-							if(not bareModeThisDiagram)
-								printf("<div style=\"max-width:%dpx\">\n", width);
+						svg = entry->svg;
+						width = entry->width;
+						height = entry->height;
+						if(verbose)
+							fprintf(stderr, "%s%sline %zu: same as an earlier diagram, not rendered\n",
+								multipleFiles ? inName : "", multipleFiles ? " " : "", diagramLine);
+					}
+					else
+					{
+						pikchr_stats stats = {0};
+						double started = monotonicNow();
+						svg = pngThisDiagram
+							? pikchrPng(prelude, source, svgClass, flagsThisDiagram, &width, &height)
+							: verbose
+							? pikchr_stats_render(prelude, source, svgClass, flagsThisDiagram, &stats, &width, &height)
+							: pikchr_prelude_render(prelude, source, svgClass, flagsThisDiagram, &width, &height);
 
-							char *afterFirstElement = strstr(svg, "<svg");
-							if(afterFirstElement)
-								afterFirstElement = strchr(afterFirstElement, '>');
-							if(afterFirstElement)
+						if(verbose)
+						{
+							char label[4200];
+							if(multipleFiles)
+								snprintf(label, sizeof(label), "%s line %zu", inName, diagramLine);
+							else
+								snprintf(label, sizeof(label), "line %zu", diagramLine);
+							if(pngThisDiagram)
 							{
-								*afterFirstElement++ = 0;
-								printf("%s %s>%s", svg, svgAttrs, afterFirstElement);
+								// The PNG rasterizer isn't broken down; charge it all to rendering.
+								stats.rRender = monotonicNow() - started;
+								stats.nOut = svg ? strlen(svg) : 0;
 							}
-							else
-								printf("%s", svg); // will only happen if pikchr() doesn't answer a complete SVG element
-
-							if(not bareModeThisDiagram)
-								printf("</div>\n");
-							printf("\n");
-
-							if(includeDocument and requoteThisDiagram)
+							pthread_mutex_lock(&statsMutex);
+							statsPrint(label, &stats);
+							statsAdd(&statsAllDiagrams, &stats);
+							diagramCount++;
+							if(statsTotal(&stats) > slowestTime)
+							{
+								slowestTime = statsTotal(&stats);
+								slowestName = inName;
+								slowestLine = diagramLine;
+							}
+							pthread_mutex_unlock(&statsMutex);
+						}
+
+						if(cache and svg)
+							entry = cacheAdd(cache, key.buf, key.offset, svg, width, height, NULL);
+					}
+
+					if(svg and extractThisDiagram)
+					{
+						// An x-png diagram is rendered again as SVG for its files.
+						int svgWidth = width;
+						int svgHeight = height;
+						char *targetSvg = pngThisDiagram
+							? pikchr_prelude_render(prelude, source, svgClass, flagsThisDiagram, &svgWidth, &svgHeight)
+							: svg;
+
+						for(const char *name = targets.buf; name < targets.buf + targets.offset; name += strlen(name) + 1)
+						{
+							if(not targetSvg)
+								rv = 1;
+							else if(svgWidth < 0)
+							{
+								rv = 1;
+								fprintf(stderr, "%s line %zu: diagram has errors, @%s not written\n", inName, diagramLine, name);
+							}
+							else if(not writeTarget(name, targetSvg))
+								rv = 1;
+						}
+
+						if(targetSvg != svg)
+							free(targetSvg);
+					}
+
+					if(svg and includeThisDiagram)
+					{
+						if(width < 0)
+						{
+							rv = 1;
+							fprintf(out, "%s\n\n", svg);
+						}
+						else
+						{
+							if(not bareModeThisDiagram)
+								fprintf(out, "<div style=\"max-width:%dpx\">\n", width);
+
+							if(assetDir and not pngThisDiagram)
+							{
+								if(not printAsset(out, svg, width, height))
+									rv = 1;
+							}
+							else if(useReferences and not pngThisDiagram)
+							{
+								uint64_t hash = cacheHash(key.buf, key.offset);
+								char id[32];
+								snprintf(id, sizeof(id), "pikchr-%016llx", (unsigned long long)hash);
+
+								bool taken;
+								if(referenceSeen(&referenced, key.buf, key.offset, hash, &taken))
+									printSvgReference(out, svg, svgAttrs, id);
+								else
+									printSvg(out, svg, svgAttrs, taken ? NULL : id);
+							}
+							else
+								printSvg(out, svg, svgAttrs, NULL);
+
+							if(not bareModeThisDiagram)
+								fprintf(out, "</div>\n");
+							fprintf(out, "\n");
+
+							if(includeDocument and requoteThisDiagram)
 							{
 								if(detailsThisDiagram)
-									printf("<details markdown=\"1\"%s>\n\n<summary %s>%s</summary>\n\n", detailsOpenThisDiagram ? " open" : "", summaryAttrs, summaryText);
+									fprintf(out, "<details markdown=\"1\"%s>\n\n<summary %s>%s</summary>\n\n", detailsOpenThisDiagram ? " open" : "", summaryAttrs, summaryText);
 
-								printIndented(accumulator.buf);
+								printIndented(out, accumulator.buf);
 								if(includeDelimitersThisDiagram)
-									printf("    %s", line);
+									fprintf(out, "    %s", line);
 
 								if(detailsThisDiagram)
-									printf("\n</details>\n\n");
+									fprintf(out, "\n</details>\n\n");
 							}
 						}
+					}
 
+					if(not entry)
 						free(svg);
-					}
 				}
 				bufferErase(&accumulator);
 			}
@@ -330,29 +960,715 @@ int main(int argc, char **argv)
 			if(0 == regexec(&startPattern, line, 0, NULL, 0))
 			{
 				accumulating = true;
+				diagramLine = lineNumber;
 				bareModeThisDiagram = bareMode or strword(line, "bare-svg") or strword(line, "svg-only");
 				requoteThisDiagram = requoteAllDiagrams or strword(line, "requote");
 				includeDelimitersThisDiagram = strword(line, "delimiters") and requoteThisDiagram;
 				detailsThisDiagram = requoteThisDiagram and (detailsAllDiagrams or strword(line, "details"));
 				detailsOpenThisDiagram = detailsThisDiagram and strword(line, "open");
 				flagsThisDiagram = flags | (strword(line, "x-current-color") ? PIKCHR_CURRENTCOLOR_FOR_BLACK : 0);
+				flagsThisDiagram |= strword(line, "x-css-colors") ? PIKCHR_CSS_COLORS : 0;
+				flagsThisDiagram |= strword(line, "x-css-classes") ? PIKCHR_CSS_CLASSES : 0;
+				flagsThisDiagram |= strword(line, "x-arrow-markers") ? PIKCHR_ARROW_MARKERS : 0;
+				flagsThisDiagram |= strword(line, "x-symbols") ? PIKCHR_SYMBOLS : 0;
+				flagsThisDiagram |= strword(line, "x-compact") ? PIKCHR_COMPACT : 0;
+				pngThisDiagram = pngAllDiagrams or strword(line, "x-png");
+				preludeThisDiagram = strword(line, "prelude");
 				includeThisDiagram = includeDiagrams and (not onlyModifier or strword(line, onlyModifier));
+				if(extractDir)
+					collectTargets(&targets, line);
+				extractThisDiagram = extractDir and targets.offset and (not onlyModifier or strword(line, onlyModifier));
 
 				if(includeDelimitersThisDiagram)
 					bufferAppend(&accumulator, line, linelen);
 				pikchrOffset = accumulator.offset;
 			}
-			else if(includeDocument and (fwrite(line, linelen, 1, stdout) < 1))
+			else if(includeDocument and (fwrite(line, linelen, 1, out) < 1))
 			{
-				perror("writing to stdout");
 				rv = 1;
 				break;
 			}
 		}
 	}
 
+	if(ownPrelude)
+		pikchr_prelude_free(prelude);
+	bufferFree(&preludeText);
 	bufferFree(&accumulator);
+	bufferFree(&key);
+	bufferFree(&targets);
+	bufferFree(&referenced);
 	free(line);
 
 	return rv;
 }
+
+static void printStatsTotals(void)
+{
+	if(verbose and diagramCount)
+	{
+		char label[64];
+		snprintf(label, sizeof(label), "%lu diagram%s", diagramCount, 1 == diagramCount ? "" : "s");
+		statsPrint(label, &statsAllDiagrams);
+		if(multipleFiles)
+			fprintf(stderr, "slowest: %s line %zu, %.3f ms\n", slowestName, slowestLine, slowestTime * 1000.0);
+		else
+			fprintf(stderr, "slowest: line %zu, %.3f ms\n", slowestLine, slowestTime * 1000.0);
+	}
+
+	memset(&statsAllDiagrams, 0, sizeof(statsAllDiagrams));
+	diagramCount = 0;
+	slowestTime = -1.0;
+	slowestLine = 0;
+}
+
+// Process the file at inPath (stdin if NULL) into the file at outPath (stdout if NULL).
+// The output file is written under a temporary name and then renamed into place, so
+// that it's never seen half written.
+static int processPath(const char *inPath, const char *outPath, cache_t *cache)
+{
+	FILE *in = inPath ? fopen(inPath, "r") : stdin;
+	if(not in)
+	{
+		perror(inPath);
+		return 1;
+	}
+
+	FILE *out = stdout;
+	char tmpPath[4200];
+	if(outPath)
+	{
+		if(not makeTempPath(tmpPath, sizeof(tmpPath), outPath))
+		{
+			if(inPath)
+				fclose(in);
+			return 1;
+		}
+		if(not (out = fopen(tmpPath, "w")))
+		{
+			perror(tmpPath);
+			if(inPath)
+				fclose(in);
+			return 1;
+		}
+	}
+
+	int rv = processDocument(in, inPath ? inPath : "stdin", out, cache);
+	bool writeFailed = ferror(out);
+
+	if(inPath)
+		fclose(in);
+	if(outPath)
+	{
+		writeFailed = (0 != fclose(out)) or writeFailed;
+		if(writeFailed or (0 != rename(tmpPath, outPath)))
+		{
+			perror(writeFailed ? tmpPath : outPath);
+			remove(tmpPath);
+			rv = 1;
+		}
+	}
+	else if((0 != fflush(out)) or writeFailed)
+	{
+		perror("writing to stdout");
+		rv = 1;
+	}
+
+	return rv;
+}
+
+// Wait for changes to a file. The directory is watched rather than the file itself,
+// since many editors save by writing a new file and renaming it over the old one.
+typedef struct {
+	const char *path;
+	const char *name;
+	int fd;
+	struct stat last;
+} watcher_t;
+
+static bool watcherInit(watcher_t *watcher, const char *path)
+{
+	memset(watcher, 0, sizeof(*watcher));
+	watcher->path = path;
+	const char *slash = strrchr(path, '/');
+	watcher->name = slash ? slash + 1 : path;
+	watcher->fd = -1;
+#ifdef __linux__
+	char dir[4096];
+	if(not slash)
+		strcpy(dir, ".");
+	else if(slash == path)
+		strcpy(dir, "/");
+	else
+		snprintf(dir, sizeof(dir), "%.*s", (int)(slash - path), path);
+
+	watcher->fd = inotify_init1(IN_CLOEXEC);
+	if((watcher->fd < 0) or (inotify_add_watch(watcher->fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0))
+	{
+		perror(dir);
+		return false;
+	}
+#else
+	stat(path, &watcher->last);
+#endif
+	return true;
+}
+
+static bool watcherWait(watcher_t *watcher)
+{
+#ifdef __linux__
+	union {
+		struct inotify_event first;
+		char buf[4096];
+	} events;
+	while(true)
+	{
+		ssize_t len = read(watcher->fd, events.buf, sizeof(events.buf));
+		if(len <= 0)
+		{
+			if((len < 0) and (EINTR == errno))
+				continue;
+			perror("inotify");
+			return false;
+		}
+		for(char *cursor = events.buf; cursor < events.buf + len; )
+		{
+			struct inotify_event *event = (struct inotify_event *)cursor;
+			if(event->len and (0 == strcmp(event->name, watcher->name)))
+				return true;
+			cursor += sizeof(struct inotify_event) + event->len;
+		}
+	}
+#else
+	// No portable change notification; poll.
+	while(true)
+	{
+		struct stat now;
+		struct timespec interval = { 0, 50000000 };
+		nanosleep(&interval, NULL);
+		if((0 == stat(watcher->path, &now))
+		 and ((now.st_mtime != watcher->last.st_mtime) or (now.st_size != watcher->last.st_size) or (now.st_ino != watcher->last.st_ino)))
+		{
+			watcher->last = now;
+			return true;
+		}
+	}
+#endif
+}
+
+// Process inPath into outPath, and again whenever inPath changes. Only diagrams whose
+// source, modifiers, or prelude changed since the previous run are rendered again.
+static int watchDocument(const char *inPath, const char *outPath)
+{
+	watcher_t watcher;
+	if(not watcherInit(&watcher, inPath))
+		return 1;
+
+	cache_t cache;
+	cacheInit(&cache, SIZE_MAX);
+
+	do {
+		double started = monotonicNow();
+		cacheNewRun(&cache);
+		int rv = processPath(inPath, outPath, &cache);
+		printStatsTotals();
+		fprintf(stderr, "%s: %s, rendered %lu of %lu in %.1f ms\n", outPath, rv ? "errors" : "ok",
+			cache.misses, cache.hits + cache.misses, (monotonicNow() - started) * 1000.0);
+	} while(watcherWait(&watcher));
+
+	cacheFree(&cache);
+	if(watcher.fd >= 0)
+		close(watcher.fd);
+
+	return 1;
+}
+
+// Answer the path under outDir for the output of path, or NULL if path has a ".."
+// component. The directories of path are kept, so that inputs with the same name in
+// different directories don't collide.
+static char * outputPathFor(const char *outDir, const char *path)
+{
+	while(true)
+	{
+		if('/' == path[0])
+			path++;
+		else if(('.' == path[0]) and ('/' == path[1]))
+			path += 2;
+		else
+			break;
+	}
+
+	for(const char *cursor = path; cursor; cursor = strchr(cursor, '/'))
+	{
+		if('/' == *cursor)
+			cursor++;
+		if(('.' == cursor[0]) and ('.' == cursor[1]) and (('/' == cursor[2]) or (0 == cursor[2])))
+			return NULL;
+	}
+
+	size_t len = strlen(outDir) + strlen(path) + 2;
+	char *rv = (char *)malloc(len);
+	if(rv)
+		snprintf(rv, len, "%s/%s", outDir, path);
+	return rv;
+}
+
+// Create the directories leading to path, if they don't already exist.
+static bool makeParentDirectories(char *path)
+{
+	for(char *slash = strchr(path + 1, '/'); slash; slash = strchr(slash + 1, '/'))
+	{
+		*slash = 0;
+		bool ok = (0 == mkdir(path, 0777)) or (EEXIST == errno);
+		if(not ok)
+			perror(path);
+		*slash = '/';
+		if(not ok)
+			return false;
+	}
+
+	return true;
+}
+
+// Process one input file into its place under outDir.
+static int processFileInto(const char *path, const char *outDir, cache_t *cache)
+{
+	char *outPath = outputPathFor(outDir, path);
+	if(not outPath)
+	{
+		fprintf(stderr, "%s: can't place a path with \"..\" under %s\n", path, outDir);
+		return 1;
+	}
+
+	struct stat inStat;
+	struct stat outStat;
+	int rv = 1;
+	if((0 == stat(path, &inStat)) and (0 == stat(outPath, &outStat))
+	 and (inStat.st_dev == outStat.st_dev) and (inStat.st_ino == outStat.st_ino))
+		fprintf(stderr, "%s: output would replace the input\n", path);
+	else if(makeParentDirectories(outPath))
+		rv = processPath(path, outPath, cache);
+
+	free(outPath);
+	return rv;
+}
+
+// GNU make's jobserver, when running under make -j. A token must be read from it for
+// each thread beyond the first, and written back when that thread is done.
+typedef struct {
+	bool    active;
+	bool    nonBlocking;    // readFd is our own, and doesn't block
+	int     readFd;
+	int     writeFd;
+} jobserver_t;
+
+// Find the jobserver in MAKEFLAGS. Answers false if make runs jobs in parallel but
+// didn't give this command the jobserver (it's not marked with "+" in the makefile),
+// in which case only one thread may be used.
+static bool jobserverOpen(jobserver_t *jobserver)
+{
+	memset(jobserver, 0, sizeof(*jobserver));
+	jobserver->readFd = jobserver->writeFd = -1;
+
+	const char *makeflags = getenv("MAKEFLAGS");
+	if(not makeflags)
+		return true;
+
+	// The last one wins, as it does for make.
+	const char *auth = NULL;
+	for(const char *cursor = makeflags; (cursor = strstr(cursor, "--jobserver-")); cursor++)
+	{
+		if(0 == strncmp(cursor, "--jobserver-auth=", 17))
+			auth = cursor + 17;
+		else if(0 == strncmp(cursor, "--jobserver-fds=", 16))
+			auth = cursor + 16;
+	}
+	if(not auth)
+		return true;
+
+	if(0 == strncmp(auth, "fifo:", 5))
+	{
+		char path[4096];
+		size_t len = strcspn(auth + 5, " \t");
+		if(len >= sizeof(path))
+			return false;
+		memcpy(path, auth + 5, len);
+		path[len] = 0;
+		jobserver->readFd = jobserver->writeFd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+		jobserver->nonBlocking = true;
+	}
+	else if(2 != sscanf(auth, "%d,%d", &jobserver->readFd, &jobserver->writeFd))
+		return false;
+
+	if((jobserver->readFd < 0) or (fcntl(jobserver->readFd, F_GETFD) < 0) or (fcntl(jobserver->writeFd, F_GETFD) < 0))
+		return false;
+
+	jobserver->active = true;
+	return true;
+}
+
+// Take a token if one is free, without waiting for one.
+static bool jobserverTryAcquire(jobserver_t *jobserver, char *token)
+{
+	while(true)
+	{
+		if(not jobserver->nonBlocking)
+		{
+			// The pipe is shared with make and its other jobs, so it can't be made
+			// nonblocking. If another job takes the token between the poll() and the
+			// read(), the read() waits for the next one, which some job will give back.
+			struct pollfd pfd = { .fd = jobserver->readFd, .events = POLLIN };
+			if(poll(&pfd, 1, 0) <= 0)
+				return false;
+		}
+
+		ssize_t rv = read(jobserver->readFd, token, 1);
+		if(1 == rv)
+			return true;
+		if((rv < 0) and (EINTR == errno))
+			continue;
+		return false;
+	}
+}
+
+static void jobserverRelease(jobserver_t *jobserver, char token)
+{
+	while((write(jobserver->writeFd, &token, 1) < 0) and (EINTR == errno))
+		;
+}
+
+static void jobserverClose(jobserver_t *jobserver)
+{
+	if(jobserver->nonBlocking and (jobserver->readFd >= 0))
+		close(jobserver->readFd);
+	jobserver->active = false;
+}
+
+// Input files shared by the threads of processFiles().
+typedef struct {
+	pthread_mutex_t mutex;
+	char **paths;
+	int count;
+	int next;
+	const char *outDir;
+	cache_t *cache;
+	jobserver_t *jobserver;
+	int rv;
+} fileQueue_t;
+
+// A thread of processFiles() beyond the first, and the jobserver token it holds.
+typedef struct {
+	fileQueue_t *queue;
+	pthread_t thread;
+	char token;
+} fileThread_t;
+
+static bool filesRemain(fileQueue_t *queue)
+{
+	pthread_mutex_lock(&queue->mutex);
+	bool rv = queue->next < queue->count;
+	pthread_mutex_unlock(&queue->mutex);
+	return rv;
+}
+
+// Process the next file of the queue. Answers false if there are none left.
+static bool processNextFile(fileQueue_t *queue)
+{
+	pthread_mutex_lock(&queue->mutex);
+	int index = queue->next++;
+	pthread_mutex_unlock(&queue->mutex);
+	if(index >= queue->count)
+		return false;
+
+	int rv = processFileInto(queue->paths[index], queue->outDir, queue->cache);
+
+	pthread_mutex_lock(&queue->mutex);
+	queue->rv |= rv;
+	pthread_mutex_unlock(&queue->mutex);
+
+	return true;
+}
+
+static void * fileWorker(void *arg)
+{
+	fileThread_t *fileThread = (fileThread_t *)arg;
+	while(processNextFile(fileThread->queue))
+		;
+	if(fileThread->queue->jobserver->active)
+		jobserverRelease(fileThread->queue->jobserver, fileThread->token);
+
+	return NULL;
+}
+
+// Process many files into outDir on up to numThreads threads, sharing one cache so
+// that a diagram that appears in several files (with the same prelude) is rendered
+// once. Under make -j, a thread beyond the first is only started with a token from
+// make's jobserver, checking for free tokens again between files.
+static int processFiles(char **paths, int count, const char *outDir, int numThreads, jobserver_t *jobserver)
+{
+	cache_t cache;
+	cacheInit(&cache, 64 * 1024 * 1024);
+
+	fileQueue_t queue = { .paths = paths, .count = count, .outDir = outDir, .cache = &cache, .jobserver = jobserver };
+	pthread_mutex_init(&queue.mutex, NULL);
+
+	if(numThreads > count)
+		numThreads = count;
+	if(numThreads > 1)
+		pikchr_limit(PIKCHR_LIMIT_RENDER_THREADS, 1); // the files already keep every thread busy
+
+	fileThread_t *threads = (fileThread_t *)calloc(numThreads, sizeof(fileThread_t));
+	int started = 0;
+	bool canStart = threads != NULL;
+	do {
+		while(canStart and (started + 1 < numThreads) and filesRemain(&queue))
+		{
+			fileThread_t *fileThread = &threads[started];
+			fileThread->queue = &queue;
+			if(jobserver->active and not jobserverTryAcquire(jobserver, &fileThread->token))
+				break;
+			if(0 != pthread_create(&fileThread->thread, NULL, fileWorker, fileThread))
+			{
+				if(jobserver->active)
+					jobserverRelease(jobserver, fileThread->token);
+				canStart = false;
+				break;
+			}
+			started++;
+		}
+	} while(processNextFile(&queue));
+
+	for(int i = 0; i < started; i++)
+		pthread_join(threads[i].thread, NULL);
+	free(threads);
+
+	pthread_mutex_destroy(&queue.mutex);
+	cacheFree(&cache);
+
+	return queue.rv;
+}
+
+int main(int argc, char **argv)
+{
+	int ch;
+	unsigned int darkmode = 0;
+	const char *preludeFile = NULL;
+	const char *watchPath = NULL;
+	const char *outputPath = NULL;
+	long numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+	int rv = 0;
+
+	while((ch = getopt(argc, argv, "c:a:s:S:bpdCtkmuzZ:gP:RDqQN:vw:o:j:x:A:Ue:E:h")) != -1)
+	{
+		switch(ch)
+		{
+		case 'c':
+			svgClass = optarg;
+			break;
+
+		case 'a':
+			svgAttrs = optarg;
+			break;
+
+		case 's':
+			summaryText = optarg;
+			break;
+
+		case 'S':
+			summaryAttrs = optarg;
+			break;
+
+		case 'b':
+			bareMode = true;
+			break;
+
+		case 'p':
+			plaintextErrors = PIKCHR_PLAINTEXT_ERRORS;
+			break;
+
+		case 'd':
+			darkmode |= PIKCHR_DARK_MODE;
+			break;
+
+		case 'C':
+			darkmode |= PIKCHR_CURRENTCOLOR_FOR_BLACK;
+			break;
+
+		case 't':
+			darkmode |= PIKCHR_CSS_COLORS;
+			break;
+
+		case 'k':
+			flags |= PIKCHR_CSS_CLASSES;
+			break;
+
+		case 'm':
+			flags |= PIKCHR_ARROW_MARKERS;
+			break;
+
+		case 'u':
+			flags |= PIKCHR_SYMBOLS;
+			break;
+
+		case 'z':
+			flags |= PIKCHR_COMPACT;
+			break;
+
+		case 'Z':
+			if((optarg[0] < '0') or (optarg[0] > '6') or optarg[1])
+				return usage(argv[0], 1, "-Z takes a number of decimal places from 0 to 6");
+			flags |= PIKCHR_COMPACT_DECIMALS(optarg[0] - '0');
+			break;
+
+		case 'g':
+			pngAllDiagrams = true;
+			break;
+
+		case 'P':
+			preludeFile = optarg;
+			break;
+
+		case 'R':
+			requoteAllDiagrams = true;
+			break;
+
+		case 'D':
+			detailsAllDiagrams = true;
+			break;
+
+		case 'q':
+			includeDocument = false;
+			break;
+
+		case 'Q':
+			includeDiagrams = false;
+			break;
+
+		case 'N':
+			onlyModifier = optarg;
+			break;
+
+		case 'v':
+			verbose = true;
+			break;
+
+		case 'w':
+			watchPath = optarg;
+			break;
+
+		case 'o':
+			outputPath = optarg;
+			break;
+
+		case 'x':
+			extractDir = optarg;
+			break;
+
+		case 'A':
+			extractAttrs = optarg;
+			break;
+
+		case 'U':
+			useReferences = true;
+			break;
+
+		case 'e':
+			assetDir = optarg;
+			break;
+
+		case 'E':
+			assetPrefix = optarg;
+			break;
+
+		case 'j':
+			numThreads = atol(optarg);
+			if(numThreads < 1)
+				return usage(argv[0], 1, "-j takes a number of threads");
+			break;
+
+		case 'h':
+		default:
+			return usage(argv[0], 'h' != ch, NULL);
+		}
+	}
+
+	if((optind < argc) and (watchPath or not outputPath))
+		return usage(argv[0], 1, "files need -o outdir, and can't be used with -w");
+	if(watchPath and not outputPath)
+		return usage(argv[0], 1, "-w needs -o");
+	if(numThreads < 1)
+		numThreads = 1;
+	multipleFiles = optind < argc;
+
+	flags = flags | plaintextErrors | darkmode;
+
+	// Render large diagrams on one thread per CPU, except with -j 1 or under make -j,
+	// where make decides how many jobs run at once. Pikchr's own threads for large
+	// diagrams can't take jobserver tokens.
+	jobserver_t jobserver;
+	if(not jobserverOpen(&jobserver))
+		numThreads = 1;
+	if(not jobserver.active and (numThreads > 1))
+		pikchr_limit(PIKCHR_LIMIT_RENDER_THREADS, 0);
+	if(not extractAttrs)
+		extractAttrs = svgAttrs;
+
+	char defaultAssetPrefix[4096];
+	if(assetDir and not assetPrefix)
+	{
+		snprintf(defaultAssetPrefix, sizeof(defaultAssetPrefix), "%s/", assetDir);
+		assetPrefix = defaultAssetPrefix;
+	}
+
+	bufferInit(&basePreludeText, 8192);
+
+	if(preludeFile)
+	{
+		if(not bufferAppendFile(&basePreludeText, preludeFile))
+		{
+			perror(preludeFile);
+			bufferFree(&basePreludeText);
+			return 1;
+		}
+
+		char *errors = NULL;
+		basePrelude = pikchr_prelude_new(basePreludeText.buf, PIKCHR_PLAINTEXT_ERRORS, &errors);
+		if(not basePrelude)
+		{
+			fprintf(stderr, "%s:\n%s\n", preludeFile, errors ? errors : "out of memory");
+			free(errors);
+			bufferFree(&basePreludeText);
+			return 1;
+		}
+	}
+
+	if( regcomp(&startPattern, "^((\\.PS)|(((```+)|(~~~+))[[:space:]]*pikchr))([[:space:]].*)?$", REG_EXTENDED | REG_NOSUB)
+	 or regcomp(&endPattern, "^((\\.PE)|(```+)|(~~~+))[[:space:]]*$", REG_EXTENDED | REG_NOSUB)
+	)
+		abort();
+
+	if(watchPath)
+		rv = watchDocument(watchPath, outputPath);
+	else if(multipleFiles)
+	{
+		rv = processFiles(argv + optind, argc - optind, outputPath, numThreads > 256 ? 256 : (int)numThreads, &jobserver);
+		printStatsTotals();
+	}
+	else
+	{
+		// Repeats of a diagram in the document are rendered once.
+		cache_t cache;
+		cacheInit(&cache, 64 * 1024 * 1024);
+		rv = processPath(NULL, outputPath, &cache);
+		cacheFree(&cache);
+		printStatsTotals();
+	}
+
+	jobserverClose(&jobserver);
+	regfree(&startPattern);
+	regfree(&endPattern);
+	pikchr_prelude_free(basePrelude);
+	bufferFree(&basePreludeText);
+
+	return rv;
+}
@@ -162,6 +162,22 @@
 #include <ctype.h>
 #include <math.h>
 #include <assert.h>
+#include <float.h>
+#include <time.h>
+/* Threads are only used where POSIX threads can be expected.  Elsewhere,
+** or with -DPIKCHR_NO_THREADS, all work is done on the calling thread.
+*/
+#if !defined(PIKCHR_NO_THREADS) && !defined(__unix__) && !defined(__APPLE__)
+# define PIKCHR_NO_THREADS 1
+#endif
+#ifndef PIKCHR_NO_THREADS
+# include <pthread.h>
+# include <unistd.h>
+#endif
+#if !defined(PIKCHR_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64))
+# include <emmintrin.h>
+# define PIK_SSE2 1   /* Use SSE2 for bounding boxes */
+#endif
 #define count(X) (sizeof(X)/sizeof(X[0]))
 #ifndef M_PI
 # define M_PI 3.1415926535897932385
@@ -178,6 +194,10 @@
 #define IsSpace(X)  isspace((unsigned char)(X))
 #define IsAlnum(X)  isalnum((unsigned char)(X))
 
+/* True if pointer z is within the N bytes at zBuf[], or just past the end */
+#define PIK_WITHIN(z,zBuf,N) \
+   ((size_t)(z) - (size_t)(zBuf) <= (size_t)(N))
+
 
 /* Limit the number of tokens in a single script to avoid run-away
 ** macro expansion attacks.  See forum post
@@ -187,6 +207,27 @@
 # define PIKCHR_TOKEN_LIMIT 100000
 #endif
 
+/* The parser stack starts out small and grows on demand, up to this
+** many entries.  Deeply nested [...] blocks and expressions need more
+** stack.  The limit can be changed at run-time using pikchr_limit().
+*/
+#ifndef PIKCHR_STACK_LIMIT
+# define PIKCHR_STACK_LIMIT 10000
+#endif
+
+/* Lists of at least this many objects are rendered on several threads
+** at once, and lists of four times as many have their bounding box
+** computed that way.  Shorter lists are not worth the thread startup.
+*/
+#ifndef PIKCHR_PARALLEL_MIN
+# define PIKCHR_PARALLEL_MIN 1000
+#endif
+
+/* Limit codes for pikchr_limit().  These must match pikchr.h */
+#define PIKCHR_LIMIT_STACK_DEPTH  0
+#define PIKCHR_LIMIT_RENDER_THREADS 1
+int pikchr_limit(int eLimit, int iNewVal);
+
 
 /* Tag intentionally unused parameters with this macro to prevent
 ** compiler warnings with -Wextra */
@@ -196,6 +237,7 @@ typedef struct Pik Pik;          /* Complete parsing context */
 typedef struct PToken PToken;    /* A single token */
 typedef struct PObj PObj;        /* A single diagram object */
 typedef struct PList PList;      /* A list of diagram objects */
+typedef struct PObjBlock PObjBlock;  /* Storage for many objects */
 typedef struct PClass PClass;    /* Description of statements types */
 typedef double PNum;             /* Numeric value */
 typedef struct PRel PRel;        /* Absolute or percentage value */
@@ -203,6 +245,16 @@ typedef struct PPoint PPoint;    /* A position in 2-D space */
 typedef struct PVar PVar;        /* script-defined variable */
 typedef struct PBox PBox;        /* A bounding box */
 typedef struct PMacro PMacro;    /* A "define" macro */
+typedef struct PShared PShared;  /* Markup shared by reference */
+typedef struct pikchr_layout pikchr_layout;  /* A diagram ready to render */
+typedef struct pikchr_session pikchr_session;  /* Incremental re-rendering */
+typedef struct pikchr_prelude pikchr_prelude;  /* Shared macros and variables */
+typedef struct pikchr_stats pikchr_stats;      /* Timings and counters */
+typedef struct pikchr_job pikchr_job;          /* One script for pikchr_batch */
+typedef struct pikchr_result pikchr_result;    /* Output of one batch job */
+typedef struct pikchr_allocator pikchr_allocator;  /* Memory allocator */
+typedef struct PBatch PBatch;    /* State of one call to pikchr_batch() */
+typedef struct PBatchRun PBatchRun;  /* Jobs queued for one batch thread */
 
 /* Compass points */
 #define CP_N      1
@@ -350,40 +402,59 @@ static int pik_token_eq(PToken *pToken, const char *z){
 #define A_FIT           0x1000
 
 
-/* A single graphics object */
+/* A single graphics object.
+**
+** The fields that the bounding box pass reads for every object come
+** first, so that they share one cache line, followed by the rest of the
+** geometry and style used when rendering.  Fields used only while the
+** script is parsed and laid out, and the text, are at the end.
+*/
 struct PObj {
   const PClass *type;      /* Object type or class */
-  PToken errTok;           /* Reference token for error messages */
-  PPoint ptAt;             /* Reference point for the object */
-  PPoint ptEnter, ptExit;  /* Entry and exit points */
+  PBox bbox;               /* Bounding box */
+  PNum sw;                 /* "thickness" property. (Mnemonic: "stroke width")*/
   PList *pSublist;         /* Substructure for [...] objects */
-  char *zName;             /* Name assigned to this statement */
+  int nPath;               /* Number of path points */
+  unsigned char nTxt;      /* Number of text values */
+  char larrow;             /* Arrow at beginning (<- or <->) */
+  char rarrow;             /* Arrow at end  (-> or <->) */
+  char bClose;             /* True if "close" is seen */
+  PPoint *aPath;           /* Array of path points */
+  PPoint ptAt;             /* Reference point for the object */
   PNum w;                  /* "width" property */
   PNum h;                  /* "height" property */
   PNum rad;                /* "radius" property */
-  PNum sw;                 /* "thickness" property. (Mnemonic: "stroke width")*/
   PNum dotted;             /* "dotted" property.   <=0.0 for off */
   PNum dashed;             /* "dashed" property.   <=0.0 for off */
   PNum fill;               /* "fill" property.  Negative for off */
   PNum color;              /* "color" property */
-  PPoint with;             /* Position constraint from WITH clause */
-  char eWith;              /* Type of heading point on WITH clause */
+  int iLayer;              /* Rendering order */
   char cw;                 /* True for clockwise arc */
-  char larrow;             /* Arrow at beginning (<- or <->) */
-  char rarrow;             /* Arrow at end  (-> or <->) */
-  char bClose;             /* True if "close" is seen */
   char bChop;              /* True if "chop" is seen */
-  char bAltAutoFit;        /* Always send both h and w into xFit() */        
-  unsigned char nTxt;      /* Number of text values */
+  char eWith;              /* Type of heading point on WITH clause */
+  char bAltAutoFit;        /* Always send both h and w into xFit() */
   unsigned mProp;          /* Masks of properties set so far */
   unsigned mCalc;          /* Values computed from other constraints */
-  PToken aTxt[5];          /* Text with .eCode holding TP flags */
-  int iLayer;              /* Rendering order */
   int inDir, outDir;       /* Entry and exit directions */
-  int nPath;               /* Number of path points */
-  PPoint *aPath;           /* Array of path points */
+  PPoint ptEnter, ptExit;  /* Entry and exit points */
+  PPoint with;             /* Position constraint from WITH clause */
   PObj *pFrom, *pTo;       /* End-point objects of a path */
-  PBox bbox;               /* Bounding box */
+  char *zName;             /* Name assigned to this statement */
+  PObjBlock *pBlock;       /* The block that holds this object */
+  PToken errTok;           /* Reference token for error messages */
+  PToken aTxt[5];          /* Text with .eCode holding TP flags */
+};
+
+/* Objects are carved out of blocks in the order they are created, so
+** that the objects of a list lie next to each other in memory.  A block
+** is freed when all of its objects have been freed and no new objects
+** can come from it.
+*/
+#define PIK_OBJ_BLOCK 32
+struct PObjBlock {
+  int nUsed;               /* Objects handed out from a[] so far */
+  int nRef;                /* Live objects, plus 1 while open */
+  PObj a[PIK_OBJ_BLOCK];   /* The objects */
 };
 
 /* A list of graphics objects */
@@ -401,6 +472,167 @@ struct PMacro {
   int inUse;           /* Do not allow recursion */
 };
 
+/* Markup that is written once and then referenced by name: a CSS class
+** for PIKCHR_CSS_CLASSES, an arrowhead marker for PIKCHR_ARROW_MARKERS,
+** or a symbol for PIKCHR_SYMBOLS */
+struct PShared {
+  unsigned long long h;      /* Hash of zDecl.  Names classes and markers */
+  char *zDecl;               /* CSS declarations, marker, or symbol key */
+  int nRef;                  /* Number of references.  Symbols only */
+  char *zBody;               /* Markup for a symbol, or NULL if not known */
+  unsigned long long hBody;  /* Hash of zDecl then zBody.  Names the symbol */
+};
+
+/* A memory allocator for pikchr_use_allocator().
+** This must be the same as the definition in pikchr.h.
+*/
+struct pikchr_allocator {
+  void *(*xMalloc)(void *pCtx, size_t nByte);
+  void *(*xRealloc)(void *pCtx, void *pOld, size_t nByte);
+  void (*xFree)(void *pCtx, void *pOld);
+  void *pCtx;              /* First argument to each of the above */
+};
+
+/* The allocator in use by the current thread, or NULL for malloc() */
+#ifdef PIKCHR_NO_THREADS
+# define PIK_THREAD_LOCAL
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__>=201112L
+# define PIK_THREAD_LOCAL _Thread_local
+#else
+# define PIK_THREAD_LOCAL __thread
+#endif
+static PIK_THREAD_LOCAL const pikchr_allocator *pik_pAlloc = 0;
+
+#ifndef PIKCHR_NO_THREADS
+/* True on threads that must not start more threads of their own */
+static PIK_THREAD_LOCAL int pik_bNoThreads = 0;
+#endif
+
+/*
+** All memory is obtained and released through these routines, so that
+** it comes from the allocator of the calling thread.
+*/
+static void *pik_malloc(size_t n){
+  return pik_pAlloc ? pik_pAlloc->xMalloc(pik_pAlloc->pCtx, n) : malloc(n);
+}
+static void *pik_realloc(void *pOld, size_t n){
+  if( pik_pAlloc ) return pik_pAlloc->xRealloc(pik_pAlloc->pCtx, pOld, n);
+  return realloc(pOld, n);
+}
+static void pik_free(void *pOld){
+  if( pOld==0 ) return;
+  if( pik_pAlloc ){
+    pik_pAlloc->xFree(pik_pAlloc->pCtx, pOld);
+  }else{
+    free(pOld);
+  }
+}
+static void *pik_calloc(size_t n, size_t sz){
+  void *pNew;
+  if( sz && n>((size_t)-1)/sz ) return 0;
+  pNew = pik_malloc(n*sz);
+  if( pNew ) memset(pNew, 0, n*sz);
+  return pNew;
+}
+
+#ifndef PIKCHR_NO_THREADS
+/* Number of online CPUs */
+static int pik_cpu_count(void){
+  long nCpu = sysconf(_SC_NPROCESSORS_ONLN);
+  return nCpu>0 && nCpu<1000 ? (int)nCpu : 1;
+}
+
+/* State shared by the threads of pik_parallel() */
+typedef struct PParallel PParallel;
+struct PParallel {
+  pthread_mutex_t mutex;       /* Guards iNext */
+  int iNext;                   /* Next task to run */
+  int nTask;                   /* Number of tasks */
+  void (*xTask)(void*,int);    /* Run one task */
+  void *pArg;                  /* First argument to xTask */
+};
+
+/* The body of each thread of pik_parallel().  Run tasks until none
+** are left.
+*/
+static void *pik_parallel_worker(void *pArg){
+  PParallel *pPar = (PParallel*)pArg;
+  int bOld = pik_bNoThreads;
+  pik_bNoThreads = 1;
+  for(;;){
+    int i;
+    pthread_mutex_lock(&pPar->mutex);
+    i = pPar->iNext++;
+    pthread_mutex_unlock(&pPar->mutex);
+    if( i>=pPar->nTask ) break;
+    pPar->xTask(pPar->pArg, i);
+  }
+  pik_bNoThreads = bOld;
+  return 0;
+}
+
+/*
+** Run xTask(pArg,i) for every i from 0 to nTask-1, using up to nThread
+** threads including the calling thread.  Tasks run in no particular
+** order.  Tasks cannot start threads of their own.
+*/
+static void pik_parallel(
+  int nTask,                   /* Number of tasks */
+  int nThread,                 /* Most threads to use */
+  void (*xTask)(void*,int),    /* Run one task */
+  void *pArg                   /* First argument to xTask */
+){
+  PParallel par;
+  pthread_t aThread[64];
+  char aLive[64];
+  int k;
+  if( nThread>(int)count(aThread) ) nThread = (int)count(aThread);
+  if( nThread>nTask ) nThread = nTask;
+  pthread_mutex_init(&par.mutex, 0);
+  par.iNext = 0;
+  par.nTask = nTask;
+  par.xTask = xTask;
+  par.pArg = pArg;
+  for(k=1; k<nThread; k++){
+    aLive[k] = pthread_create(&aThread[k], 0, pik_parallel_worker, &par)==0;
+  }
+  pik_parallel_worker(&par);
+  for(k=1; k<nThread; k++){
+    if( aLive[k] ) pthread_join(aThread[k], 0);
+  }
+  pthread_mutex_destroy(&par.mutex);
+}
+
+/*
+** Number of threads to use for one step of rendering: the value of
+** PIKCHR_LIMIT_RENDER_THREADS, or one per online CPU if that is zero.
+** Other threads use malloc(), so with a custom allocator this is 1.
+*/
+static int pik_render_threads(void){
+  int n;
+  if( pik_bNoThreads || pik_pAlloc ) return 1;
+  n = pikchr_limit(PIKCHR_LIMIT_RENDER_THREADS, -1);
+  return n>0 ? n : pik_cpu_count();
+}
+#endif /* PIKCHR_NO_THREADS */
+
+/* Timings and counters from pikchr_stats_render().  Times are in seconds.
+** This must be the same as the definition in pikchr.h.
+*/
+struct pikchr_stats {
+  double rTokenize;        /* Splitting the input into tokens */
+  double rParse;           /* Parser actions, other than layout */
+  double rLayout;          /* Sizing and placing each object */
+  double rBbox;            /* Computing the bounding box of the diagram */
+  double rRender;          /* Writing the SVG */
+  unsigned int nToken;     /* Tokens sent to the parser */
+  unsigned int nObj;       /* Objects created, including inside [...] */
+  unsigned int nMacro;     /* Macro expansions */
+  unsigned int nVarLookup; /* Lookups of variables by name */
+  size_t nOut;             /* Bytes of output */
+  size_t nPeakEst;         /* Estimate of the most bytes held at once */
+};
+
 /* Each call to the pikchr() subroutine uses an instance of the following
 ** object to pass around context to all of its subroutines.
 */
@@ -408,6 +640,7 @@ struct Pik {
   unsigned nErr;           /* Number of errors seen */
   unsigned nToken;         /* Number of tokens parsed */
   PToken sIn;              /* Input Pikchr-language text */
+  PToken sPrelude;         /* Text of the prelude, if any */
   char *zOut;              /* Result accumulates here */
   unsigned int nOut;       /* Bytes written to zOut[] so far */
   unsigned int nOutAlloc;  /* Space allocated to zOut[] */
@@ -426,6 +659,7 @@ struct Pik {
   PNum charHeight;             /* Character height */
   PNum wArrow;                 /* Width of arrowhead at the fat end */
   PNum hArrow;                 /* Ht of arrowhead - dist from tip to fat end */
+  PNum rSimplify;              /* Polyline simplification tolerance */
   char bLayoutVars;            /* True if cache is valid */
   char thenFlag;           /* True if "then" seen */
   char samePath;           /* aTPath copied by "same" */
@@ -441,8 +675,52 @@ struct Pik {
   /* Error contexts */
   unsigned int nCtx;       /* Number of error contexts */
   PToken aCtx[10];         /* Nested error contexts */
+  /* State for output that is collected while rendering and then
+  ** emitted at the top of the <svg>, just after the start tag */
+  unsigned int iHead;      /* Offset in zOut just past the <svg> start tag */
+  int nClr;                /* Number of entries in aClr[] */
+  int nClrAlloc;           /* Slots allocated for aClr[] */
+  int *aClr;               /* Colors given as CSS custom properties */
+  int nStyle;              /* Number of entries in aStyle[] */
+  int nStyleAlloc;         /* Slots allocated for aStyle[] */
+  PShared *aStyle;          /* Styles shared through CSS classes */
+  int nMarker;             /* Number of entries in aMarker[] */
+  int nMarkerAlloc;        /* Slots allocated for aMarker[] */
+  PShared *aMarker;         /* Arrowhead markers */
+  int iMarkStart;          /* 1 + aMarker[] index for the next line start */
+  int iMarkEnd;            /* 1 + aMarker[] index for the next line end */
+  /* Pen state for PIKCHR_COMPACT path data */
+  char bInPath;            /* Writing the d="..." of a <path> */
+  char bQCtrl;             /* Just wrote the control point of a "q" */
+  char cLastCmd;           /* The last path command letter written */
+  long long aPen[2];       /* Current point, in units of 10**-decimals px */
+  int nSym;                /* Number of entries in aSym[] */
+  int nSymAlloc;           /* Slots allocated for aSym[] */
+  PShared *aSym;           /* Symbols for repeated objects */
+  char bKeyRange;          /* A symbol key had a distance out of range */
+  /* Layout capture for pikchr_layout_new() */
+  char bKeepList;          /* Keep the object list rather than render it */
+  PList *pKeep;            /* The kept object list */
+  PObjBlock *pOpen;        /* Block from which new objects are taken */
+  /* Checkpoints for pikchr_session_render() */
+  pikchr_session *pSession; /* Record checkpoints here, if not NULL */
+  PList *pResume;          /* Prior objects to resume appending to */
+  int nBracket;            /* Depth of [...] nesting */
+  unsigned int nEdit;      /* Changes to variables or macros */
+  /* Statistics for pikchr_stats_render() */
+  pikchr_stats *pStats;    /* Collect statistics here, if not NULL */
+  int ePhase;              /* The PIK_PHASE_* being timed */
+  PNum rMark;              /* Time when ePhase started */
 };
 
+/* The phases of processing timed for pikchr_stats */
+#define PIK_PHASE_NONE      0
+#define PIK_PHASE_TOKENIZE  1    /* pik_tokenize() */
+#define PIK_PHASE_PARSE     2    /* Parser actions */
+#define PIK_PHASE_LAYOUT    3    /* pik_after_adding_attributes() */
+#define PIK_PHASE_BBOX      4    /* pik_render_bbox() */
+#define PIK_PHASE_RENDER    5    /* pik_render_svg() */
+
 /* Include PIKCHR_PLAINTEXT_ERRORS among the bits of mFlags on the 3rd
 ** argument to pikchr() in order to cause error message text to come out
 ** as text/plain instead of as text/html
@@ -459,6 +737,46 @@ struct Pik {
 */
 #define PIKCHR_CURRENTCOLOR_FOR_BLACK 0x0004
 
+/* Include PIKCHR_CSS_COLORS among the bits of mFlags on the 3rd argument
+** to pikchr() to get a single SVG that follows the light or dark color
+** scheme of the viewer.  Colors that differ in dark mode are written as
+** CSS custom properties with the light color as the fallback, and a
+** <style> element at the top of the SVG supplies the dark colors under
+** a prefers-color-scheme media query.
+*/
+#define PIKCHR_CSS_COLORS       0x0008
+
+/* Include PIKCHR_CSS_CLASSES among the bits of mFlags on the 3rd argument
+** to pikchr() to replace the inline style of each shape and the font
+** attributes of each text with a class.  Each distinct style is written
+** once in a <style> element at the top of the SVG.
+*/
+#define PIKCHR_CSS_CLASSES      0x0010
+
+/* Include PIKCHR_ARROW_MARKERS among the bits of mFlags on the 3rd
+** argument to pikchr() to draw arrowheads with a shared <marker> for
+** each distinct arrowhead, rather than with a separate <polygon> for
+** each arrowhead.
+*/
+#define PIKCHR_ARROW_MARKERS    0x0020
+
+/* Include PIKCHR_SYMBOLS among the bits of mFlags on the 3rd argument to
+** pikchr() to write objects that appear more than once, differing only
+** in position, as a symbol in <defs> that is placed with <use>.
+*/
+#define PIKCHR_SYMBOLS          0x0040
+
+/* Include PIKCHR_COMPACT among the bits of mFlags on the 3rd argument to
+** pikchr() to make the SVG as small as possible: numbers are rounded to
+** a fixed number of decimal places, path data uses relative commands,
+** and whitespace between and inside tags is removed.  The number of
+** decimal places is 2 unless PIKCHR_COMPACT_DECIMALS(N) is also
+** included, for N between 0 and 6.
+*/
+#define PIKCHR_COMPACT          0x0080
+#define PIKCHR_COMPACT_DECIMALS(N)  ((((N)&7)+1)<<8)
+#define PIKCHR_COMPACT_DMASK    0x0f00
+
 /*
 ** The behavior of an object class is defined by an instance of
 ** this structure. This is the "virtual method" table.
@@ -489,8 +807,11 @@ static void pik_append_dis(Pik*,const char*,PNum,const char*);
 static void pik_append_arc(Pik*,PNum,PNum,PNum,PNum);
 static void pik_append_clr(Pik*,const char*,PNum,const char*,int);
 static void pik_append_style(Pik*,PObj*,int);
+static int pik_intern(Pik*,PShared**,int*,int*,const char*,unsigned int);
+static int pik_symbol_render(Pik*,PObj*);
+void pik_elist_render(Pik*,PList*);
 static void pik_append_txt(Pik*,PObj*, PBox*);
-static void pik_draw_arrowhead(Pik*,PPoint*pFrom,PPoint*pTo,PObj*);
+static void pik_draw_arrowhead(Pik*,PPoint*pFrom,PPoint*pTo,PObj*,int);
 static void pik_chop(PPoint*pFrom,PPoint*pTo,PNum);
 static void pik_error(Pik*,PToken*,const char*);
 static void pik_elist_free(Pik*,PList*);
@@ -530,6 +851,7 @@ static int pik_bbox_contains_point(PBox*,PPoint*);
 static void pik_bbox_init(PBox*);
 static void pik_bbox_addbox(PBox*,PBox*);
 static void pik_bbox_add_xy(PBox*,PNum,PNum);
+static void pik_bbox_add_points(PBox*,const PPoint*,int);
 static void pik_bbox_addellipse(PBox*,PNum x,PNum y,PNum rx,PNum ry);
 static void pik_add_txt(Pik*,PToken*,int);
 static int pik_text_length(const PToken *pToken, const int isMonospace);
@@ -549,6 +871,7 @@ static PObj *pik_assert(Pik*,PNum,PToken*,PNum);
 static PObj *pik_position_assert(Pik*,PPoint*,PToken*,PPoint*);
 static PNum pik_dist(PPoint*,PPoint*);
 static void pik_add_macro(Pik*,PToken *pId,PToken *pCode);
+static void pik_session_checkpoint(Pik*,unsigned int);
 
 
 #line 555 "pikchr.c"
@@ -734,16 +1057,16 @@ typedef union {
   short int yy272;
 } YYMINORTYPE;
 #ifndef YYSTACKDEPTH
-#define YYSTACKDEPTH 100
+#define YYSTACKDEPTH 20
 #endif
 #define pik_parserARG_SDECL
 #define pik_parserARG_PDECL
 #define pik_parserARG_PARAM
 #define pik_parserARG_FETCH
 #define pik_parserARG_STORE
-#define YYREALLOC realloc
-#define YYFREE free
-#define YYDYNSTACK 0
+#define YYREALLOC pik_realloc
+#define YYFREE pik_free
+#define YYDYNSTACK 1
 #define pik_parserCTX_SDECL Pik *p;
 #define pik_parserCTX_PDECL ,Pik *p
 #define pik_parserCTX_PARAM ,p
@@ -1692,11 +2015,14 @@ static const char *const yyRuleName[] = {
 */
 static int yyGrowStack(yyParser *p){
   int oldSize = 1 + (int)(p->yystackEnd - p->yystack);
+  int mxSize = pikchr_limit(PIKCHR_LIMIT_STACK_DEPTH, -1);
   int newSize;
   int idx;
   yyStackEntry *pNew;
 
+  if( oldSize>=mxSize ) return 1;
   newSize = oldSize*2 + 100;
+  if( newSize>mxSize ) newSize = mxSize;
   idx = (int)(p->yytos - p->yystack);
   if( p->yystack==p->yystk0 ){
     pNew = YYREALLOC(0, newSize*sizeof(pNew[0]));
@@ -3743,10 +4069,10 @@ static void arcRender(Pik *p, PObj *pObj){
   t = pObj->aPath[1];
   m = arcControlPoint(pObj->cw,f,t);
   if( pObj->larrow ){
-    pik_draw_arrowhead(p,&m,&f,pObj);
+    pik_draw_arrowhead(p,&m,&f,pObj,1);
   }
   if( pObj->rarrow ){
-    pik_draw_arrowhead(p,&m,&t,pObj);
+    pik_draw_arrowhead(p,&m,&t,pObj,0);
   }
   pik_append_xy(p,"<path d=\"M", f.x, f.y);
   pik_append_xy(p,"Q", m.x, m.y);
@@ -4259,25 +4585,110 @@ static PPoint lineOffset(Pik *p, PObj *pObj, int cp){
 #endif
   return boxOffset(p,pObj,cp);
 }
+/*
+** If the "simplify" variable is set to a tolerance in pixels, remove
+** points from the path a[] of *pn points using the Douglas-Peucker
+** algorithm, so that the simplified path never strays from the original
+** by more than the tolerance.  The first and last points are always
+** kept.  Distances are measured to the segment between the kept points,
+** not to the line through them, so a path that doubles back on itself
+** keeps its turning point.
+**
+** Return a new array of points obtained from malloc() and store its
+** size in *pn, or return NULL if the path should be drawn unchanged.
+** The object is not changed, so the bounding box and all layout still
+** come from the complete path.
+*/
+static PPoint *pik_simplify(Pik *p, const PPoint *a, int *pn){
+  int n = *pn;
+  PNum tol = p->rSimplify;
+  char *aKeep;       /* aKeep[i] is true to keep point a[i] */
+  int *aStack;       /* Ranges of points still to be examined */
+  int nStack = 0;    /* Number of integers on aStack[] */
+  PPoint *aOut = 0;  /* The simplified path */
+  int i, m;
+
+  if( tol<=0.0 || n<3 ) return 0;
+  aKeep = pik_calloc(n, 1);
+  aStack = pik_malloc( sizeof(int)*2*n );
+  if( aKeep==0 || aStack==0 ){
+    pik_free(aKeep);
+    pik_free(aStack);
+    return 0;
+  }
+  aKeep[0] = aKeep[n-1] = 1;
+  aStack[nStack++] = 0;
+  aStack[nStack++] = n-1;
+  while( nStack>0 ){
+    int iHi = aStack[--nStack];
+    int iLo = aStack[--nStack];
+    int iMax = 0;
+    PNum dMax = 0.0;
+    PNum dx = a[iHi].x - a[iLo].x;
+    PNum dy = a[iHi].y - a[iLo].y;
+    PNum len2 = dx*dx + dy*dy;
+    for(i=iLo+1; i<iHi; i++){
+      PNum d;
+      PNum t = 0.0;     /* Nearest point is a[iLo] + t*(dx,dy) */
+      if( len2>0.0 ){
+        t = (dx*(a[i].x - a[iLo].x) + dy*(a[i].y - a[iLo].y))/len2;
+        if( t<0.0 ) t = 0.0;
+        if( t>1.0 ) t = 1.0;
+      }
+      d = hypot(a[i].x - a[iLo].x - t*dx, a[i].y - a[iLo].y - t*dy);
+      if( d>dMax ){
+        dMax = d;
+        iMax = i;
+      }
+    }
+    if( dMax>tol ){
+      aKeep[iMax] = 1;
+      if( iMax-iLo>1 ){
+        aStack[nStack++] = iLo;
+        aStack[nStack++] = iMax;
+      }
+      if( iHi-iMax>1 ){
+        aStack[nStack++] = iMax;
+        aStack[nStack++] = iHi;
+      }
+    }
+  }
+  for(i=m=0; i<n; i++) m += aKeep[i];
+  if( m<n ) aOut = pik_malloc( sizeof(PPoint)*m );
+  if( aOut ){
+    for(i=m=0; i<n; i++){
+      if( aKeep[i] ) aOut[m++] = a[i];
+    }
+    *pn = m;
+  }
+  pik_free(aKeep);
+  pik_free(aStack);
+  return aOut;
+}
+
 static void lineRender(Pik *p, PObj *pObj){
   int i;
   if( pObj->sw>0.0 ){
     const char *z = "<path d=\"M";
     int n = pObj->nPath;
+    PPoint *aS = pik_simplify(p, pObj->aPath, &n); /* Simplified, or NULL */
+    PPoint *a = aS ? aS : pObj->aPath;  /* The path to draw */
+    PPoint a0 = a[0];                   /* First point, after arrowhead chop */
+    PPoint an = a[n-1];                 /* Last point, after arrowhead chop */
     if( pObj->larrow ){
-      pik_draw_arrowhead(p,&pObj->aPath[1],&pObj->aPath[0],pObj);
+      pik_draw_arrowhead(p,&a[1],&a0,pObj,1);
     }
     if( pObj->rarrow ){
-      pik_draw_arrowhead(p,&pObj->aPath[n-2],&pObj->aPath[n-1],pObj);
+      pik_draw_arrowhead(p,n>2 ? &a[n-2] : &a0,&an,pObj,0);
     }
-    for(i=0; i<pObj->nPath; i++){
-      pik_append_xy(p,z,pObj->aPath[i].x,pObj->aPath[i].y);
+    for(i=0; i<n; i++){
+      PPoint *pPt = i==0 ? &a0 : i==n-1 ? &an : &a[i];
+      pik_append_xy(p,z,pPt->x,pPt->y);
       z = "L";
     }
+    pik_free(aS);
     if( pObj->bClose ){
       pik_append(p,"Z",1);
-    }else{
-      pObj->fill = -1.0;
     }
     pik_append(p,"\" ",-1);
     pik_append_style(p,pObj,pObj->bClose?3:0);
@@ -4351,10 +4762,8 @@ static PPoint radiusMidpoint(PPoint f, PPoint t, PNum r, int *pbMid){
   m.y = t.y - r*dy;
   return m;
 }
-static void radiusPath(Pik *p, PObj *pObj, PNum r){
+static void radiusPath(Pik *p, PObj *pObj, const PPoint *a, int n, PNum r){
   int i;
-  int n = pObj->nPath;
-  const PPoint *a = pObj->aPath;
   PPoint m;
   PPoint an = a[n-1];
   int isMid = 0;
@@ -4376,8 +4785,6 @@ static void radiusPath(Pik *p, PObj *pObj, PNum r){
   pik_append_xy(p," L ",an.x,an.y);
   if( pObj->bClose ){
     pik_append(p,"Z",1);
-  }else{
-    pObj->fill = -1.0;
   }
   pik_append(p,"\" ",-1);
   pik_append_style(p,pObj,pObj->bClose?3:0);
@@ -4387,17 +4794,30 @@ static void splineRender(Pik *p, PObj *pObj){
   if( pObj->sw>0.0 ){
     int n = pObj->nPath;
     PNum r = pObj->rad;
+    PPoint *a;
     if( n<3 || r<=0.0 ){
       lineRender(p,pObj);
       return;
     }
+    a = pik_simplify(p, pObj->aPath, &n);
+    if( a==0 ) a = pObj->aPath;
+    if( (pObj->larrow || pObj->rarrow) && a==pObj->aPath ){
+      /* Chop arrowheads from a copy, leaving the object unchanged */
+      a = pik_malloc( sizeof(PPoint)*n );
+      if( a==0 ){
+        pik_error(p,0,0);
+        return;
+      }
+      memcpy(a, pObj->aPath, sizeof(PPoint)*n);
+    }
     if( pObj->larrow ){
-      pik_draw_arrowhead(p,&pObj->aPath[1],&pObj->aPath[0],pObj);
+      pik_draw_arrowhead(p,&a[1],&a[0],pObj,1);
     }
     if( pObj->rarrow ){
-      pik_draw_arrowhead(p,&pObj->aPath[n-2],&pObj->aPath[n-1],pObj);
+      pik_draw_arrowhead(p,&a[n-2],&a[n-1],pObj,0);
     }
-    radiusPath(p,pObj,pObj->rad);
+    radiusPath(p,pObj,a,n,pObj->rad);
+    if( a!=pObj->aPath ) pik_free(a);
   }
   pik_append_txt(p, pObj, 0);
 }
@@ -4643,12 +5063,59 @@ static void pik_chop(PPoint *f, PPoint *t, PNum amt){
   t->y = f->y + r*dy;
 }
 
+/*
+** Define an arrowhead marker of half-width w and height h for pObj, and
+** arrange for the next pik_append_style() to attach it to the start of
+** the line if bStart is true or to the end if bStart is false.
+**
+** The marker is drawn in the coordinates of the line, with the tip of
+** the arrowhead pointing along +x, and its reference point where the
+** line is chopped, at h/2 behind the tip.  With orient="auto-start-reverse"
+** the same marker serves both ends of a line.
+*/
+static void pik_arrow_marker(Pik *p, PObj *pObj, PNum w, PNum h, int bStart){
+  unsigned int iStart = p->nOut;
+  int j;
+  if( p->nErr ) return;
+  pik_append_dis(p, " markerUnits=\"userSpaceOnUse\" markerWidth=\"", h, "\"");
+  pik_append_dis(p, " markerHeight=\"", 2*w, "\"");
+  pik_append_dis(p, " refX=\"", h/2, "\"");
+  pik_append_dis(p, " refY=\"", w, "\"");
+  pik_append(p, " orient=\"auto-start-reverse\" overflow=\"visible\">", -1);
+  pik_append_dis(p, "<polygon points=\"", h, ",");
+  pik_append_dis(p, "", w, " 0,0 0,");
+  pik_append_dis(p, "", 2*w, "");
+  pik_append_clr(p,"\" style=\"fill:",pObj->color,"\"/>",0);
+  if( p->nErr ) return;
+  j = pik_intern(p, &p->aMarker, &p->nMarker, &p->nMarkerAlloc,
+                 p->zOut+iStart, p->nOut-iStart);
+  p->nOut = iStart;
+  if( j<0 ){
+    return;
+  }else if( bStart ){
+    p->iMarkStart = j+1;
+  }else{
+    p->iMarkEnd = j+1;
+  }
+}
+
 /*
 ** Draw an arrowhead on the end of the line segment from pFrom to pTo.
 ** Also, shorten the line segment (by changing the value of pTo) so that
 ** the shaft of the arrow does not extend into the arrowhead.
-*/
-static void pik_draw_arrowhead(Pik *p, PPoint *f, PPoint *t, PObj *pObj){
+**
+** bStart is true for an arrowhead at the start of a line.  It only
+** matters in PIKCHR_ARROW_MARKERS mode, where the arrowhead becomes a
+** marker on the line itself, unless the line is too short for a full
+** arrowhead.
+*/
+static void pik_draw_arrowhead(
+  Pik *p,           /* Context */
+  PPoint *f,        /* Arrowhead points from here */
+  PPoint *t,        /* to here.  Shortened on return */
+  PObj *pObj,       /* The line */
+  int bStart        /* True for the start of the line */
+){
   PNum dx = t->x - f->x;
   PNum dy = t->y - f->y;
   PNum dist = hypot(dx,dy);
@@ -4666,6 +5133,13 @@ static void pik_draw_arrowhead(Pik *p, PPoint *f, PPoint *t, PObj *pObj){
     e1 = 0.0;
     h = dist;
   }
+  if( (p->mFlags & PIKCHR_ARROW_MARKERS)!=0 && e1>0.0 ){
+    pik_arrow_marker(p, pObj, w, h, bStart);
+    if( (bStart ? p->iMarkStart : p->iMarkEnd)!=0 ){
+      pik_chop(f,t,h/2);
+      return;
+    }
+  }
   ddx = -w*dy;
   ddy = w*dx;
   bx = f->x + e1*dx;
@@ -4693,7 +5167,7 @@ static void pik_append(Pik *p, const char *zText, int n){
   if( n<0 ) n = (int)strlen(zText);
   if( p->nOut+n>=p->nOutAlloc ){
     int nNew = (p->nOut+n)*2 + 1;
-    char *z = realloc(p->zOut, nNew);
+    char *z = pik_realloc(p->zOut, nNew);
     if( z==0 ){
       pik_error(p, 0, 0);
       return;
@@ -4854,12 +5328,147 @@ static int pik_color_to_dark_mode(int x, int isBg){
   return r*0x10000 + g*0x100 + b;
 }
 
+/*
+** Routines for PIKCHR_COMPACT output.
+**
+** Pixel values are rounded to integers in units of 10**-D pixels, where
+** D is the number of decimal places, and formatted without redundant
+** zeros.  Path data is written with relative "l", "q", and "a" commands.
+** The current point is kept in rounded units, so the relative values
+** add up to exactly the rounded absolute positions.
+**
+** Rounded values are long long integers no larger than PIK_COMPACT_MAX,
+** so that sums and differences of two of them are exact.  Every value
+** written is measured from the corner of the bounding box, and
+** pik_render_svg() leaves out PIKCHR_COMPACT for a diagram too large for
+** that, which then uses the usual "%g" formatting.
+*/
+#define PIK_COMPACT_MAX 1e15
+static int pik_compact_decimals(Pik *p){
+  int d = (p->mFlags & PIKCHR_COMPACT_DMASK)>>8;
+  if( d==0 ) return 2;
+  d--;
+  return d>6 ? 6 : d;
+}
+static PNum pik_compact_scale(Pik *p){
+  static const PNum aScale[] = { 1, 10, 100, 1e3, 1e4, 1e5, 1e6 };
+  return aScale[pik_compact_decimals(p)];
+}
+static long long pik_compact_round(Pik *p, PNum v){
+  v = floor(v*pik_compact_scale(p) + 0.5);
+  if( v>PIK_COMPACT_MAX ) return (long long)PIK_COMPACT_MAX;
+  if( v<-PIK_COMPACT_MAX ) return -(long long)PIK_COMPACT_MAX;
+  if( v!=v ) return 0;   /* NaN */
+  return (long long)v;
+}
+
+/* Write the rounded value n as text into z[], which must have room for
+** at least 30 bytes.  Return the number of bytes written.
+*/
+static int pik_compact_fmt(Pik *p, char *z, long long n){
+  int d = pik_compact_decimals(p);
+  unsigned long long u = n<0 ? -(unsigned long long)n : (unsigned long long)n;
+  unsigned long long scale = 1;
+  unsigned long long ip, fp;
+  int i, k = 0;
+  for(i=0; i<d; i++) scale *= 10;
+  ip = u/scale;
+  fp = u%scale;
+  if( n<0 ) z[k++] = '-';
+  if( ip || fp==0 ) k += snprintf(z+k, 25, "%llu", ip);
+  if( fp ){
+    char zFrac[24];
+    int nFrac = d;
+    snprintf(zFrac, sizeof(zFrac), "%0*llu", d, fp);
+    while( zFrac[nFrac-1]=='0' ) nFrac--;
+    z[k++] = '.';
+    memcpy(z+k, zFrac, nFrac);
+    k += nFrac;
+  }
+  z[k] = 0;
+  return k;
+}
+
+/* Append n rounded values, separated by commas.  No comma is needed in
+** front of a negative value.  If bSep is true, the first value also
+** needs a separator.
+*/
+static void pik_compact_list(Pik *p, const long long *a, int n, int bSep){
+  char buf[200];
+  int i, k = 0;
+  for(i=0; i<n; i++){
+    if( (i>0 || bSep) && a[i]>=0 ) buf[k++] = ',';
+    k += pik_compact_fmt(p, buf+k, a[i]);
+  }
+  pik_append(p, buf, k);
+}
+
+/* Append a point to path data or to a list of points.  z1 is the same
+** prefix that the non-compact code would use.  A prefix ending in "M"
+** starts a path.  Within a path, "L" and "Q" prefixes become relative
+** "l" and "q" commands, and the point after a "Q" is the end point of
+** the curve.  Outside of a path the point is absolute.
+*/
+static void pik_compact_xy(Pik *p, const char *z1, PNum x, PNum y){
+  long long a[2];
+  int n = (int)strlen(z1);
+  char c;
+  while( n>0 && z1[n-1]==' ' ) n--;
+  c = n>0 ? z1[n-1] : 0;
+  a[0] = pik_compact_round(p, x);
+  a[1] = pik_compact_round(p, y);
+  if( c=='M' ){
+    pik_append(p, z1, n);
+    pik_compact_list(p, a, 2, 0);
+    p->bInPath = 1;
+    p->bQCtrl = 0;
+    p->cLastCmd = 'M';
+    p->aPen[0] = a[0];
+    p->aPen[1] = a[1];
+  }else if( p->bInPath ){
+    long long d[2];
+    d[0] = a[0] - p->aPen[0];
+    d[1] = a[1] - p->aPen[1];
+    if( p->bQCtrl ){
+      pik_compact_list(p, d, 2, 1);
+      p->bQCtrl = 0;
+      p->aPen[0] = a[0];
+      p->aPen[1] = a[1];
+    }else{
+      char cmd = c=='Q' ? 'q' : 'l';
+      if( cmd==p->cLastCmd ){
+        pik_compact_list(p, d, 2, 1);
+      }else{
+        pik_append(p, &cmd, 1);
+        pik_compact_list(p, d, 2, 0);
+        p->cLastCmd = cmd;
+      }
+      if( cmd=='q' ){
+        p->bQCtrl = 1;
+      }else{
+        p->aPen[0] = a[0];
+        p->aPen[1] = a[1];
+      }
+    }
+  }else{
+    pik_append(p, z1, -1);
+    pik_compact_list(p, a, 2, 0);
+  }
+}
+
 /* Append a PNum value surrounded by text.  Do coordinate transformations
 ** on the value.
 */
 static void pik_append_x(Pik *p, const char *z1, PNum v, const char *z2){
   char buf[200];
   v -= p->bbox.sw.x;
+  if( p->mFlags & PIKCHR_COMPACT ){
+    pik_append(p, z1, -1);
+    pik_compact_fmt(p, buf, pik_compact_round(p, p->rScale*v));
+    pik_append(p, buf, -1);
+    pik_append(p, z2, -1);
+    return;
+  }
   snprintf(buf, sizeof(buf)-1, "%s%g%s", z1, p->rScale*v, z2);
   buf[sizeof(buf)-1] = 0;
   pik_append(p, buf, -1);
@@ -4867,6 +5476,10 @@ static void pik_append_x(Pik *p, const char *z1, PNum v, const char *z2){
 static void pik_append_y(Pik *p, const char *z1, PNum v, const char *z2){
   char buf[200];
   v = p->bbox.ne.y - v;
+  if( p->mFlags & PIKCHR_COMPACT ){
+    pik_append_dis(p, z1, v, z2);
+    return;
+  }
   snprintf(buf, sizeof(buf)-1, "%s%g%s", z1, p->rScale*v, z2);
   buf[sizeof(buf)-1] = 0;
   pik_append(p, buf, -1);
@@ -4875,32 +5488,76 @@ static void pik_append_xy(Pik *p, const char *z1, PNum x, PNum y){
   char buf[200];
   x = x - p->bbox.sw.x;
   y = p->bbox.ne.y - y;
+  if( p->mFlags & PIKCHR_COMPACT ){
+    pik_compact_xy(p, z1, p->rScale*x, p->rScale*y);
+    return;
+  }
   snprintf(buf, sizeof(buf)-1, "%s%g,%g", z1, p->rScale*x, p->rScale*y);
   buf[sizeof(buf)-1] = 0;
   pik_append(p, buf, -1);
 }
 static void pik_append_dis(Pik *p, const char *z1, PNum v, const char *z2){
   char buf[200];
+  if( p->mFlags & PIKCHR_COMPACT ){
+    pik_append(p, z1, -1);
+    pik_compact_fmt(p, buf, pik_compact_round(p, p->rScale*v));
+    pik_append(p, buf, -1);
+    pik_append(p, z2, -1);
+    return;
+  }
   snprintf(buf, sizeof(buf)-1, "%s%g%s", z1, p->rScale*v, z2);
   buf[sizeof(buf)-1] = 0;
   pik_append(p, buf, -1);
 }
 
+/* Remember that color x (a background color if bg is true) has been
+** written as a CSS custom property, so that its dark mode value will be
+** included in the <style> at the top of the SVG.
+*/
+static void pik_css_color_add(Pik *p, int x, int bg){
+  int i;
+  int v = x | (bg ? 0x1000000 : 0);
+  for(i=0; i<p->nClr; i++){
+    if( p->aClr[i]==v ) return;
+  }
+  if( p->nClr>=p->nClrAlloc ){
+    int nNew = p->nClrAlloc*2 + 8;
+    int *aNew = pik_realloc(p->aClr, nNew*sizeof(int));
+    if( aNew==0 ){
+      pik_error(p, 0, 0);
+      return;
+    }
+    p->aClr = aNew;
+    p->nClrAlloc = nNew;
+  }
+  p->aClr[p->nClr++] = v;
+}
+
 /* Append a color specification to the output.
 **
 ** In PIKCHR_DARK_MODE, the color is inverted.  The "bg" flags indicates that
 ** the color is intended for use as a background color if true, or as a
 ** foreground color if false.  The distinction only matters for color
-** inversions in PIKCHR_DARK_MODE.
+** inversions in PIKCHR_DARK_MODE and PIKCHR_CSS_COLORS.
+**
+** In PIKCHR_CSS_COLORS mode, a color that is different in dark mode is
+** written as var(--pikchr-fRRGGBB,rgb(...)), or --pikchr-bRRGGBB for
+** background colors.  The name depends only on the light color, so
+** several diagrams on the same page never disagree about a value.
+** Colors set by "fgcolor" and "bgcolor" are used as-is.
 */
 static void pik_append_clr(Pik *p,const char *z1,PNum v,const char *z2,int bg){
   char buf[200];
   int x = pik_round(v);
   int r, g, b;
+  int bVar = 0;
   if( x==0 && p->fgcolor>0 && !bg ){
     x = p->fgcolor;
   }else if( bg && x>=0xffffff && p->bgcolor>0 ){
     x = p->bgcolor;
+  }else if( p->mFlags & PIKCHR_CSS_COLORS ){
+    x &= 0xffffff;
+    bVar = pik_color_to_dark_mode(x,bg)!=x;
   }else if( p->mFlags & PIKCHR_DARK_MODE ){
     x = pik_color_to_dark_mode(x,bg);
   }
@@ -4910,7 +5567,13 @@ static void pik_append_clr(Pik *p,const char *z1,PNum v,const char *z2,int bg){
     r = (x>>16) & 0xff;
     g = (x>>8) & 0xff;
     b = x & 0xff;
-    snprintf(buf, sizeof(buf)-1, "%srgb(%d,%d,%d)%s", z1, r, g, b, z2);
+    if( bVar ){
+      pik_css_color_add(p, x, bg);
+      snprintf(buf, sizeof(buf)-1, "%svar(--pikchr-%c%06x,rgb(%d,%d,%d))%s",
+               z1, bg ? 'b' : 'f', x, r, g, b, z2);
+    }else{
+      snprintf(buf, sizeof(buf)-1, "%srgb(%d,%d,%d)%s", z1, r, g, b, z2);
+    }
   }
   buf[sizeof(buf)-1] = 0;
   pik_append(p, buf, -1);
@@ -4924,6 +5587,26 @@ static void pik_append_arc(Pik *p, PNum r1, PNum r2, PNum x, PNum y){
   char buf[200];
   x = x - p->bbox.sw.x;
   y = p->bbox.ne.y - y;
+  if( p->mFlags & PIKCHR_COMPACT ){
+    long long a[7];
+    a[0] = pik_compact_round(p, p->rScale*r1);
+    a[1] = pik_compact_round(p, p->rScale*r2);
+    a[2] = a[3] = a[4] = 0;
+    a[5] = pik_compact_round(p, p->rScale*x);
+    a[6] = pik_compact_round(p, p->rScale*y);
+    a[5] -= p->aPen[0];
+    a[6] -= p->aPen[1];
+    if( p->cLastCmd=='a' ){
+      pik_compact_list(p, a, 7, 1);
+    }else{
+      pik_append(p, "a", 1);
+      pik_compact_list(p, a, 7, 0);
+      p->cLastCmd = 'a';
+    }
+    p->aPen[0] += a[5];
+    p->aPen[1] += a[6];
+    return;
+  }
   snprintf(buf, sizeof(buf)-1, "A%g %g 0 0 0 %g %g", 
      p->rScale*r1, p->rScale*r2,
      p->rScale*x, p->rScale*y);
@@ -4931,9 +5614,150 @@ static void pik_append_arc(Pik *p, PNum r1, PNum r2, PNum x, PNum y){
   pik_append(p, buf, -1);
 }
 
+/*
+** The *pnAlloc slots of a pik_intern() list are followed, in the same
+** allocation, by a hash index of twice as many integers.  Each integer
+** is 1 more than the list index of an entry, or 0 if unused, and entries
+** are found by linear probing from their hash.
+*/
+#define pik_intern_index(A,NALLOC)  ((int*)&(A)[NALLOC])
+
+/* Rebuild the hash index of the n entries of a pik_intern() list */
+static void pik_intern_reindex(PShared *a, int n, int nAlloc){
+  int *aIdx = pik_intern_index(a, nAlloc);
+  unsigned int nIdx = 2*(unsigned int)nAlloc;
+  unsigned int k;
+  int j;
+  if( nAlloc==0 ) return;
+  memset(aIdx, 0, sizeof(int)*nIdx);
+  for(j=0; j<n; j++){
+    for(k=(unsigned int)(a[j].h%nIdx); aIdx[k]; k=(k+1)%nIdx){}
+    aIdx[k] = j+1;
+  }
+}
+
+/* Continue the 64-bit FNV-1a hash h, which starts as PIK_HASH_INIT,
+** over the n bytes of z[] */
+#define PIK_HASH_INIT 0xcbf29ce484222325ULL
+static unsigned long long pik_hash(
+  unsigned long long h,  /* Hash so far */
+  const char *z,         /* More text */
+  unsigned int n         /* Bytes of text in z[] */
+){
+  unsigned int i;
+  for(i=0; i<n; i++){
+    h = (h ^ (unsigned char)z[i])*0x100000001b3ULL;
+  }
+  return h;
+}
+
+/*
+** Find the entry for the n bytes of text in z[] on the list *paList of
+** *pnList entries, adding a new entry if there is none.  Return the
+** index of the entry, or -1 if a different text already has the same
+** hash or if out of memory.
+**
+** The hash becomes part of a class name or marker id.  CSS and ids are
+** shared by every diagram on a page, so the hash is 64 bits long, and
+** as a class or marker is named for its complete text, two diagrams
+** give the same name to different ones only if their hashes collide.
+** A symbol is named for a hash of both its key and its markup, which
+** can depend on more than the key, such as the mFlags of the diagram.
+*/
+static int pik_intern(
+  Pik *p,              /* Context, for reporting out-of-memory */
+  PShared **paList,     /* The list */
+  int *pnList,         /* Number of entries on the list */
+  int *pnAlloc,        /* Slots allocated for the list */
+  const char *z,       /* The text */
+  unsigned int n       /* Bytes of text in z[] */
+){
+  unsigned long long h = pik_hash(PIK_HASH_INIT, z, n);
+  unsigned int k, nIdx;
+  int *aIdx;
+  int j;
+  PShared *a = *paList;
+  if( *pnAlloc>0 ){
+    aIdx = pik_intern_index(a, *pnAlloc);
+    nIdx = 2*(unsigned int)*pnAlloc;
+    for(k=(unsigned int)(h%nIdx); aIdx[k]; k=(k+1)%nIdx){
+      j = aIdx[k]-1;
+      if( a[j].h==h ){
+        const char *zOld = a[j].zDecl;
+        if( strlen(zOld)!=n || memcmp(zOld, z, n)!=0 ) return -1;
+        return j;
+      }
+    }
+  }
+  j = *pnList;
+  if( j>=*pnAlloc ){
+    int nNew = *pnAlloc*2 + 8;
+    a = pik_realloc(a, nNew*(sizeof(PShared) + 2*sizeof(int)));
+    if( a==0 ){
+      pik_error(p, 0, 0);
+      return -1;
+    }
+    *paList = a;
+    *pnAlloc = nNew;
+    pik_intern_reindex(a, j, nNew);
+  }
+  a[j].h = h;
+  a[j].nRef = 0;
+  a[j].zBody = 0;
+  a[j].hBody = 0;
+  a[j].zDecl = pik_malloc( n+1 );
+  if( a[j].zDecl==0 ){
+    pik_error(p, 0, 0);
+    return -1;
+  }
+  memcpy(a[j].zDecl, z, n);
+  a[j].zDecl[n] = 0;
+  (*pnList)++;
+  aIdx = pik_intern_index(a, *pnAlloc);
+  nIdx = 2*(unsigned int)*pnAlloc;
+  for(k=(unsigned int)(h%nIdx); aIdx[k]; k=(k+1)%nIdx){}
+  aIdx[k] = j+1;
+  return j;
+}
+
+/* Free a list built by pik_intern() */
+static void pik_intern_free(PShared **paList, int *pnList, int *pnAlloc){
+  int i;
+  for(i=0; i<*pnList; i++){
+    pik_free((*paList)[i].zDecl);
+    pik_free((*paList)[i].zBody);
+  }
+  pik_free(*paList);
+  *paList = 0;
+  *pnList = *pnAlloc = 0;
+}
+
+/*
+** The end of zOut[], starting at iAttr, is an unterminated style="..."
+** attribute.  Replace it with a class="..." attribute for the same style,
+** also unterminated.  In the unlikely event that two different styles in
+** one diagram have the same hash, the second one remains an inline style.
+*/
+static void pik_style_to_class(Pik *p, unsigned int iAttr){
+  unsigned int iDecl = iAttr+8;  /* Skip over ' style="' */
+  int j;
+  char zName[20];
+  if( p->nErr ) return;
+  j = pik_intern(p, &p->aStyle, &p->nStyle, &p->nStyleAlloc,
+                 p->zOut+iDecl, p->nOut-iDecl);
+  if( j<0 ) return;
+  p->nOut = iAttr;
+  snprintf(zName, sizeof(zName), "pk%llx", p->aStyle[j].h);
+  pik_append(p, " class=\"", -1);
+  pik_append(p, zName, -1);
+}
+
 /* Append a style="..." text.  But, leave the quote unterminated, in case
 ** the caller wants to add some more.
 **
+** In PIKCHR_CSS_CLASSES mode, a class="..." attribute is appended instead,
+** again with the quote left open.  Callers must not add more to it.
+**
 ** eFill is non-zero to fill in the background, or 0 if no fill should
 ** occur.  Non-zero values of eFill determine the "bg" flag to pik_append_clr()
 ** for cases when pObj->fill==pObj->color
@@ -4944,6 +5768,8 @@ static void pik_append_arc(Pik *p, PNum r1, PNum r2, PNum x, PNum y){
 */
 static void pik_append_style(Pik *p, PObj *pObj, int eFill){
   int clrIsBg = 0;
+  unsigned int iAttr = p->nOut;
+  p->bInPath = 0;   /* Any path data is finished */
   pik_append(p, " style=\"", -1);
   if( pObj->fill>=0 && eFill ){
     int fillIsBg = 1;
@@ -4973,20 +5799,35 @@ static void pik_append_style(Pik *p, PObj *pObj, int eFill){
       pik_append_dis(p,",",v,";");
     }
   }
+  if( p->mFlags & PIKCHR_CSS_CLASSES ){
+    pik_style_to_class(p, iAttr);
+  }
+  if( p->iMarkStart || p->iMarkEnd ){
+    /* Arrowhead markers from pik_draw_arrowhead().  Each attribute
+    ** closes the quote of the one before, and the last is left open. */
+    char buf[100];
+    if( p->iMarkStart ){
+      snprintf(buf, sizeof(buf), "\" marker-start=\"url(#pkm%llx)",
+               p->aMarker[p->iMarkStart-1].h);
+      pik_append(p, buf, -1);
+    }
+    if( p->iMarkEnd ){
+      snprintf(buf, sizeof(buf), "\" marker-end=\"url(#pkm%llx)",
+               p->aMarker[p->iMarkEnd-1].h);
+      pik_append(p, buf, -1);
+    }
+    p->iMarkStart = p->iMarkEnd = 0;
+  }
 }
 
 /*
-** Compute the vertical locations for all text items in the
-** object pObj.  In other words, set every pObj->aTxt[*].eCode
-** value to contain exactly one of: TP_ABOVE2, TP_ABOVE, TP_CENTER,
-** TP_BELOW, or TP_BELOW2 is set.
+** Compute the vertical locations for the n text items in aTxt[].
+** In other words, set every aTxt[*].eCode value to contain exactly
+** one of: TP_ABOVE2, TP_ABOVE, TP_CENTER, TP_BELOW, or TP_BELOW2 is set.
 */
-static void pik_txt_vertical_layout(PObj *pObj){
-  int n, i;
-  PToken *aTxt;
-  n = pObj->nTxt;
+static void pik_txt_vertical_layout(PToken *aTxt, int n){
+  int i;
   if( n==0 ) return;
-  aTxt = pObj->aTxt;
   if( n==1 ){
     if( (aTxt[0].eCode & TP_VMASK)==0 ){
       aTxt[0].eCode |= TP_CENTER;
@@ -5073,6 +5914,10 @@ static PNum pik_font_scale(PToken *t){
 **    pBox       If not NULL, do no rendering at all.  Instead
 **               expand the box object so that it will include all
 **               of the text.
+**
+** The vertical text layout is saved back into pObj only when computing
+** the bounding box.  Rendering works on a copy so that it leaves the
+** object unchanged and can be repeated.
 */
 static void pik_append_txt(Pik *p, PObj *pObj, PBox *pBox){
   PNum jw;          /* Justification margin relative to center */
@@ -5087,15 +5932,23 @@ static void pik_append_txt(Pik *p, PObj *pObj, PBox *pBox){
   PNum x, y, orig_y, s;
   const char *z;
   PToken *aTxt;
+  PToken aCopy[count(pObj->aTxt)];
   unsigned allMask = 0;
+  unsigned int iAttr;  /* Start of the text attributes in zOut[] */
+  int bCss = (p->mFlags & PIKCHR_CSS_CLASSES)!=0;  /* Attributes as a class */
 
   if( p->nErr ) return;
   if( pObj->nTxt==0 ) return;
-  aTxt = pObj->aTxt;
   n = pObj->nTxt;
-  pik_txt_vertical_layout(pObj);
+  if( pBox ){
+    aTxt = pObj->aTxt;
+  }else{
+    memcpy(aCopy, pObj->aTxt, n*sizeof(aCopy[0]));
+    aTxt = aCopy;
+  }
+  pik_txt_vertical_layout(aTxt, n);
   x = pObj->ptAt.x;
-  for(i=0; i<n; i++) allMask |= pObj->aTxt[i].eCode;
+  for(i=0; i<n; i++) allMask |= aTxt[i].eCode;
   if( pObj->type->isLine ){
     hc = sw*1.5;
   }else if( pObj->rad>0.0 && pObj->type->xInit==cylinderInit ){
@@ -5103,23 +5956,23 @@ static void pik_append_txt(Pik *p, PObj *pObj, PBox *pBox){
   }
   if( allMask & TP_CENTER ){
     for(i=0; i<n; i++){
-      if( pObj->aTxt[i].eCode & TP_CENTER ){
-        s = pik_font_scale(pObj->aTxt+i);
+      if( aTxt[i].eCode & TP_CENTER ){
+        s = pik_font_scale(aTxt+i);
         if( hc<s*p->charHeight ) hc = s*p->charHeight;
       }
     }
   }
   if( allMask & TP_ABOVE ){
     for(i=0; i<n; i++){
-      if( pObj->aTxt[i].eCode & TP_ABOVE ){
-        s = pik_font_scale(pObj->aTxt+i)*p->charHeight;
+      if( aTxt[i].eCode & TP_ABOVE ){
+        s = pik_font_scale(aTxt+i)*p->charHeight;
         if( ha1<s ) ha1 = s;
       }
     }
     if( allMask & TP_ABOVE2 ){
       for(i=0; i<n; i++){
-        if( pObj->aTxt[i].eCode & TP_ABOVE2 ){
-          s = pik_font_scale(pObj->aTxt+i)*p->charHeight;
+        if( aTxt[i].eCode & TP_ABOVE2 ){
+          s = pik_font_scale(aTxt+i)*p->charHeight;
           if( ha2<s ) ha2 = s;
         }
       }
@@ -5127,15 +5980,15 @@ static void pik_append_txt(Pik *p, PObj *pObj, PBox *pBox){
   }
   if( allMask & TP_BELOW ){
     for(i=0; i<n; i++){
-      if( pObj->aTxt[i].eCode & TP_BELOW ){
-        s = pik_font_scale(pObj->aTxt+i)*p->charHeight;
+      if( aTxt[i].eCode & TP_BELOW ){
+        s = pik_font_scale(aTxt+i)*p->charHeight;
         if( hb1<s ) hb1 = s;
       }
     }
     if( allMask & TP_BELOW2 ){
       for(i=0; i<n; i++){
-        if( pObj->aTxt[i].eCode & TP_BELOW2 ){
-          s = pik_font_scale(pObj->aTxt+i)*p->charHeight;
+        if( aTxt[i].eCode & TP_BELOW2 ){
+          s = pik_font_scale(aTxt+i)*p->charHeight;
           if( hb2<s ) hb2 = s;
         }
       }
@@ -5210,29 +6063,60 @@ static void pik_append_txt(Pik *p, PObj *pObj, PBox *pBox){
 
     pik_append_x(p, "<text x=\"", nx, "\"");
     pik_append_y(p, " y=\"", y, "\"");
-    if( t->eCode & TP_RJUST ){
-      pik_append(p, " text-anchor=\"end\"", -1);
-    }else if( t->eCode & TP_LJUST ){
-      pik_append(p, " text-anchor=\"start\"", -1);
+    iAttr = p->nOut;
+    if( bCss ){
+      /* Font attributes become CSS declarations, shared through a class */
+      pik_append(p, " style=\"", -1);
+      if( t->eCode & TP_RJUST ){
+        pik_append(p, "text-anchor:end;", -1);
+      }else if( t->eCode & TP_LJUST ){
+        pik_append(p, "text-anchor:start;", -1);
+      }else{
+        pik_append(p, "text-anchor:middle;", -1);
+      }
+      if( t->eCode & TP_ITALIC ) pik_append(p, "font-style:italic;", -1);
+      if( t->eCode & TP_BOLD ) pik_append(p, "font-weight:bold;", -1);
+      if( t->eCode & TP_MONO ) pik_append(p, "font-family:monospace;", -1);
+      if( pObj->color>=0.0 ){
+        pik_append_clr(p, "fill:", pObj->color, ";", 0);
+      }
     }else{
-      pik_append(p, " text-anchor=\"middle\"", -1);
-    }
-    if( t->eCode & TP_ITALIC ){
-      pik_append(p, " font-style=\"italic\"", -1);
-    }
-    if( t->eCode & TP_BOLD ){
-      pik_append(p, " font-weight=\"bold\"", -1);
-    }
-    if( t->eCode & TP_MONO ){
-      pik_append(p, " font-family=\"monospace\"", -1);
-    }
-    if( pObj->color>=0.0 ){
-      pik_append_clr(p, " fill=\"", pObj->color, "\"",0);
+      if( t->eCode & TP_RJUST ){
+        pik_append(p, " text-anchor=\"end\"", -1);
+      }else if( t->eCode & TP_LJUST ){
+        pik_append(p, " text-anchor=\"start\"", -1);
+      }else{
+        pik_append(p, " text-anchor=\"middle\"", -1);
+      }
+      if( t->eCode & TP_ITALIC ){
+        pik_append(p, " font-style=\"italic\"", -1);
+      }
+      if( t->eCode & TP_BOLD ){
+        pik_append(p, " font-weight=\"bold\"", -1);
+      }
+      if( t->eCode & TP_MONO ){
+        pik_append(p, " font-family=\"monospace\"", -1);
+      }
+      if( pObj->color>=0.0 ){
+        /* CSS var() is not allowed in presentation attributes */
+        pik_append_clr(p, (p->mFlags & PIKCHR_CSS_COLORS) ?
+                           " style=\"fill:" : " fill=\"", pObj->color, "\"",0);
+      }
     }
     xtraFontScale *= p->fontScale;
     if( xtraFontScale<=0.99 || xtraFontScale>=1.01 ){
-      pik_append_num(p, " font-size=\"", xtraFontScale*100.0);
-      pik_append(p, "%\"", 2);
+      if( bCss ){
+        pik_append_num(p, "font-size:", xtraFontScale*100.0);
+        pik_append(p, "%;", 2);
+      }else{
+        pik_append_num(p, " font-size=\"", xtraFontScale*100.0);
+        pik_append(p, "%\"", 2);
+      }
+    }
+    if( bCss ){
+      pik_append(p, "dominant-baseline:central;", -1);
+      pik_style_to_class(p, iAttr);
+      pik_append(p, "\"", 1);
     }
     if( (t->eCode & TP_ALIGN)!=0 && pObj->nPath>=2 ){
       int nn = pObj->nPath;
@@ -5245,7 +6129,7 @@ static void pik_append_txt(Pik *p, PObj *pObj, PBox *pBox){
         pik_append(p,")\"",2);
       }
     }
-    pik_append(p," dominant-baseline=\"central\">",-1);
+    pik_append(p, bCss ? ">" : " dominant-baseline=\"central\">", -1);
     if( t->n>=2 && t->z[0]=='"' ){
       z = t->z+1;
       nz = t->n-2;
@@ -5282,42 +6166,50 @@ static void pik_error_context(Pik *p, PToken *pErr, int nContext){
   int i;                /* Loop counter */
   int iBump = 0;        /* Bump the location of the error cursor */
   char zLineno[24];     /* Buffer in which to generate line numbers */
+  const char *zIn = p->sIn.z;     /* Text that contains the error token */
+  unsigned int nIn = p->sIn.n;    /* Bytes in zIn[] */
+
+  if( p->sPrelude.z && PIK_WITHIN(pErr->z, p->sPrelude.z, p->sPrelude.n) ){
+    /* The error is in a macro defined by the prelude */
+    zIn = p->sPrelude.z;
+    nIn = p->sPrelude.n;
+  }
 
-  iErrPt = (int)(pErr->z - p->sIn.z);
-  if( iErrPt>=(int)p->sIn.n ){
-    iErrPt = p->sIn.n-1;
+  iErrPt = (int)(pErr->z - zIn);
+  if( iErrPt>=(int)nIn ){
+    iErrPt = nIn-1;
     iBump = 1;
   }else{
-    while( iErrPt>0 && (p->sIn.z[iErrPt]=='\n' || p->sIn.z[iErrPt]=='\r') ){
+    while( iErrPt>0 && (zIn[iErrPt]=='\n' || zIn[iErrPt]=='\r') ){
       iErrPt--;
       iBump = 1;
     }
   }
   iLineno = 1;
   for(i=0; i<iErrPt; i++){
-    if( p->sIn.z[i]=='\n' ){
+    if( zIn[i]=='\n' ){
       iLineno++;
     }
   }
   iStart = 0;
   iFirstLineno = 1;
   while( iFirstLineno+nContext<iLineno ){
-    while( p->sIn.z[iStart]!='\n' ){ iStart++; }
+    while( zIn[iStart]!='\n' ){ iStart++; }
     iStart++;
     iFirstLineno++;
   }
-  for(iEnd=iErrPt; p->sIn.z[iEnd]!=0 && p->sIn.z[iEnd]!='\n'; iEnd++){}
+  for(iEnd=iErrPt; zIn[iEnd]!=0 && zIn[iEnd]!='\n'; iEnd++){}
   i = iStart;
   while( iFirstLineno<=iLineno ){
     snprintf(zLineno,sizeof(zLineno)-1,"/* %4d */  ", iFirstLineno++);
     zLineno[sizeof(zLineno)-1] = 0;
     pik_append(p, zLineno, -1);
-    for(i=iStart; p->sIn.z[i]!=0 && p->sIn.z[i]!='\n'; i++){}
-    pik_append_errtxt(p, p->sIn.z+iStart, i-iStart);
+    for(i=iStart; zIn[i]!=0 && zIn[i]!='\n'; i++){}
+    pik_append_errtxt(p, zIn+iStart, i-iStart);
     iStart = i+1;
     pik_append(p, "\n", 1);
   }
-  for(iErrCol=0, i=iErrPt; i>0 && p->sIn.z[i]!='\n'; iErrCol++, i--){}
+  for(iErrCol=0, i=iErrPt; i>0 && zIn[i]!='\n'; iErrCol++, i--){}
   for(i=0; i<iErrCol+11+iBump; i++){ pik_append(p, " ", 1); }
   for(i=0; i<(int)pErr->n; i++) pik_append(p, "^", 1);
   pik_append(p, "\n", 1);
@@ -5399,25 +6291,220 @@ static PObj *pik_position_assert(Pik *p, PPoint *e1, PToken *pEq, PPoint *e2){
   return 0;
 }
 
-/* Free a complete list of objects */
-static void pik_elist_free(Pik *p, PList *pList){
+/* Return the current time in seconds */
+static PNum pik_now(void){
+#ifdef TIME_UTC
+  struct timespec t;
+  timespec_get(&t, TIME_UTC);
+  return t.tv_sec + t.tv_nsec*1.0e-9;
+#else
+  return clock()/(PNum)CLOCKS_PER_SEC;
+#endif
+}
+
+/*
+** Charge the time since the last call to the phase that was running,
+** and start timing ePhase.  Return the phase that was running, so that
+** the caller can switch back to it.  A no-op unless collecting
+** statistics.
+*/
+static int pik_stats_phase(Pik *p, int ePhase){
+  int ePrior = p->ePhase;
+  PNum rNow, rDelta;
+  if( p->pStats==0 ) return PIK_PHASE_NONE;
+  rNow = pik_now();
+  rDelta = rNow - p->rMark;
+  switch( ePrior ){
+    case PIK_PHASE_TOKENIZE:  p->pStats->rTokenize += rDelta;  break;
+    case PIK_PHASE_PARSE:     p->pStats->rParse += rDelta;     break;
+    case PIK_PHASE_LAYOUT:    p->pStats->rLayout += rDelta;    break;
+    case PIK_PHASE_BBOX:      p->pStats->rBbox += rDelta;      break;
+    case PIK_PHASE_RENDER:    p->pStats->rRender += rDelta;    break;
+  }
+  p->ePhase = ePhase;
+  p->rMark = rNow;
+  return ePrior;
+}
+
+/* Bytes of memory held by a list of objects */
+static size_t pik_elist_bytes(const PList *pList){
+  size_t n;
   int i;
-  if( pList==0 ) return;
+  if( pList==0 ) return 0;
+  n = sizeof(*pList) + sizeof(PObj*)*pList->nAlloc;
   for(i=0; i<pList->n; i++){
-    pik_elem_free(p, pList->a[i]);
+    const PObj *pObj = pList->a[i];
+    n += sizeof(*pObj) + sizeof(PPoint)*pObj->nPath;
+    if( pObj->zName ) n += strlen(pObj->zName)+1;
+    n += pik_elist_bytes(pObj->pSublist);
   }
-  free(pList->a);
-  free(pList);
-  return;
+  return n;
 }
 
-/* Free a single object, and its substructure */
-static void pik_elem_free(Pik *p, PObj *pObj){
-  if( pObj==0 ) return;
-  free(pObj->zName);
+/* Bytes of memory held by an array of shared markup */
+static size_t pik_shared_bytes(const PShared *a, int n, int nAlloc){
+  size_t nByte = (sizeof(*a) + 2*sizeof(int))*nAlloc;  /* With the index */
+  int i;
+  for(i=0; i<n; i++){
+    nByte += strlen(a[i].zDecl)+1;
+    if( a[i].zBody ) nByte += strlen(a[i].zBody)+1;
+  }
+  return nByte;
+}
+
+/*
+** Estimate the memory in use while rendering pList, just before the
+** working storage is released, by adding up the sizes of the structures
+** that are still live.  Nothing is freed before rendering is done, so
+** this is close to the most that is held at any time, but short-lived
+** scratch buffers and allocator overhead are not counted.  Also called
+** for a diagram with errors, before its objects are freed.
+*/
+static void pik_stats_memory(Pik *p, const PList *pList){
+  size_t n;
+  const PVar *pVar;
+  const PMacro *pMac;
+  if( p->pStats==0 ) return;
+  n = pik_elist_bytes(pList) + p->nOutAlloc + sizeof(int)*p->nClrAlloc;
+  n += pik_shared_bytes(p->aStyle, p->nStyle, p->nStyleAlloc);
+  n += pik_shared_bytes(p->aMarker, p->nMarker, p->nMarkerAlloc);
+  n += pik_shared_bytes(p->aSym, p->nSym, p->nSymAlloc);
+  for(pVar=p->pVar; pVar; pVar=pVar->pNext){
+    n += sizeof(*pVar) + strlen(pVar->zName)+1;
+  }
+  for(pMac=p->pMacros; pMac; pMac=pMac->pNext) n += sizeof(*pMac);
+  if( n>p->pStats->nPeakEst ) p->pStats->nPeakEst = n;
+}
+
+/* Free a complete list of objects */
+static void pik_elist_free(Pik *p, PList *pList){
+  int i;
+  if( pList==0 ) return;
+  for(i=0; i<pList->n; i++){
+    pik_elem_free(p, pList->a[i]);
+  }
+  pik_free(pList->a);
+  pik_free(pList);
+  return;
+}
+
+/* Drop one reference to block pBlock, and free it if that was the last */
+static void pik_obj_unref(PObjBlock *pBlock){
+  if( --pBlock->nRef==0 ) pik_free(pBlock);
+}
+
+/* Return a new zeroed object from the open block *ppOpen, opening a
+** new block first if needed.  Return NULL if out of memory.
+*/
+static PObj *pik_obj_new(PObjBlock **ppOpen){
+  PObjBlock *pBlock = *ppOpen;
+  PObj *pObj;
+  if( pBlock==0 || pBlock->nUsed>=PIK_OBJ_BLOCK ){
+    if( pBlock ) pik_obj_unref(pBlock);
+    *ppOpen = pBlock = pik_malloc( sizeof(*pBlock) );
+    if( pBlock==0 ) return 0;
+    pBlock->nUsed = 0;
+    pBlock->nRef = 1;
+  }
+  pObj = &pBlock->a[pBlock->nUsed++];
+  pBlock->nRef++;
+  memset(pObj, 0, sizeof(*pObj));
+  pObj->pBlock = pBlock;
+  return pObj;
+}
+
+/* No more objects will be taken from *ppOpen */
+static void pik_obj_close(PObjBlock **ppOpen){
+  if( *ppOpen ){
+    pik_obj_unref(*ppOpen);
+    *ppOpen = 0;
+  }
+}
+
+/* Free a single object, and its substructure */
+static void pik_elem_free(Pik *p, PObj *pObj){
+  if( pObj==0 ) return;
+  pik_free(pObj->zName);
   pik_elist_free(p, pObj->pSublist);
-  free(pObj->aPath);
-  free(pObj);
+  pik_free(pObj->aPath);
+  pik_obj_unref(pObj->pBlock);
+}
+
+/* Powers of ten that are exactly representable as doubles */
+static const double pik_aPow10[] = {
+  1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/*
+** Convert the decimal number at the start of z[] without strtod(), if
+** that can be done exactly.  Write the value into *pr and the end of the
+** number into *pzEnd and return 1, or return 0 if strtod() is needed.
+** The syntax accepted is the same as for strtod() on a decimal number
+** without a sign: digits, an optional fraction, and an optional exponent.
+**
+** This is Clinger's fast path.  When the significant digits make an
+** integer of no more than 2^53 and the power of ten is no more than 22,
+** both are exact doubles, and one multiplication or division, which
+** IEEE 754 rounds correctly, gives the same result as strtod().  That
+** covers nearly all of the numbers in real scripts.  It is also
+** independent of the locale.
+*/
+static int pik_fast_atof(const char *z, PNum *pr, const char **pzEnd){
+#if defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD==0
+  unsigned long long m = 0;   /* Significant digits */
+  int nSig = 0;               /* Number of digits in m */
+  int e = 0;                  /* Power of ten to apply to m */
+  int c;
+
+  for(; (c = z[0])>='0' && c<='9'; z++){
+    if( m==0 && c=='0' ) continue;
+    if( nSig>=19 ) return 0;
+    m = m*10 + (c - '0');
+    nSig++;
+  }
+  if( c=='.' ){
+    for(z++; (c = z[0])>='0' && c<='9'; z++){
+      e--;
+      if( m==0 && c=='0' ) continue;
+      if( nSig>=19 ) return 0;
+      m = m*10 + (c - '0');
+      nSig++;
+    }
+  }
+  if( c=='e' || c=='E' ){
+    int i = 1, neg = 0, x = 0;
+    if( z[1]=='+' || z[1]=='-' ){
+      neg = z[1]=='-';
+      i = 2;
+    }
+    if( z[i]>='0' && z[i]<='9' ){
+      for(z+=i; (c = z[0])>='0' && c<='9'; z++){
+        if( x>10000 ) return 0;
+        x = x*10 + (c - '0');
+      }
+      e += neg ? -x : x;
+    }
+  }
+  if( m>((unsigned long long)1)<<53 ) return 0;
+  if( m==0 || e==0 ){
+    *pr = (PNum)m;
+  }else if( e>0 && e<(int)count(pik_aPow10) ){
+    *pr = (PNum)m * pik_aPow10[e];
+  }else if( e<0 && -e<(int)count(pik_aPow10) ){
+    *pr = (PNum)m / pik_aPow10[-e];
+  }else{
+    return 0;
+  }
+  *pzEnd = z;
+  return 1;
+#else
+  /* Extended precision arithmetic could round twice */
+  UNUSED_PARAMETER(z);
+  UNUSED_PARAMETER(pr);
+  UNUSED_PARAMETER(pzEnd);
+  return 0;
+#endif
 }
 
 /* Convert a numeric literal into a number.  Return that number.
@@ -5435,12 +6522,16 @@ static void pik_elem_free(Pik *p, PObj *pObj){
 ** is specified, the conversion happens automatically.
 */
 PNum pik_atof(PToken *num){
-  char *endptr;
+  const char *endptr;
   PNum ans;
   if( num->n>=3 && num->z[0]=='0' && (num->z[1]=='x'||num->z[1]=='X') ){
     return (PNum)strtol(num->z+2, 0, 16);
   }
-  ans = strtod(num->z, &endptr);
+  if( !pik_fast_atof(num->z, &ans, &endptr) ){
+    char *zEnd;
+    ans = strtod(num->z, &zEnd);
+    endptr = zEnd;
+  }
   if( (int)(endptr - num->z)==(int)num->n-2 ){
     char c1 = endptr[0];
     char c2 = endptr[1];
@@ -5503,10 +6594,56 @@ static void pik_bbox_addbox(PBox *pA, PBox *pB){
     *pA = *pB;
   }
   if( pik_bbox_isempty(pB) ) return;
+#ifdef PIK_SSE2
+  _mm_storeu_pd(&pA->sw.x,
+      _mm_min_pd(_mm_loadu_pd(&pB->sw.x), _mm_loadu_pd(&pA->sw.x)));
+  _mm_storeu_pd(&pA->ne.x,
+      _mm_max_pd(_mm_loadu_pd(&pB->ne.x), _mm_loadu_pd(&pA->ne.x)));
+#else
   if( pA->sw.x>pB->sw.x ) pA->sw.x = pB->sw.x;
   if( pA->sw.y>pB->sw.y ) pA->sw.y = pB->sw.y;
   if( pA->ne.x<pB->ne.x ) pA->ne.x = pB->ne.x;
   if( pA->ne.y<pB->ne.y ) pA->ne.y = pB->ne.y;
+#endif
+}
+
+/* Enlarge the PBox of the first argument so that it contains all n
+** points in a[].
+**
+** With SSE2, a whole point fits in one register, and so do each of
+** the sw and ne corners, so every point costs one min and one max
+** with no branches.  _mm_min_pd() and _mm_max_pd() return their second
+** operand when the two are equal or unordered, so with the running
+** corner as the second operand the result is the same as for
+** pik_bbox_add_xy(), down to the sign of zero.
+*/
+static void pik_bbox_add_points(PBox *pA, const PPoint *a, int n){
+  int i = 0;
+  if( n<=0 ) return;
+  if( pik_bbox_isempty(pA) ){
+    pA->sw = pA->ne = a[0];
+    i = 1;
+  }
+#ifdef PIK_SSE2
+  {
+    __m128d sw = _mm_loadu_pd(&pA->sw.x);
+    __m128d ne = _mm_loadu_pd(&pA->ne.x);
+    for(; i<n; i++){
+      __m128d pt = _mm_loadu_pd(&a[i].x);
+      sw = _mm_min_pd(pt, sw);
+      ne = _mm_max_pd(pt, ne);
+    }
+    _mm_storeu_pd(&pA->sw.x, sw);
+    _mm_storeu_pd(&pA->ne.x, ne);
+  }
+#else
+  for(; i<n; i++){
+    if( pA->sw.x>a[i].x ) pA->sw.x = a[i].x;
+    if( pA->sw.y>a[i].y ) pA->sw.y = a[i].y;
+    if( pA->ne.x<a[i].x ) pA->ne.x = a[i].x;
+    if( pA->ne.y<a[i].y ) pA->ne.y = a[i].y;
+  }
+#endif
 }
 
 /* Enlarge the PBox of the first argument, if necessary, so that
@@ -5551,8 +6688,13 @@ static void pik_bbox_addellipse(PBox *pA, PNum x, PNum y, PNum rx, PNum ry){
 */
 static PList *pik_elist_append(Pik *p, PList *pList, PObj *pObj){
   if( pObj==0 ) return pList;
+  if( pList==0 && p->pResume && p->list==p->pResume ){
+    /* First new top-level object after resuming a session */
+    pList = p->pResume;
+    p->pResume = 0;
+  }
   if( pList==0 ){
-    pList = malloc(sizeof(*pList));
+    pList = pik_malloc(sizeof(*pList));
     if( pList==0 ){
       pik_error(p, 0, 0);
       pik_elem_free(p, pObj);
@@ -5562,7 +6704,7 @@ static PList *pik_elist_append(Pik *p, PList *pList, PObj *pObj){
   }
   if( pList->n>=pList->nAlloc ){
     int nNew = (pList->n+5)*2;
-    PObj **pNew = realloc(pList->a, sizeof(PObj*)*nNew);
+    PObj **pNew = pik_realloc(pList->a, sizeof(PObj*)*nNew);
     if( pNew==0 ){
       pik_error(p, 0, 0);
       pik_elem_free(p, pObj);
@@ -5609,13 +6751,13 @@ static PObj *pik_elem_new(Pik *p, PToken *pId, PToken *pStr,PList *pSublist){
   int miss = 0;
 
   if( p->nErr ) return 0;
-  pNew = malloc( sizeof(*pNew) );
+  pNew = pik_obj_new(&p->pOpen);
   if( pNew==0 ){
     pik_error(p,0,0);
     pik_elist_free(p, pSublist);
     return 0;
   }
-  memset(pNew, 0, sizeof(*pNew));
+  if( p->pStats ) p->pStats->nObj++;
   p->cur = pNew;
   p->nTPath = 1;
   p->thenFlag = 0;
@@ -5701,7 +6843,7 @@ static void pik_add_macro(
 ){
   PMacro *pNew = pik_find_macro(p, pId);
   if( pNew==0 ){
-    pNew = malloc( sizeof(*pNew) );
+    pNew = pik_malloc( sizeof(*pNew) );
     if( pNew==0 ){
       pik_error(p, 0, 0);
       return;
@@ -5713,6 +6855,7 @@ static void pik_add_macro(
   pNew->macroBody.z = pCode->z+1;
   pNew->macroBody.n = pCode->n-2;
   pNew->inUse = 0;
+  p->nEdit++;
 }
 
 
@@ -6472,7 +7615,7 @@ static void pik_set_var(Pik *p, PToken *pId, PNum val, PToken *pOp){
   }
   if( pVar==0 ){
     char *z;
-    pVar = malloc( pId->n+1 + sizeof(*pVar) );
+    pVar = pik_malloc( pId->n+1 + sizeof(*pVar) );
     if( pVar==0 ){
       pik_error(p, 0, 0);
       return;
@@ -6498,6 +7641,7 @@ static void pik_set_var(Pik *p, PToken *pId, PNum val, PToken *pOp){
     default:      pVar->val = val; break;
   }
   p->bLayoutVars = 0;  /* Clear the layout setting cache */
+  p->nEdit++;
 }
 
 /*
@@ -6527,6 +7671,7 @@ static int pik_round(PNum v){
 static PNum pik_value(Pik *p, const char *z, int n, int *pMiss){
   PVar *pVar;
   int first, last, mid, c;
+  if( p->pStats ) p->pStats->nVarLookup++;
   for(pVar=p->pVar; pVar; pVar=pVar->pNext){
     if( strncmp(pVar->zName,z,n)==0 && pVar->zName[n]==0 ){
       return pVar->val;
@@ -6900,8 +8045,8 @@ static PNum pik_func(Pik *p, PToken *pFunc, PNum x, PNum y){
 static void pik_elem_setname(Pik *p, PObj *pObj, PToken *pName){
   if( pObj==0 ) return;
   if( pName==0 ) return;
-  free(pObj->zName);
-  pObj->zName = malloc(pName->n+1);
+  pik_free(pObj->zName);
+  pObj->zName = pik_malloc(pName->n+1);
   if( pObj->zName==0 ){
     pik_error(p,0,0);
   }else{
@@ -6963,8 +8108,10 @@ static void pik_after_adding_attributes(Pik *p, PObj *pObj){
   int i;
   PPoint ofst;
   PNum dx, dy;
+  int ePrior;
 
   if( p->nErr ) return;
+  ePrior = pik_stats_phase(p, PIK_PHASE_LAYOUT);
 
   /* Position block objects */
   if( pObj->type->isLine==0 ){
@@ -7025,16 +8172,20 @@ static void pik_after_adding_attributes(Pik *p, PObj *pObj){
   /* Run object-specific code */
   if( pObj->type->xCheck!=0 ){
     pObj->type->xCheck(p,pObj);
-    if( p->nErr ) return;
+    if( p->nErr ){
+      pik_stats_phase(p, ePrior);
+      return;
+    }
   }
 
   /* Compute final bounding box, entry and exit points, center
   ** point (ptAt) and path for the object
   */
   if( pObj->type->isLine ){
-    pObj->aPath = malloc( sizeof(PPoint)*p->nTPath );
+    pObj->aPath = pik_malloc( sizeof(PPoint)*p->nTPath );
     if( pObj->aPath==0 ){
       pik_error(p, 0, 0);
+      pik_stats_phase(p, ePrior);
       return;
     }else{
       pObj->nPath = p->nTPath;
@@ -7062,9 +8213,7 @@ static void pik_after_adding_attributes(Pik *p, PObj *pObj){
     ** center of a line is halfway between its .start and .end.  For
     ** straight lines, this is the same point, but for multi-segment
     ** lines the result is usually diferent */
-    for(i=0; i<pObj->nPath; i++){
-      pik_bbox_add_xy(&pObj->bbox, pObj->aPath[i].x, pObj->aPath[i].y);
-    }
+    pik_bbox_add_points(&pObj->bbox, pObj->aPath, pObj->nPath);
     pObj->ptAt.x = (pObj->bbox.ne.x + pObj->bbox.sw.x)/2.0;
     pObj->ptAt.y = (pObj->bbox.ne.y + pObj->bbox.sw.y)/2.0;
 
@@ -7101,6 +8250,151 @@ static void pik_after_adding_attributes(Pik *p, PObj *pObj){
     pik_bbox_add_xy(&pObj->bbox, pObj->ptAt.x + w2, pObj->ptAt.y + h2);
   }
   p->eDir = (unsigned char)pObj->outDir;
+  pik_stats_phase(p, ePrior);
+}
+
+/*
+** Append to the output of pKey a description of everything about pObj
+** that affects its rendering, with positions relative to pOrig.  Two
+** objects with the same description render the same, except for
+** position.  Distances are rounded to 1/10000th of a pixel so that
+** copies made at different places still compare equal.  A distance too
+** large to round to an integer sets pKey->bKeyRange, and the object is
+** then not drawn as a symbol.
+*/
+static long long pik_symbol_round(Pik *pKey, Pik *p, PNum v){
+  v = floor(p->rScale*v*10000.0 + 0.5);
+  if( !(v>-1e15 && v<1e15) ){
+    pKey->bKeyRange = 1;
+    return 0;
+  }
+  return (long long)v;
+}
+static void pik_symbol_key(Pik *pKey, Pik *p, PObj *pObj, PPoint *pOrig){
+  char buf[300];
+  int i;
+  snprintf(buf, sizeof(buf)-1,
+     "%s %lld,%lld %lld %lld %lld %lld %lld %lld %.17g %.17g"
+     " %d%d%d%d %d %d %d\n",
+     pObj->type->zName,
+     pik_symbol_round(pKey, p, pObj->ptAt.x - pOrig->x),
+     pik_symbol_round(pKey, p, pObj->ptAt.y - pOrig->y),
+     pik_symbol_round(pKey, p, pObj->w),
+     pik_symbol_round(pKey, p, pObj->h),
+     pik_symbol_round(pKey, p, pObj->rad),
+     pik_symbol_round(pKey, p, pObj->sw),
+     pik_symbol_round(pKey, p, pObj->dotted),
+     pik_symbol_round(pKey, p, pObj->dashed),
+     pObj->fill, pObj->color, pObj->cw, pObj->larrow, pObj->rarrow,
+     pObj->bClose, pObj->iLayer, pObj->nTxt, pObj->nPath);
+  buf[sizeof(buf)-1] = 0;
+  pik_append(pKey, buf, -1);
+  for(i=0; i<pObj->nTxt; i++){
+    snprintf(buf, sizeof(buf)-1, "%d %u:", pObj->aTxt[i].eCode,
+             pObj->aTxt[i].n);
+    buf[sizeof(buf)-1] = 0;
+    pik_append(pKey, buf, -1);
+    pik_append(pKey, pObj->aTxt[i].z, pObj->aTxt[i].n);
+  }
+  for(i=0; i<pObj->nPath; i++){
+    snprintf(buf, sizeof(buf)-1, " %lld,%lld",
+             pik_symbol_round(pKey, p, pObj->aPath[i].x - pOrig->x),
+             pik_symbol_round(pKey, p, pObj->aPath[i].y - pOrig->y));
+    buf[sizeof(buf)-1] = 0;
+    pik_append(pKey, buf, -1);
+  }
+  if( pObj->pSublist ){
+    PList *pList = pObj->pSublist;
+    snprintf(buf, sizeof(buf)-1, " [%d\n", pList->n);
+    buf[sizeof(buf)-1] = 0;
+    pik_append(pKey, buf, -1);
+    for(i=0; i<pList->n; i++){
+      pik_symbol_key(pKey, p, pList->a[i], pOrig);
+    }
+    pik_append(pKey, "]", 1);
+  }
+  pik_append(pKey, "\n", 1);
+}
+
+/* Find the symbol for pObj, creating it if necessary.  Return its
+** index in p->aSym[], or -1 if it cannot be used.
+*/
+static int pik_symbol_find(Pik *p, PObj *pObj){
+  Pik k;        /* Only the output buffer of k is used */
+  int j = -1;
+  memset(&k, 0, sizeof(k));
+  pik_symbol_key(&k, p, pObj, &pObj->ptAt);
+  if( k.nErr ){
+    pik_error(p, 0, 0);
+  }else if( !k.bKeyRange ){
+    j = pik_intern(p, &p->aSym, &p->nSym, &p->nSymAlloc, k.zOut, k.nOut);
+  }
+  pik_free(k.zOut);
+  return j;
+}
+
+/* Count how often each distinct object appears in pList and its
+** sublists, in preparation for PIKCHR_SYMBOLS rendering.
+*/
+static void pik_symbol_count(Pik *p, PList *pList){
+  int i, j;
+  for(i=0; i<pList->n && p->nErr==0; i++){
+    PObj *pObj = pList->a[i];
+    if( pObj->type->xRender==0 && pObj->nTxt==0 && pObj->pSublist==0 ){
+      continue;   /* Nothing to draw */
+    }
+    j = pik_symbol_find(p, pObj);
+    if( j>=0 ) p->aSym[j].nRef++;
+    if( pObj->pSublist ) pik_symbol_count(p, pObj->pSublist);
+  }
+}
+
+/*
+** If pObj appears more than once in the diagram, render it as a <use>
+** of a symbol and return true.  The first time a symbol is used, its
+** markup is generated by rendering pObj as if its center were at the
+** origin.  Return false if pObj should be rendered normally.
+*/
+static int pik_symbol_render(Pik *p, PObj *pObj){
+  int j;
+  PShared *pSym;
+  if( pObj->type->xRender==0 && pObj->nTxt==0 && pObj->pSublist==0 ){
+    return 0;
+  }
+  j = pik_symbol_find(p, pObj);
+  if( j<0 || p->aSym[j].nRef<2 ) return 0;
+  if( p->aSym[j].zBody==0 ){
+    PBox savedBox = p->bbox;
+    unsigned int iStart = p->nOut;
+    char *zBody;
+    p->bbox.sw.x = pObj->ptAt.x;
+    p->bbox.ne.y = pObj->ptAt.y;
+    if( pObj->type->xRender ) pObj->type->xRender(p, pObj);
+    if( pObj->pSublist ) pik_elist_render(p, pObj->pSublist);
+    p->bbox = savedBox;
+    if( p->nErr ) return 1;
+    zBody = pik_malloc( p->nOut - iStart + 1 );
+    if( zBody==0 ){
+      pik_error(p, 0, 0);
+      return 1;
+    }
+    memcpy(zBody, p->zOut+iStart, p->nOut - iStart);
+    zBody[p->nOut - iStart] = 0;
+    p->nOut = iStart;
+    p->aSym[j].zBody = zBody;   /* aSym[] might have moved while rendering */
+    p->aSym[j].hBody = pik_hash(p->aSym[j].h, zBody,
+                                (unsigned int)strlen(zBody));
+  }
+  pSym = &p->aSym[j];
+  if( pSym->zBody[0]==0 ) return 1;
+  {
+    char buf[40];
+    snprintf(buf, sizeof(buf), "<use href=\"#pks%llx\"", pSym->hBody);
+    pik_append(p, buf, -1);
+  }
+  pik_append_x(p, " x=\"", pObj->ptAt.x, "\"");
+  pik_append_y(p, " y=\"", pObj->ptAt.y, "\" />\n");
+  return 1;
 }
 
 /* Show basic information about each object as a comment in the
@@ -7137,40 +8431,205 @@ static void pik_elem_render(Pik *p, PObj *pObj){
   pik_append(p, " -->\n", -1);
 }
 
-/* Render a list of objects
+#ifndef PIKCHR_NO_THREADS
+/* Fill aOrder[] with the objects of pList in the order that
+** pik_elist_render() draws them: by layer, and in list order within
+** each layer.  Return the number of objects.
 */
-void pik_elist_render(Pik *p, PList *pList){
-  int i;
+static int pik_layer_order(PList *pList, PObj **aOrder){
+  int i, n = 0;
   int iNextLayer = 0;
   int iThisLayer;
   int bMoreToDo;
-  int miss = 0;
-  int mDebug = pik_value_int(p, "debug", 5, 0);
-  PNum colorLabel;
   do{
     bMoreToDo = 0;
     iThisLayer = iNextLayer;
     iNextLayer = 0x7fffffff;
     for(i=0; i<pList->n; i++){
       PObj *pObj = pList->a[i];
-      void (*xRender)(Pik*,PObj*);
       if( pObj->iLayer>iThisLayer ){
         if( pObj->iLayer<iNextLayer ) iNextLayer = pObj->iLayer;
         bMoreToDo = 1;
-        continue; /* Defer until another round */
-      }else if( pObj->iLayer<iThisLayer ){
-        continue;
-      }
-      if( mDebug & 1 ) pik_elem_render(p, pObj);
-      xRender = pObj->type->xRender;
-      if( xRender ){
-        xRender(p, pObj);
-      }
-      if( pObj->pSublist ){
-        pik_elist_render(p, pObj->pSublist);
+      }else if( pObj->iLayer==iThisLayer ){
+        aOrder[n++] = pObj;
       }
     }
   }while( bMoreToDo );
+  return n;
+}
+
+/* A run of consecutive objects rendered by pik_elist_render_parallel() */
+typedef struct PRenderChunk PRenderChunk;
+struct PRenderChunk {
+  Pik w;                   /* Private copy of the context */
+  pikchr_stats sStats;     /* Private statistics */
+  int iFirst;              /* Index in aOrder[] of the first object */
+  int nObj;                /* Number of objects */
+};
+typedef struct PRenderJob PRenderJob;
+struct PRenderJob {
+  PObj **aOrder;           /* Objects in the order they are rendered */
+  PRenderChunk *aChunk;    /* The chunks */
+};
+
+/* Render chunk i of the PRenderJob pArg */
+static void pik_render_chunk(void *pArg, int i){
+  PRenderJob *pJob = (PRenderJob*)pArg;
+  PRenderChunk *pC = &pJob->aChunk[i];
+  int k;
+  for(k=0; k<pC->nObj && pC->w.nErr==0; k++){
+    PObj *pObj = pJob->aOrder[pC->iFirst+k];
+    if( pObj->type->xRender ) pObj->type->xRender(&pC->w, pObj);
+    if( pObj->pSublist ) pik_elist_render(&pC->w, pObj->pSublist);
+  }
+}
+
+/* Remove entries of a pik_intern() list after the first nKeep */
+static void pik_intern_truncate(PShared *a, int *pnList, int nAlloc, int nKeep){
+  if( *pnList<=nKeep ) return;
+  while( *pnList>nKeep ){
+    (*pnList)--;
+    pik_free(a[*pnList].zDecl);
+    pik_free(a[*pnList].zBody);
+  }
+  pik_intern_reindex(a, nKeep, nAlloc);
+}
+#endif /* PIKCHR_NO_THREADS */
+
+/*
+** Render the objects of a long list on several threads.  Each thread
+** renders chunks of consecutive objects into its own copy of the
+** context.  The chunks are then joined in order, and the colors, styles,
+** and markers that each one used are added in order, so that the result
+** is the same as serial rendering.  Return 1 on success.  Return 0, with
+** nothing rendered, if the list is short or if serial rendering would
+** have come out differently, as when two styles have the same hash.
+*/
+static int pik_elist_render_parallel(Pik *p, PList *pList){
+#ifndef PIKCHR_NO_THREADS
+  PRenderJob job;
+  int nThread, nChunk, nObj, i, k;
+  int ok = 1;
+  unsigned int nOut0 = p->nOut;
+  int nClr0 = p->nClr;
+  int nStyle0 = p->nStyle;
+  int nMarker0 = p->nMarker;
+
+  if( pList->n<PIKCHR_PARALLEL_MIN || p->nSym || p->nErr ) return 0;
+  nThread = pik_render_threads();
+  if( nThread<2 ) return 0;
+  nChunk = nThread*4;
+  if( nChunk>pList->n ) nChunk = pList->n;
+  job.aOrder = pik_malloc( sizeof(job.aOrder[0])*pList->n );
+  job.aChunk = pik_calloc( nChunk, sizeof(job.aChunk[0]) );
+  if( job.aOrder==0 || job.aChunk==0 ){
+    pik_free(job.aOrder);
+    pik_free(job.aChunk);
+    return 0;
+  }
+  nObj = pik_layer_order(pList, job.aOrder);
+  for(i=0; i<nChunk; i++){
+    PRenderChunk *pC = &job.aChunk[i];
+    pC->w = *p;
+    pC->w.zOut = 0;
+    pC->w.nOut = pC->w.nOutAlloc = 0;
+    pC->w.aClr = 0;
+    pC->w.nClr = pC->w.nClrAlloc = 0;
+    pC->w.aStyle = 0;
+    pC->w.nStyle = pC->w.nStyleAlloc = 0;
+    pC->w.aMarker = 0;
+    pC->w.nMarker = pC->w.nMarkerAlloc = 0;
+    pC->w.pStats = p->pStats ? &pC->sStats : 0;
+    pC->iFirst = (int)((size_t)nObj*i/nChunk);
+    pC->nObj = (int)((size_t)nObj*(i+1)/nChunk) - pC->iFirst;
+  }
+  pik_parallel(nChunk, nThread, pik_render_chunk, &job);
+
+  for(i=0; i<nChunk && ok; i++){
+    Pik *w = &job.aChunk[i].w;
+    if( w->nErr ){
+      ok = 0;
+      break;
+    }
+    if( w->nOut ) pik_append(p, w->zOut, (int)w->nOut);
+    for(k=0; k<w->nClr; k++){
+      pik_css_color_add(p, w->aClr[k] & 0xffffff, w->aClr[k]>>24);
+    }
+    for(k=0; k<w->nStyle && ok; k++){
+      const char *z = w->aStyle[k].zDecl;
+      ok = pik_intern(p, &p->aStyle, &p->nStyle, &p->nStyleAlloc,
+                      z, (unsigned int)strlen(z))>=0;
+    }
+    for(k=0; k<w->nMarker && ok; k++){
+      const char *z = w->aMarker[k].zDecl;
+      ok = pik_intern(p, &p->aMarker, &p->nMarker, &p->nMarkerAlloc,
+                      z, (unsigned int)strlen(z))>=0;
+    }
+    if( p->nErr ) ok = 0;
+  }
+  if( !ok ){
+    p->nOut = nOut0;
+    p->nClr = nClr0;
+    pik_intern_truncate(p->aStyle, &p->nStyle, p->nStyleAlloc, nStyle0);
+    pik_intern_truncate(p->aMarker, &p->nMarker, p->nMarkerAlloc, nMarker0);
+  }
+  for(i=0; i<nChunk; i++){
+    Pik *w = &job.aChunk[i].w;
+    if( ok && p->pStats ){
+      p->pStats->nVarLookup += job.aChunk[i].sStats.nVarLookup;
+    }
+    pik_free(w->zOut);
+    pik_free(w->aClr);
+    pik_intern_free(&w->aStyle, &w->nStyle, &w->nStyleAlloc);
+    pik_intern_free(&w->aMarker, &w->nMarker, &w->nMarkerAlloc);
+  }
+  pik_free(job.aOrder);
+  pik_free(job.aChunk);
+  return ok;
+#else
+  UNUSED_PARAMETER(p);
+  UNUSED_PARAMETER(pList);
+  return 0;
+#endif
+}
+
+/* Render a list of objects
+*/
+void pik_elist_render(Pik *p, PList *pList){
+  int i;
+  int iNextLayer = 0;
+  int iThisLayer;
+  int bMoreToDo;
+  int miss = 0;
+  int mDebug = pik_value_int(p, "debug", 5, 0);
+  PNum colorLabel;
+  if( (mDebug & 1)!=0 || !pik_elist_render_parallel(p, pList) ){
+    do{
+      bMoreToDo = 0;
+      iThisLayer = iNextLayer;
+      iNextLayer = 0x7fffffff;
+      for(i=0; i<pList->n; i++){
+        PObj *pObj = pList->a[i];
+        void (*xRender)(Pik*,PObj*);
+        if( pObj->iLayer>iThisLayer ){
+          if( pObj->iLayer<iNextLayer ) iNextLayer = pObj->iLayer;
+          bMoreToDo = 1;
+          continue; /* Defer until another round */
+        }else if( pObj->iLayer<iThisLayer ){
+          continue;
+        }
+        if( mDebug & 1 ) pik_elem_render(p, pObj);
+        if( p->nSym && pik_symbol_render(p, pObj) ) continue;
+        xRender = pObj->type->xRender;
+        if( xRender ){
+          xRender(p, pObj);
+        }
+        if( pObj->pSublist ){
+          pik_elist_render(p, pObj->pSublist);
+        }
+      }
+    }while( bMoreToDo );
+  }
 
   /* If the color_debug_label value is defined, then go through
   ** and paint a dot at every label location */
@@ -7196,32 +8655,88 @@ void pik_elist_render(Pik *p, PList *pList){
   }
 }
 
-/* Add all objects of the list pList to the bounding box
+/* Add all objects of the list pList to the bounding box pBox
 */
-static void pik_bbox_add_elist(Pik *p, PList *pList, PNum wArrow){
+static void pik_bbox_add_elist(Pik *p, PList *pList, PNum wArrow, PBox *pBox){
   int i;
   for(i=0; i<pList->n; i++){
     PObj *pObj = pList->a[i];
-    if( pObj->sw>=0.0 ) pik_bbox_addbox(&p->bbox, &pObj->bbox);
-    pik_append_txt(p, pObj, &p->bbox);
-    if( pObj->pSublist ) pik_bbox_add_elist(p, pObj->pSublist, wArrow);
+    if( pObj->sw>=0.0 ) pik_bbox_addbox(pBox, &pObj->bbox);
+    pik_append_txt(p, pObj, pBox);
+    if( pObj->pSublist ) pik_bbox_add_elist(p, pObj->pSublist, wArrow, pBox);
 
 
     /* Expand the bounding box to account for arrowheads on lines */
     if( pObj->type->isLine && pObj->nPath>0 ){
       if( pObj->larrow ){
-        pik_bbox_addellipse(&p->bbox, pObj->aPath[0].x, pObj->aPath[0].y,
+        pik_bbox_addellipse(pBox, pObj->aPath[0].x, pObj->aPath[0].y,
                             wArrow, wArrow);
       }
       if( pObj->rarrow ){
         int j = pObj->nPath-1;
-        pik_bbox_addellipse(&p->bbox, pObj->aPath[j].x, pObj->aPath[j].y,
+        pik_bbox_addellipse(pBox, pObj->aPath[j].x, pObj->aPath[j].y,
                             wArrow, wArrow);
       }
     }
   }
 }
 
+#ifndef PIKCHR_NO_THREADS
+/* Bounding boxes of chunks of a list, for pik_bbox_add_elist_parallel() */
+typedef struct PBboxJob PBboxJob;
+struct PBboxJob {
+  Pik *p;                  /* The context.  Only read */
+  PList *pList;            /* The whole list */
+  PNum wArrow;             /* Width of arrowheads */
+  int nChunk;              /* Number of chunks */
+  PBox *aBox;              /* Bounding box of each chunk */
+};
+
+/* Compute the bounding box of chunk i of the PBboxJob pArg */
+static void pik_bbox_chunk(void *pArg, int i){
+  PBboxJob *pJob = (PBboxJob*)pArg;
+  int n = pJob->pList->n;
+  int iFirst = (int)((size_t)n*i/pJob->nChunk);
+  PList sub;
+  sub.n = sub.nAlloc = (int)((size_t)n*(i+1)/pJob->nChunk) - iFirst;
+  sub.a = pJob->pList->a + iFirst;
+  pik_bbox_init(&pJob->aBox[i]);
+  pik_bbox_add_elist(pJob->p, &sub, pJob->wArrow, &pJob->aBox[i]);
+}
+#endif /* PIKCHR_NO_THREADS */
+
+/* Add all objects of the list pList to the bounding box pBox, using
+** several threads for a long list.  Each thread computes the bounding
+** box of chunks of consecutive objects, and those are then added to
+** pBox in order.
+*/
+static void pik_bbox_add_elist_parallel(
+  Pik *p,
+  PList *pList,
+  PNum wArrow,
+  PBox *pBox
+){
+#ifndef PIKCHR_NO_THREADS
+  int nThread;
+  if( pList->n>=PIKCHR_PARALLEL_MIN*4 && (nThread = pik_render_threads())>1 ){
+    PBboxJob job;
+    job.p = p;
+    job.pList = pList;
+    job.wArrow = wArrow;
+    job.nChunk = nThread*4;
+    job.aBox = pik_malloc( sizeof(job.aBox[0])*job.nChunk );
+    if( job.aBox ){
+      int i;
+      pik_parallel(job.nChunk, nThread, pik_bbox_chunk, &job);
+      for(i=0; i<job.nChunk; i++) pik_bbox_addbox(pBox, &job.aBox[i]);
+      pik_free(job.aBox);
+      return;
+    }
+  }
+#endif
+  pik_bbox_add_elist(p, pList, wArrow, pBox);
+}
+
 /* Recompute key layout parameters from variables. */
 static void pik_compute_layout_settings(Pik *p){
   PNum thickness;  /* Line thickness */
@@ -7239,88 +8754,275 @@ static void pik_compute_layout_settings(Pik *p){
   p->rScale = 144.0;
   p->charWidth = pik_value(p,"charwid",7,0)*p->fontScale;
   p->charHeight = pik_value(p,"charht",6,0)*p->fontScale;
+  p->rSimplify = pik_value(p,"simplify",8,0)/p->rScale;
   p->bLayoutVars = 1;
 }
 
+/* Insert n bytes of text z[] into the output at offset iOff, moving
+** everything after it down.
+*/
+static void pik_insert(Pik *p, unsigned int iOff, const char *z, int n){
+  unsigned int nOld = p->nOut;
+  if( n<0 ) n = (int)strlen(z);
+  if( n==0 ) return;
+  pik_append(p, z, n);
+  if( p->nOut!=nOld+n ) return;   /* Out of memory */
+  memmove(p->zOut+iOff+n, p->zOut+iOff, nOld-iOff);
+  memcpy(p->zOut+iOff, z, n);
+}
+
+/*
+** Remove unneeded whitespace from the SVG that starts at p->zOut[iStart]
+** for PIKCHR_COMPACT.  Within a tag, and outside of quoted attribute
+** values, runs of whitespace become a single space and whitespace in
+** front of ">" or "/>" is dropped.  Whitespace that contains a newline
+** between two tags is dropped.  The final newline is kept.
+*/
+static void pik_compact_space(Pik *p, unsigned int iStart){
+  char *z = p->zOut;
+  unsigned int i, j = iStart;
+  unsigned int n = p->nOut;
+  int inTag = 0;       /* Within <...> */
+  char cQuote = 0;     /* The quote character of an attribute value */
+  if( n>iStart && z[n-1]=='\n' ) n--;
+  for(i=iStart; i<n; i++){
+    char c = z[i];
+    if( cQuote ){
+      if( c==cQuote ) cQuote = 0;
+    }else if( inTag ){
+      if( c=='"' || c=='\'' ){
+        cQuote = c;
+      }else if( c=='>' ){
+        inTag = 0;
+      }else if( IsSpace(c) ){
+        while( i+1<n && IsSpace(z[i+1]) ) i++;
+        if( i+1<n && (z[i+1]=='>' || (i+2<n && z[i+1]=='/' && z[i+2]=='>')) ){
+          continue;
+        }
+        c = ' ';
+      }
+    }else if( c=='<' ){
+      inTag = 1;
+    }else if( IsSpace(c) && j>iStart && z[j-1]=='>' ){
+      unsigned int k = i;
+      int bNL = 0;
+      while( k<n && IsSpace(z[k]) ){
+        if( z[k]=='\n' ) bNL = 1;
+        k++;
+      }
+      if( bNL && (k==n || z[k]=='<') ){
+        i = k-1;
+        continue;
+      }
+    }
+    z[j++] = c;
+  }
+  if( n<p->nOut ) z[j++] = '\n';
+  z[j] = 0;
+  p->nOut = j;
+}
+
+/* Add the text that was collected while rendering just after the <svg>
+** start tag: the arrowhead markers for PIKCHR_ARROW_MARKERS and the
+** symbols for PIKCHR_SYMBOLS in a <defs> element, then the classes for
+** PIKCHR_CSS_CLASSES and the dark mode colors for PIKCHR_CSS_COLORS in a
+** <style> element.
+*/
+static void pik_svg_head(Pik *p){
+  Pik h;           /* Only the output buffer of h is used */
+  int i;
+  int nSym = 0;    /* Number of symbols actually used */
+  char buf[100];
+  for(i=0; i<p->nSym; i++){
+    if( p->aSym[i].zBody && p->aSym[i].zBody[0] ) nSym++;
+  }
+  if( p->nClr==0 && p->nStyle==0 && p->nMarker==0 && nSym==0 ) return;
+  memset(&h, 0, sizeof(h));
+  if( p->nMarker || nSym ){
+    pik_append(&h, "<defs>", -1);
+    for(i=0; i<p->nMarker; i++){
+      snprintf(buf, sizeof(buf)-1, "<marker id=\"pkm%llx\"", p->aMarker[i].h);
+      buf[sizeof(buf)-1] = 0;
+      pik_append(&h, buf, -1);
+      pik_append(&h, p->aMarker[i].zDecl, -1);
+      pik_append(&h, "</marker>", -1);
+    }
+    for(i=0; i<p->nSym; i++){
+      if( p->aSym[i].zBody==0 || p->aSym[i].zBody[0]==0 ) continue;
+      snprintf(buf, sizeof(buf)-1, "\n<g id=\"pks%llx\">\n", p->aSym[i].hBody);
+      buf[sizeof(buf)-1] = 0;
+      pik_append(&h, buf, -1);
+      pik_append(&h, p->aSym[i].zBody, -1);
+      pik_append(&h, "</g>", -1);
+    }
+    pik_append(&h, "</defs>\n", -1);
+  }
+  if( p->nClr || p->nStyle ){
+    pik_append(&h, "<style>", -1);
+    for(i=0; i<p->nStyle; i++){
+      snprintf(buf, sizeof(buf)-1, ".pk%llx{", p->aStyle[i].h);
+      buf[sizeof(buf)-1] = 0;
+      pik_append(&h, buf, -1);
+      pik_append(&h, p->aStyle[i].zDecl, -1);
+      pik_append(&h, "}", 1);
+    }
+    if( p->nClr ){
+      pik_append(&h, "@media (prefers-color-scheme:dark){:root{", -1);
+      for(i=0; i<p->nClr; i++){
+        int bg = (p->aClr[i] & 0x1000000)!=0;
+        int x = p->aClr[i] & 0xffffff;
+        int d = pik_color_to_dark_mode(x, bg);
+        snprintf(buf, sizeof(buf)-1, "--pikchr-%c%06x:rgb(%d,%d,%d);",
+                 bg ? 'b' : 'f', x, (d>>16)&0xff, (d>>8)&0xff, d&0xff);
+        buf[sizeof(buf)-1] = 0;
+        pik_append(&h, buf, -1);
+      }
+      pik_append(&h, "}}", 2);
+    }
+    pik_append(&h, "</style>\n", -1);
+  }
+  if( h.nErr ){
+    pik_error(p, 0, 0);
+  }else{
+    pik_insert(p, p->iHead, h.zOut, (int)h.nOut);
+  }
+  pik_free(h.zOut);
+}
+
+/* Compute the bounding box of the whole diagram in pList, including
+** margins, and store it in p->bbox.
+*/
+static void pik_render_bbox(Pik *p, PList *pList){
+  PNum thickness;  /* Stroke width */
+  PNum margin;     /* Extra bounding box margin */
+  PNum wArrow;
+  int ePrior = pik_stats_phase(p, PIK_PHASE_BBOX);
+
+  /* Set up rendering parameters */
+  pik_compute_layout_settings(p);
+  thickness = pik_value(p,"thickness",9,0);
+  if( thickness<=0.01 ) thickness = 0.01;
+  margin = pik_value(p,"margin",6,0);
+  margin += thickness;
+  wArrow = p->wArrow*thickness;
+
+  /* Compute a bounding box over all objects so that we can know
+  ** how big to declare the SVG canvas */
+  pik_bbox_init(&p->bbox);
+  pik_bbox_add_elist_parallel(p, pList, wArrow, &p->bbox);
+
+  /* Expand the bounding box slightly to account for line thickness
+  ** and the optional "margin = EXPR" setting. */
+  p->bbox.ne.x += margin + pik_value(p,"rightmargin",11,0);
+  p->bbox.ne.y += margin + pik_value(p,"topmargin",9,0);
+  p->bbox.sw.x -= margin + pik_value(p,"leftmargin",10,0);
+  p->bbox.sw.y -= margin + pik_value(p,"bottommargin",12,0);
+  pik_stats_phase(p, ePrior);
+}
+
+/* Write the SVG for the list of objects in pList into p->zOut.  The
+** bounding box in p->bbox must already have been computed by
+** pik_render_bbox().  The object list is not modified.
+*/
+static void pik_render_svg(Pik *p, PList *pList){
+  PNum w, h;       /* Drawing width and height */
+  PNum pikScale;   /* Value of the "scale" variable */
+  int miss = 0;
+  unsigned int iSvg;   /* Offset of the <svg> tag in p->zOut */
+  int ePrior = pik_stats_phase(p, PIK_PHASE_RENDER);
+
+  pik_compute_layout_settings(p);
+  p->fgcolor = pik_value_int(p,"fgcolor",7,&miss);
+  if( miss ){
+    PToken t;
+    t.z = "fgcolor";
+    t.n = 7;
+    p->fgcolor = pik_round(pik_lookup_color(0, &t));
+  }
+  miss = 0;
+  p->bgcolor = pik_value_int(p,"bgcolor",7,&miss);
+  if( miss ){
+    PToken t;
+    t.z = "bgcolor";
+    t.n = 7;
+    p->bgcolor = pik_round(pik_lookup_color(0, &t));
+  }
+
+  /* Output the SVG */
+  iSvg = p->nOut;
+  p->bInPath = 0;
+  pik_append(p, "<svg xmlns='http://www.w3.org/2000/svg'"
+                /* " style='font-size:initial;'" */,-1);
+  if( p->zClass ){
+    pik_append(p, " class=\"", -1);
+    pik_append(p, p->zClass, -1);
+    pik_append(p, "\"", 1);
+  }
+  w = p->bbox.ne.x - p->bbox.sw.x;
+  h = p->bbox.ne.y - p->bbox.sw.y;
+  if( (p->mFlags & PIKCHR_COMPACT)!=0
+   && !(p->rScale*(w>h ? w : h)*pik_compact_scale(p) < PIK_COMPACT_MAX/4)
+  ){
+    p->mFlags &= ~PIKCHR_COMPACT;   /* Too large to round to integers */
+  }
+  p->wSVG = pik_round(p->rScale*w);
+  p->hSVG = pik_round(p->rScale*h);
+  pikScale = pik_value(p,"scale",5,0);
+  if( pikScale>=0.001 && pikScale<=1000.0
+   && (pikScale<0.99 || pikScale>1.01)
+  ){
+    p->wSVG = pik_round(p->wSVG*pikScale);
+    p->hSVG = pik_round(p->hSVG*pikScale);
+    pik_append_num(p, " width=\"", p->wSVG);
+    pik_append_num(p, "\" height=\"", p->hSVG);
+    pik_append(p, "\"", 1);
+  }
+  pik_append_dis(p, " viewBox=\"0 0 ",w,"");
+  pik_append_dis(p, " ",h,"\"");
+  pik_append(p, " data-pikchr-date=\"" MANIFEST_ISODATE "\">\n", -1);
+  p->iHead = p->nOut;
+  if( (p->mFlags & PIKCHR_SYMBOLS)!=0
+   && (pik_value_int(p,"debug",5,0) & 1)==0
+  ){
+    pik_symbol_count(p, pList);
+  }
+  pik_elist_render(p, pList);
+  pik_svg_head(p);
+  pik_append(p,"</svg>\n", -1);
+  if( (p->mFlags & PIKCHR_COMPACT)!=0 && p->zOut ){
+    pik_compact_space(p, iSvg);
+  }
+  pik_stats_memory(p, pList);
+  pik_free(p->aClr);
+  p->aClr = 0;
+  p->nClr = p->nClrAlloc = 0;
+  pik_intern_free(&p->aStyle, &p->nStyle, &p->nStyleAlloc);
+  pik_intern_free(&p->aMarker, &p->nMarker, &p->nMarkerAlloc);
+  pik_intern_free(&p->aSym, &p->nSym, &p->nSymAlloc);
+  pik_stats_phase(p, ePrior);
+}
+
 /* Render a list of objects.  Write the SVG into p->zOut.
 ** Delete the input object_list before returnning.
+**
+** If p->bKeepList is set, only compute the bounding box and then
+** hand the list over to p->pKeep instead of rendering it.  This is
+** how pikchr_layout_new() captures a diagram for later rendering.
 */
 static void pik_render(Pik *p, PList *pList){
   if( pList==0 ) return;
   if( p->nErr==0 ){
-    PNum thickness;  /* Stroke width */
-    PNum margin;     /* Extra bounding box margin */
-    PNum w, h;       /* Drawing width and height */
-    PNum wArrow;
-    PNum pikScale;   /* Value of the "scale" variable */
-    int miss = 0;
-
-    /* Set up rendering parameters */
-    pik_compute_layout_settings(p);
-    thickness = pik_value(p,"thickness",9,0);
-    if( thickness<=0.01 ) thickness = 0.01;
-    margin = pik_value(p,"margin",6,0);
-    margin += thickness;
-    wArrow = p->wArrow*thickness;
-    miss = 0;
-    p->fgcolor = pik_value_int(p,"fgcolor",7,&miss);
-    if( miss ){
-      PToken t;
-      t.z = "fgcolor";
-      t.n = 7;
-      p->fgcolor = pik_round(pik_lookup_color(0, &t));
-    }
-    miss = 0;
-    p->bgcolor = pik_value_int(p,"bgcolor",7,&miss);
-    if( miss ){
-      PToken t;
-      t.z = "bgcolor";
-      t.n = 7;
-      p->bgcolor = pik_round(pik_lookup_color(0, &t));
-    }
-
-    /* Compute a bounding box over all objects so that we can know
-    ** how big to declare the SVG canvas */
-    pik_bbox_init(&p->bbox);
-    pik_bbox_add_elist(p, pList, wArrow);
-
-    /* Expand the bounding box slightly to account for line thickness
-    ** and the optional "margin = EXPR" setting. */
-    p->bbox.ne.x += margin + pik_value(p,"rightmargin",11,0);
-    p->bbox.ne.y += margin + pik_value(p,"topmargin",9,0);
-    p->bbox.sw.x -= margin + pik_value(p,"leftmargin",10,0);
-    p->bbox.sw.y -= margin + pik_value(p,"bottommargin",12,0);
-
-    /* Output the SVG */
-    pik_append(p, "<svg xmlns='http://www.w3.org/2000/svg'"
-                  /* " style='font-size:initial;'" */,-1);
-    if( p->zClass ){
-      pik_append(p, " class=\"", -1);
-      pik_append(p, p->zClass, -1);
-      pik_append(p, "\"", 1);
-    }
-    w = p->bbox.ne.x - p->bbox.sw.x;
-    h = p->bbox.ne.y - p->bbox.sw.y;
-    p->wSVG = pik_round(p->rScale*w);
-    p->hSVG = pik_round(p->rScale*h);
-    pikScale = pik_value(p,"scale",5,0);
-    if( pikScale>=0.001 && pikScale<=1000.0
-     && (pikScale<0.99 || pikScale>1.01)
-    ){
-      p->wSVG = pik_round(p->wSVG*pikScale);
-      p->hSVG = pik_round(p->hSVG*pikScale);
-      pik_append_num(p, " width=\"", p->wSVG);
-      pik_append_num(p, "\" height=\"", p->hSVG);
-      pik_append(p, "\"", 1);
+    pik_render_bbox(p, pList);
+    if( p->bKeepList && p->nErr==0 ){
+      pik_elist_free(p, p->pKeep);
+      p->pKeep = pList;
+      return;
     }
-    pik_append_dis(p, " viewBox=\"0 0 ",w,"");
-    pik_append_dis(p, " ",h,"\"");
-    pik_append(p, " data-pikchr-date=\"" MANIFEST_ISODATE "\">\n", -1);
-    pik_elist_render(p, pList);
-    pik_append(p,"</svg>\n", -1);
+    pik_render_svg(p, pList);
   }else{
     p->wSVG = -1;
     p->hSVG = -1;
+    pik_stats_memory(p, pList);
   }
   pik_elist_free(p, pList);
 }
@@ -7919,6 +9621,7 @@ void pik_tokenize(Pik *p, PToken *pIn, yyParser *pParser, PToken *aParam){
   int sz = 0;
   PToken token;
   PMacro *pMac;
+  int ePrior;
   for(i=0; i<pIn->n && pIn->z[i] && p->nErr==0; i+=sz){
     token.eCode = 0;
     token.eEdge = 0;
@@ -7967,6 +9670,7 @@ void pik_tokenize(Pik *p, PToken *pIn, yyParser *pParser, PToken *aParam){
         break;
       } 
       pMac->inUse = 1;
+      if( p->pStats ) p->pStats->nMacro++;
       memset(args, 0, sizeof(args));
       p->aCtx[p->nCtx++] = token;
       sz += pik_parse_macro_args(p, pIn->z+j, pIn->n-j, args, aParam);
@@ -7989,7 +9693,19 @@ void pik_tokenize(Pik *p, PToken *pIn, yyParser *pParser, PToken *aParam){
         token.n = sizeof(MANIFEST_ISODATE)+1;
         token.eType = T_STRING;
       }
+      if( token.eType==T_LB ){
+        p->nBracket++;
+      }else if( token.eType==T_RB && p->nBracket>0 ){
+        p->nBracket--;
+      }
+      ePrior = pik_stats_phase(p, PIK_PHASE_PARSE);
       pik_parser(pParser, token.eType, token);
+      pik_stats_phase(p, ePrior);
+      if( token.eType==T_EOL && p->pSession && aParam==0 && p->nCtx==0
+       && p->nBracket==0 && p->nErr==0
+      ){
+        pik_session_checkpoint(p, (unsigned int)(token.z+token.n-p->sIn.z));
+      }
     }
   }
 }
@@ -8004,23 +9720,977 @@ const char *pikchr_version(void){
   return RELEASE_VERSION " " MANIFEST_ISODATE;
 }
 
+/* Current values of the run-time limits, indexed by PIKCHR_LIMIT_* */
+static int pik_aLimit[] = {
+  PIKCHR_STACK_LIMIT,    /* PIKCHR_LIMIT_STACK_DEPTH */
+  1,                     /* PIKCHR_LIMIT_RENDER_THREADS */
+};
+
 /*
-** Parse the PIKCHR script contained in zText[].  Return a rendering.  Or
-** if an error is encountered, return the error text.  The error message
-** is HTML formatted.  So regardless of what happens, the return text
-** is safe to be insertd into an HTML output stream.
+** Query or change a run-time limit.  Return the prior value of the
+** limit.  If iNewVal is negative, the limit is unchanged.  Return -1
+** if eLimit is not a known limit.
 **
-** If pnWidth and pnHeight are not NULL, then this routine writes the
-** width and height of the <SVG> object into the integers that they
-** point to.  A value of -1 is written if an error is seen.
-**
-** If zClass is not NULL, then it is a class name to be included in
-** the <SVG> markup.
+** Limits are process-wide.  Multi-threaded applications should set
+** them before the first call to pikchr().
+*/
+int pikchr_limit(int eLimit, int iNewVal){
+  int iOld;
+  if( eLimit<0 || eLimit>=(int)count(pik_aLimit) ) return -1;
+  iOld = pik_aLimit[eLimit];
+  if( iNewVal>=0 ){
+    if( eLimit==PIKCHR_LIMIT_STACK_DEPTH && iNewVal<YYSTACKDEPTH ){
+      iNewVal = YYSTACKDEPTH;
+    }
+    pik_aLimit[eLimit] = iNewVal;
+  }
+  return iOld;
+}
+
+/*
+** Make pAlloc the allocator for memory used by Pikchr on the calling
+** thread, or go back to malloc() if pAlloc is NULL.  Return the prior
+** allocator.  *pAlloc must remain valid while it is in use, and for as
+** long as any layout, session, or prelude created with it exists.
+*/
+const pikchr_allocator *pikchr_use_allocator(const pikchr_allocator *pAlloc){
+  const pikchr_allocator *pOld = pik_pAlloc;
+  pik_pAlloc = pAlloc;
+  return pOld;
+}
+
+/*
+** Finish up after processing a script with p.  Add the comment for
+** an empty diagram, report the width and height, and return the
+** output text.  The caller becomes responsible for freeing it.
+*/
+static char *pik_finish(Pik *p, int *pnWidth, int *pnHeight){
+  if( p->zOut==0 && p->nErr==0 ){
+    pik_append(p, "<!-- empty pikchr diagram -->\n", -1);
+  }
+  if( pnWidth ) *pnWidth = p->nErr ? -1 : p->wSVG;
+  if( pnHeight ) *pnHeight = p->nErr ? -1 : p->hSVG;
+  if( p->zOut ){
+    p->zOut[p->nOut] = 0;
+    p->zOut = pik_realloc(p->zOut, p->nOut+1);
+  }
+  return p->zOut;
+}
+
+/* Free a list of variables */
+static void pik_var_free(PVar *pVar){
+  while( pVar ){
+    PVar *pNext = pVar->pNext;
+    pik_free(pVar);
+    pVar = pNext;
+  }
+}
+
+/*
+** A diagram that has been parsed and laid out, but not rendered.
+** Tokens in the object list point into zText[].
+*/
+struct pikchr_layout {
+  char *zText;            /* Private copy of the source text */
+  unsigned int nText;     /* Bytes in zText[] */
+  char *zPrint;           /* Output of "print" statements, or NULL */
+  unsigned int nPrint;    /* Bytes in zPrint[] */
+  PList *pList;           /* The objects.  NULL for an empty diagram */
+  PVar *pVar;             /* Variables at the end of the script */
+  PBox bbox;              /* Bounding box, including margins */
+  const pikchr_allocator *pAlloc;  /* Allocator of this layout */
+};
+
+/*
+** Parse the Pikchr script in zText[] and compute the layout of the
+** diagram, but do not render it.  Return a handle that can be passed
+** to pikchr_layout_render() any number of times.
 **
-** The returned string is contained in memory obtained from malloc()
-** and should be released by the caller.
+** If there is an error, return NULL.  If pzErr is not NULL, write the
+** error text into *pzErr.  The error text is obtained from malloc()
+** and is formatted according to PIKCHR_PLAINTEXT_ERRORS in mFlags.
+** No other mFlags bits matter here.
 */
-char *pikchr(
+pikchr_layout *pikchr_layout_new(
+  const char *zText,     /* Input PIKCHR source text.  zero-terminated */
+  unsigned int mFlags,   /* Flags used to influence error messages */
+  char **pzErr           /* Write error text here, if not NULL */
+){
+  Pik s;
+  yyParser sParse;
+  pikchr_layout *pLayout;
+
+  if( pzErr ) *pzErr = 0;
+  pLayout = pik_malloc( sizeof(*pLayout) );
+  if( pLayout==0 ) return 0;
+  memset(pLayout, 0, sizeof(*pLayout));
+  pLayout->pAlloc = pik_pAlloc;
+  pLayout->nText = (unsigned int)strlen(zText);
+  pLayout->zText = pik_malloc( pLayout->nText+1 );
+  if( pLayout->zText==0 ){
+    pik_free(pLayout);
+    return 0;
+  }
+  memcpy(pLayout->zText, zText, pLayout->nText+1);
+
+  memset(&s, 0, sizeof(s));
+  s.sIn.z = pLayout->zText;
+  s.sIn.n = pLayout->nText;
+  s.eDir = DIR_RIGHT;
+  s.mFlags = mFlags;
+  s.bKeepList = 1;
+  pik_parserInit(&sParse, &s);
+  pik_tokenize(&s, &s.sIn, &sParse, 0);
+  if( s.nErr==0 ){
+    PToken token;
+    memset(&token,0,sizeof(token));
+    token.z = s.sIn.z + (s.sIn.n>0 ? s.sIn.n-1 : 0);
+    token.n = 1;
+    pik_parser(&sParse, 0, token);
+  }
+  pik_parserFinalize(&sParse);
+  pik_obj_close(&s.pOpen);
+  while( s.pMacros ){
+    PMacro *pNext = s.pMacros->pNext;
+    pik_free(s.pMacros);
+    s.pMacros = pNext;
+  }
+  if( s.nErr ){
+    char *zErr;
+    pik_elist_free(&s, s.pKeep);
+    pik_var_free(s.pVar);
+    zErr = pik_finish(&s, 0, 0);
+    if( pzErr ){
+      *pzErr = zErr;
+    }else{
+      pik_free(zErr);
+    }
+    pik_free(pLayout->zText);
+    pik_free(pLayout);
+    return 0;
+  }
+  pLayout->zPrint = s.zOut;
+  pLayout->nPrint = s.nOut;
+  pLayout->pList = s.pKeep;
+  pLayout->pVar = s.pVar;
+  pLayout->bbox = s.bbox;
+  return pLayout;
+}
+
+/*
+** Render a diagram previously prepared by pikchr_layout_new() or
+** pikchr_layout_deserialize().  The zClass, mFlags, pnWidth, and
+** pnHeight parameters and the return value have the same meanings
+** as for pikchr().  The layout is not changed and may be rendered
+** again, with the same or different flags.
+*/
+char *pikchr_layout_render(
+  const pikchr_layout *pLayout,  /* The diagram to render */
+  const char *zClass,    /* Add class="%s" to <svg> markup */
+  unsigned int mFlags,   /* Flags used to influence rendering behavior */
+  int *pnWidth,          /* Write width of <svg> here, if not NULL */
+  int *pnHeight          /* Write height here, if not NULL */
+){
+  Pik s;
+
+  memset(&s, 0, sizeof(s));
+  s.sIn.z = pLayout->zText;
+  s.sIn.n = pLayout->nText;
+  s.eDir = DIR_RIGHT;
+  s.zClass = zClass;
+  s.mFlags = mFlags;
+  s.pVar = pLayout->pVar;
+  if( pLayout->nPrint ){
+    pik_append(&s, pLayout->zPrint, (int)pLayout->nPrint);
+  }
+  if( pLayout->pList ){
+    s.bbox = pLayout->bbox;
+    pik_render_svg(&s, pLayout->pList);
+  }
+  return pik_finish(&s, pnWidth, pnHeight);
+}
+
+/* Free a layout handle.  Harmless no-op if pLayout is NULL. */
+void pikchr_layout_free(pikchr_layout *pLayout){
+  const pikchr_allocator *pOld;
+  if( pLayout==0 ) return;
+  pOld = pikchr_use_allocator(pLayout->pAlloc);
+  pik_elist_free(0, pLayout->pList);
+  pik_var_free(pLayout->pVar);
+  pik_free(pLayout->zPrint);
+  pik_free(pLayout->zText);
+  pik_free(pLayout);
+  pikchr_use_allocator(pOld);
+}
+
+/*
+** Serialized layouts.
+**
+** The binary format is private to this version of Pikchr.  It begins
+** with the four bytes "PIKL" and a version number.  Integers are
+** variable-length, seven bits per byte, least significant group first.
+** Floating point values are 8-byte IEEE 754 in little-endian order.
+** Each object records its class, its final geometry, its text, and
+** its path, followed by any sublist.  Only the information needed
+** for rendering is kept, so a deserialized layout renders exactly
+** like the original.
+*/
+#define PIK_LAYOUT_VERSION 1
+#define PIK_CLASS_SUBLIST  254    /* Class code for [...] objects */
+#define PIK_CLASS_NOOP     255    /* Class code for noop objects */
+
+/* Flag bits for each serialized object */
+#define PIK_OBJ_CW         0x01
+#define PIK_OBJ_LARROW     0x02
+#define PIK_OBJ_RARROW     0x04
+#define PIK_OBJ_CLOSE      0x08
+#define PIK_OBJ_SUBLIST    0x10
+#define PIK_OBJ_NAME       0x20
+
+/* Append an unsigned variable-length integer */
+static void pik_blob_varint(Pik *p, unsigned int v){
+  char a[5];
+  int n = 0;
+  do{
+    a[n] = (char)(v & 0x7f);
+    v >>= 7;
+    if( v ) a[n] |= 0x80;
+    n++;
+  }while( v );
+  pik_append(p, a, n);
+}
+
+/* Append a floating point value */
+static void pik_blob_num(Pik *p, PNum r){
+  static const unsigned int one = 1;
+  unsigned char a[8], b[8];
+  int i;
+  memcpy(a, &r, 8);
+  for(i=0; i<8; i++) b[i] = *(const unsigned char*)&one ? a[i] : a[7-i];
+  pik_append(p, (const char*)b, 8);
+}
+
+/* Append a length-prefixed string */
+static void pik_blob_text(Pik *p, const char *z, unsigned int n){
+  pik_blob_varint(p, n);
+  if( n ) pik_append(p, z, (int)n);
+}
+
+/* Append a list of objects, recursively */
+static void pik_blob_elist(Pik *p, const PList *pList){
+  int i, j;
+  pik_blob_varint(p, pList ? pList->n : 0);
+  for(i=0; pList && i<pList->n; i++){
+    const PObj *pObj = pList->a[i];
+    const PNum aNum[] = {
+      pObj->ptAt.x, pObj->ptAt.y, pObj->ptEnter.x, pObj->ptEnter.y,
+      pObj->ptExit.x, pObj->ptExit.y, pObj->w, pObj->h, pObj->rad,
+      pObj->sw, pObj->dotted, pObj->dashed, pObj->fill, pObj->color,
+      pObj->bbox.sw.x, pObj->bbox.sw.y, pObj->bbox.ne.x, pObj->bbox.ne.y
+    };
+    char a[2];
+    if( pObj->type==&sublistClass ){
+      a[0] = (char)PIK_CLASS_SUBLIST;
+    }else if( pObj->type==&noopClass ){
+      a[0] = (char)PIK_CLASS_NOOP;
+    }else{
+      a[0] = (char)(pObj->type - aClass);
+    }
+    a[1] = 0;
+    if( pObj->cw ) a[1] |= PIK_OBJ_CW;
+    if( pObj->larrow ) a[1] |= PIK_OBJ_LARROW;
+    if( pObj->rarrow ) a[1] |= PIK_OBJ_RARROW;
+    if( pObj->bClose ) a[1] |= PIK_OBJ_CLOSE;
+    if( pObj->pSublist ) a[1] |= PIK_OBJ_SUBLIST;
+    if( pObj->zName ) a[1] |= PIK_OBJ_NAME;
+    pik_append(p, a, 2);
+    for(j=0; j<(int)count(aNum); j++) pik_blob_num(p, aNum[j]);
+    pik_blob_varint(p, pObj->iLayer<0 ? ((unsigned)(-(pObj->iLayer+1))<<1)|1
+                                      : (unsigned)pObj->iLayer<<1);
+    pik_blob_varint(p, (unsigned)pObj->outDir);
+    if( pObj->zName ){
+      pik_blob_text(p, pObj->zName, (unsigned int)strlen(pObj->zName));
+    }
+    pik_blob_varint(p, pObj->nTxt);
+    for(j=0; j<pObj->nTxt; j++){
+      pik_blob_varint(p, (unsigned short)pObj->aTxt[j].eCode);
+      pik_blob_text(p, pObj->aTxt[j].z, pObj->aTxt[j].n);
+    }
+    pik_blob_varint(p, pObj->nPath);
+    for(j=0; j<pObj->nPath; j++){
+      pik_blob_num(p, pObj->aPath[j].x);
+      pik_blob_num(p, pObj->aPath[j].y);
+    }
+    if( pObj->pSublist ) pik_blob_elist(p, pObj->pSublist);
+  }
+}
+
+/*
+** Serialize a layout into a binary blob that can later be turned back
+** into a layout by pikchr_layout_deserialize(), possibly in a different
+** process.  Write the size of the blob into *pnByte.  The blob is
+** obtained from malloc().  Return NULL if out of memory.
+*/
+void *pikchr_layout_serialize(const pikchr_layout *pLayout, size_t *pnByte){
+  Pik s;
+  const PVar *pVar;
+  int nVar = 0;
+
+  memset(&s, 0, sizeof(s));
+  pik_append(&s, "PIKL", 4);
+  pik_blob_varint(&s, PIK_LAYOUT_VERSION);
+  pik_blob_num(&s, pLayout->bbox.sw.x);
+  pik_blob_num(&s, pLayout->bbox.sw.y);
+  pik_blob_num(&s, pLayout->bbox.ne.x);
+  pik_blob_num(&s, pLayout->bbox.ne.y);
+  pik_blob_text(&s, pLayout->zPrint, pLayout->nPrint);
+  for(pVar=pLayout->pVar; pVar; pVar=pVar->pNext) nVar++;
+  pik_blob_varint(&s, nVar);
+  for(pVar=pLayout->pVar; pVar; pVar=pVar->pNext){
+    pik_blob_text(&s, pVar->zName, (unsigned int)strlen(pVar->zName));
+    pik_blob_num(&s, pVar->val);
+  }
+  pik_blob_varint(&s, pLayout->pList!=0);
+  if( pLayout->pList ) pik_blob_elist(&s, pLayout->pList);
+  if( s.nErr ){
+    pik_free(s.zOut);
+    return 0;
+  }
+  *pnByte = s.nOut;
+  return s.zOut;
+}
+
+/* A cursor for reading a serialized layout */
+typedef struct PReader PReader;
+struct PReader {
+  char *z;              /* Private copy of the blob */
+  size_t n;             /* Bytes in z[] */
+  size_t i;             /* Next byte to read */
+  int bErr;             /* True if the blob is malformed */
+  int nDepth;           /* Current sublist nesting depth */
+  PObjBlock *pOpen;     /* Block from which new objects are taken */
+};
+
+/* Read an unsigned variable-length integer */
+static unsigned int pik_rd_varint(PReader *r){
+  unsigned int v = 0;
+  int shift = 0;
+  while( r->i<r->n && shift<32 ){
+    unsigned char c = (unsigned char)r->z[r->i++];
+    v |= (unsigned int)(c & 0x7f) << shift;
+    if( (c & 0x80)==0 ) return v;
+    shift += 7;
+  }
+  r->bErr = 1;
+  return 0;
+}
+
+/* Read a floating point value */
+static PNum pik_rd_num(PReader *r){
+  static const unsigned int one = 1;
+  unsigned char a[8];
+  PNum v;
+  int i;
+  if( r->n - r->i < 8 ){
+    r->bErr = 1;
+    return 0.0;
+  }
+  for(i=0; i<8; i++){
+    a[*(const unsigned char*)&one ? i : 7-i] = (unsigned char)r->z[r->i+i];
+  }
+  r->i += 8;
+  memcpy(&v, a, 8);
+  if( v!=v ) r->bErr = 1;   /* Reject NaN */
+  return v;
+}
+
+/* Read a length-prefixed string.  Return a pointer into the blob */
+static char *pik_rd_text(PReader *r, unsigned int *pN){
+  unsigned int n = pik_rd_varint(r);
+  char *z;
+  if( r->bErr || n > r->n - r->i ){
+    r->bErr = 1;
+    *pN = 0;
+    return 0;
+  }
+  z = &r->z[r->i];
+  r->i += n;
+  *pN = n;
+  return z;
+}
+
+/* Read a list of objects, recursively */
+static PList *pik_rd_elist(PReader *r){
+  PList *pList;
+  unsigned int n, i;
+  n = pik_rd_varint(r);
+  if( r->bErr || n > r->n - r->i ){
+    r->bErr = 1;
+    return 0;
+  }
+  pList = pik_malloc( sizeof(*pList) );
+  if( pList==0 ){
+    r->bErr = 1;
+    return 0;
+  }
+  pList->n = 0;
+  pList->nAlloc = n;
+  pList->a = pik_malloc( sizeof(PObj*)*(n>0 ? n : 1) );
+  if( pList->a==0 ){
+    pik_free(pList);
+    r->bErr = 1;
+    return 0;
+  }
+  for(i=0; i<n && !r->bErr; i++){
+    PObj *pObj;
+    PNum aNum[18];
+    unsigned char eClass, mFlag;
+    unsigned int j, v;
+    char *z;
+    if( r->n - r->i < 2 ){
+      r->bErr = 1;
+      break;
+    }
+    pObj = pik_obj_new(&r->pOpen);
+    if( pObj==0 ){
+      r->bErr = 1;
+      break;
+    }
+    pList->a[pList->n++] = pObj;
+    eClass = (unsigned char)r->z[r->i++];
+    mFlag = (unsigned char)r->z[r->i++];
+    if( eClass==PIK_CLASS_SUBLIST ){
+      pObj->type = &sublistClass;
+    }else if( eClass==PIK_CLASS_NOOP ){
+      pObj->type = &noopClass;
+    }else if( eClass<count(aClass) ){
+      pObj->type = &aClass[eClass];
+    }else{
+      r->bErr = 1;
+      break;
+    }
+    pObj->cw = (mFlag & PIK_OBJ_CW)!=0;
+    pObj->larrow = (mFlag & PIK_OBJ_LARROW)!=0;
+    pObj->rarrow = (mFlag & PIK_OBJ_RARROW)!=0;
+    pObj->bClose = (mFlag & PIK_OBJ_CLOSE)!=0;
+    for(j=0; j<count(aNum); j++) aNum[j] = pik_rd_num(r);
+    pObj->ptAt.x = aNum[0];     pObj->ptAt.y = aNum[1];
+    pObj->ptEnter.x = aNum[2];  pObj->ptEnter.y = aNum[3];
+    pObj->ptExit.x = aNum[4];   pObj->ptExit.y = aNum[5];
+    pObj->w = aNum[6];          pObj->h = aNum[7];
+    pObj->rad = aNum[8];        pObj->sw = aNum[9];
+    pObj->dotted = aNum[10];    pObj->dashed = aNum[11];
+    pObj->fill = aNum[12];      pObj->color = aNum[13];
+    pObj->bbox.sw.x = aNum[14]; pObj->bbox.sw.y = aNum[15];
+    pObj->bbox.ne.x = aNum[16]; pObj->bbox.ne.y = aNum[17];
+    v = pik_rd_varint(r);
+    pObj->iLayer = (v & 1) ? -(int)(v>>1)-1 : (int)(v>>1);
+    pObj->outDir = (int)pik_rd_varint(r);
+    if( !ValidDir(pObj->outDir) ) r->bErr = 1;
+    if( mFlag & PIK_OBJ_NAME ){
+      z = pik_rd_text(r, &v);
+      if( r->bErr ) break;
+      pObj->zName = pik_malloc( v+1 );
+      if( pObj->zName==0 ){
+        r->bErr = 1;
+        break;
+      }
+      memcpy(pObj->zName, z, v);
+      pObj->zName[v] = 0;
+    }
+    pObj->nTxt = (unsigned char)(v = pik_rd_varint(r));
+    if( v>count(pObj->aTxt) ) r->bErr = 1;
+    for(j=0; j<pObj->nTxt && !r->bErr; j++){
+      pObj->aTxt[j].eCode = (short int)pik_rd_varint(r);
+      pObj->aTxt[j].z = pik_rd_text(r, &pObj->aTxt[j].n);
+      pObj->aTxt[j].eType = T_STRING;
+      if( pObj->aTxt[j].n<2 ) r->bErr = 1;
+    }
+    v = pik_rd_varint(r);
+    if( v>1000 || (pObj->type->isLine && v<2) ) r->bErr = 1;
+    if( r->bErr ) break;
+    if( v>0 ){
+      pObj->aPath = pik_malloc( sizeof(PPoint)*v );
+      if( pObj->aPath==0 ){
+        r->bErr = 1;
+        break;
+      }
+      pObj->nPath = (int)v;
+      for(j=0; j<v; j++){
+        pObj->aPath[j].x = pik_rd_num(r);
+        pObj->aPath[j].y = pik_rd_num(r);
+      }
+    }
+    if( mFlag & PIK_OBJ_SUBLIST ){
+      if( ++r->nDepth > pikchr_limit(PIKCHR_LIMIT_STACK_DEPTH,-1) ){
+        r->bErr = 1;
+        break;
+      }
+      pObj->pSublist = pik_rd_elist(r);
+      r->nDepth--;
+    }
+  }
+  return pList;
+}
+
+/*
+** Reconstruct a layout from a blob created by pikchr_layout_serialize().
+** Return NULL if the blob is malformed or if out of memory.  The blob
+** is copied, so the caller may free it as soon as this routine returns.
+*/
+pikchr_layout *pikchr_layout_deserialize(const void *pBlob, size_t nByte){
+  PReader r;
+  pikchr_layout *pLayout;
+  PVar **ppTail;
+  unsigned int i, n;
+  char *z;
+
+  if( nByte<5 || memcmp(pBlob, "PIKL", 4)!=0 ) return 0;
+  if( nByte>=0x7fffffff ) return 0;
+  pLayout = pik_malloc( sizeof(*pLayout) );
+  if( pLayout==0 ) return 0;
+  memset(pLayout, 0, sizeof(*pLayout));
+  pLayout->pAlloc = pik_pAlloc;
+  memset(&r, 0, sizeof(r));
+  r.z = pik_malloc( nByte+1 );
+  if( r.z==0 ){
+    pik_free(pLayout);
+    return 0;
+  }
+  memcpy(r.z, pBlob, nByte);
+  r.z[nByte] = 0;
+  r.n = nByte;
+  r.i = 4;
+  pLayout->zText = r.z;
+  pLayout->nText = (unsigned int)nByte;
+  if( pik_rd_varint(&r)!=PIK_LAYOUT_VERSION ) r.bErr = 1;
+  pLayout->bbox.sw.x = pik_rd_num(&r);
+  pLayout->bbox.sw.y = pik_rd_num(&r);
+  pLayout->bbox.ne.x = pik_rd_num(&r);
+  pLayout->bbox.ne.y = pik_rd_num(&r);
+  z = pik_rd_text(&r, &n);
+  if( n>0 && !r.bErr ){
+    pLayout->zPrint = pik_malloc( n+1 );
+    if( pLayout->zPrint==0 ){
+      r.bErr = 1;
+    }else{
+      memcpy(pLayout->zPrint, z, n);
+      pLayout->nPrint = n;
+    }
+  }
+  n = pik_rd_varint(&r);
+  ppTail = &pLayout->pVar;
+  for(i=0; i<n && !r.bErr; i++){
+    PVar *pVar;
+    unsigned int nName;
+    char *zName = pik_rd_text(&r, &nName);
+    if( r.bErr ) break;
+    pVar = pik_malloc( nName+1 + sizeof(*pVar) );
+    if( pVar==0 ){
+      r.bErr = 1;
+      break;
+    }
+    pVar->zName = z = (char*)&pVar[1];
+    memcpy(z, zName, nName);
+    z[nName] = 0;
+    pVar->val = pik_rd_num(&r);
+    pVar->pNext = 0;
+    *ppTail = pVar;
+    ppTail = &pVar->pNext;
+  }
+  if( !r.bErr && pik_rd_varint(&r) ){
+    pLayout->pList = pik_rd_elist(&r);
+  }
+  pik_obj_close(&r.pOpen);
+  if( r.bErr || r.i!=r.n ){
+    pikchr_layout_free(pLayout);
+    return 0;
+  }
+  return pLayout;
+}
+
+/*
+** Incremental re-rendering.
+**
+** A pikchr_session holds the layout of the most recent script, like a
+** pikchr_layout, together with a checkpoint at the end of each top-level
+** statement.  A checkpoint records everything the parser needs in order
+** to carry on from that point as if it had parsed the whole script: the
+** number of objects, the direction, the "print" output so far, and
+** copies of the variables and macros.  Copies are shared with the prior
+** checkpoint when nothing has changed in between.
+**
+** Only the exit point and direction of the last object can change after
+** it has been added to the list, by a later "up" or "down" statement, so
+** those are saved in the checkpoint too.
+*/
+typedef struct PCheckpoint PCheckpoint;
+struct PCheckpoint {
+  unsigned int iText;      /* Resume parsing at this offset in zText[] */
+  int nObj;                /* Top-level objects before this point */
+  unsigned int nOut;       /* Bytes of "print" output before this point */
+  unsigned int nToken;     /* Tokens parsed before this point */
+  unsigned char eDir;      /* Current direction */
+  char samePath;           /* Pik.samePath */
+  int mTPath;              /* Pik.mTPath */
+  PObj *cur;               /* Pik.cur */
+  PObj *lastRef;           /* Pik.lastRef */
+  int outDir;              /* Exit direction of the last object */
+  PPoint ptExit;           /* Exit point of the last object */
+  PVar *pVar;              /* Variables */
+  PMacro *pMacros;         /* Macros */
+};
+struct pikchr_session {
+  pikchr_layout x;         /* Layout of x.zText, if bValid */
+  char bValid;             /* True if x describes a script without errors */
+  unsigned int nEditCk;    /* Pik.nEdit at the last checkpoint */
+  int nCk;                 /* Number of entries in aCk[] */
+  int nCkAlloc;            /* Slots allocated for aCk[] */
+  PCheckpoint *aCk;        /* Checkpoints in order of increasing iText */
+};
+
+/* Free a list of macros */
+static void pik_macro_free(PMacro *pMac){
+  while( pMac ){
+    PMacro *pNext = pMac->pNext;
+    pik_free(pMac);
+    pMac = pNext;
+  }
+}
+
+/* Return a copy of a list of variables, or NULL after an OOM error */
+static PVar *pik_var_dup(Pik *p, const PVar *pVar){
+  PVar *pFirst = 0;
+  PVar **ppTail = &pFirst;
+  for(; pVar; pVar=pVar->pNext){
+    size_t n = strlen(pVar->zName);
+    PVar *pNew = pik_malloc( n+1 + sizeof(*pNew) );
+    if( pNew==0 ){
+      pik_error(p, 0, 0);
+      pik_var_free(pFirst);
+      return 0;
+    }
+    pNew->zName = memcpy(&pNew[1], pVar->zName, n+1);
+    pNew->val = pVar->val;
+    pNew->pNext = 0;
+    *ppTail = pNew;
+    ppTail = &pNew->pNext;
+  }
+  return pFirst;
+}
+
+/* Return a copy of a list of macros, or NULL after an OOM error */
+static PMacro *pik_macro_dup(Pik *p, const PMacro *pMac){
+  PMacro *pFirst = 0;
+  PMacro **ppTail = &pFirst;
+  for(; pMac; pMac=pMac->pNext){
+    PMacro *pNew = pik_malloc( sizeof(*pNew) );
+    if( pNew==0 ){
+      pik_error(p, 0, 0);
+      pik_macro_free(pFirst);
+      return 0;
+    }
+    *pNew = *pMac;
+    pNew->pNext = 0;
+    *ppTail = pNew;
+    ppTail = &pNew->pNext;
+  }
+  return pFirst;
+}
+
+/*
+** Record a checkpoint just after the top-level EOL token that ends
+** at offset iText of the script.  Called from pik_tokenize().
+*/
+static void pik_session_checkpoint(Pik *p, unsigned int iText){
+  pikchr_session *pS = p->pSession;
+  PCheckpoint *pCk;
+  if( pS->nCk>=pS->nCkAlloc ){
+    int nNew = (pS->nCk+10)*2;
+    PCheckpoint *aNew = pik_realloc(pS->aCk, sizeof(*aNew)*nNew);
+    if( aNew==0 ){
+      pik_error(p, 0, 0);
+      return;
+    }
+    pS->aCk = aNew;
+    pS->nCkAlloc = nNew;
+  }
+  pCk = &pS->aCk[pS->nCk];
+  memset(pCk, 0, sizeof(*pCk));
+  pCk->iText = iText;
+  pCk->nObj = p->list ? p->list->n : 0;
+  pCk->nOut = p->nOut;
+  pCk->nToken = p->nToken;
+  pCk->eDir = p->eDir;
+  pCk->samePath = p->samePath;
+  pCk->mTPath = p->mTPath;
+  pCk->cur = p->cur;
+  pCk->lastRef = p->lastRef;
+  if( pCk->nObj ){
+    PObj *pLast = p->list->a[pCk->nObj-1];
+    pCk->outDir = pLast->outDir;
+    pCk->ptExit = pLast->ptExit;
+  }
+  if( pS->nCk>0 && p->nEdit==pS->nEditCk ){
+    pCk->pVar = pCk[-1].pVar;
+    pCk->pMacros = pCk[-1].pMacros;
+  }else{
+    pCk->pVar = pik_var_dup(p, p->pVar);
+    pCk->pMacros = pik_macro_dup(p, p->pMacros);
+    if( p->nErr ){
+      pik_var_free(pCk->pVar);
+      pik_macro_free(pCk->pMacros);
+      return;
+    }
+    pS->nEditCk = p->nEdit;
+  }
+  pS->nCk++;
+}
+
+/* Discard all checkpoints after the first nKeep */
+static void pik_session_truncate(pikchr_session *pS, int nKeep){
+  int i;
+  for(i=pS->nCk-1; i>=nKeep; i--){
+    PCheckpoint *pCk = &pS->aCk[i];
+    if( i==0 || pCk->pVar!=pCk[-1].pVar ) pik_var_free(pCk->pVar);
+    if( i==0 || pCk->pMacros!=pCk[-1].pMacros ) pik_macro_free(pCk->pMacros);
+  }
+  if( pS->nCk>nKeep ) pS->nCk = nKeep;
+}
+
+/* Move a token from the old copy of the script to the new one */
+static void pik_rebase_token(
+  PToken *pTok,
+  const char *zOld,
+  unsigned int nOld,
+  const char *zNew
+){
+  if( pTok->z && PIK_WITHIN(pTok->z, zOld, nOld) ){
+    pTok->z = zNew + (pTok->z - zOld);
+  }
+}
+
+/* Move the tokens of a list of objects to the new copy of the script */
+static void pik_rebase_elist(
+  PList *pList,
+  const char *zOld,
+  unsigned int nOld,
+  const char *zNew
+){
+  int i, j;
+  if( pList==0 ) return;
+  for(i=0; i<pList->n; i++){
+    PObj *pObj = pList->a[i];
+    pik_rebase_token(&pObj->errTok, zOld, nOld, zNew);
+    for(j=0; j<pObj->nTxt; j++){
+      pik_rebase_token(&pObj->aTxt[j], zOld, nOld, zNew);
+    }
+    pik_rebase_elist(pObj->pSublist, zOld, nOld, zNew);
+  }
+}
+
+/* Allocate a new session.  Return NULL if out of memory. */
+pikchr_session *pikchr_session_new(void){
+  pikchr_session *pS = pik_malloc( sizeof(*pS) );
+  if( pS ){
+    memset(pS, 0, sizeof(*pS));
+    pS->x.pAlloc = pik_pAlloc;
+  }
+  return pS;
+}
+
+/*
+** Render zText[] using session pS.  The result is the same as from
+** pikchr(zText, zClass, mFlags, pnWidth, pnHeight).
+**
+** If zText[] is unchanged since the previous call, the saved layout is
+** rendered again.  Otherwise zText[] is compared to the previous script
+** to find the first byte that differs.  Objects, checkpoints, and state
+** from after the last checkpoint before that byte are discarded, and
+** parsing resumes from that checkpoint.  The tokens of the objects that
+** are kept are moved over to the private copy of the new text, which is
+** the same as the old text up to the checkpoint.
+*/
+static char *pik_session_render(
+  pikchr_session *pS,    /* The session */
+  const char *zText,     /* Input PIKCHR source text.  zero-terminated */
+  const char *zClass,    /* Add class="%s" to <svg> markup */
+  unsigned int mFlags,   /* Flags used to influence rendering behavior */
+  int *pnWidth,          /* Write width of <svg> here, if not NULL */
+  int *pnHeight          /* Write height here, if not NULL */
+){
+  Pik s;
+  yyParser sParse;
+  PToken token;
+  PCheckpoint *pCk = 0;
+  PList *pList = pS->x.pList;
+  unsigned int nText = (unsigned int)strlen(zText);
+  unsigned int d = 0;
+  char *zNew;
+  int k;
+
+  if( pS->bValid && nText==pS->x.nText
+   && memcmp(zText, pS->x.zText, nText)==0
+  ){
+    return pikchr_layout_render(&pS->x, zClass, mFlags, pnWidth, pnHeight);
+  }
+  zNew = pik_malloc( nText+1 );
+  if( zNew==0 ) return 0;
+  memcpy(zNew, zText, nText+1);
+
+  /* Find the checkpoint to resume from and discard what comes after it */
+  if( pS->bValid ){
+    unsigned int nMin = nText<pS->x.nText ? nText : pS->x.nText;
+    while( d<nMin && zText[d]==pS->x.zText[d] ) d++;
+  }
+  for(k=pS->nCk; k>0 && pS->aCk[k-1].iText>d; k--){}
+  pik_session_truncate(pS, k);
+  if( k>0 ){
+    pCk = &pS->aCk[k-1];
+    if( pCk->nObj==0 ){
+      pik_elist_free(0, pList);
+      pList = 0;
+    }else{
+      PObj *pLast = pList->a[pCk->nObj-1];
+      while( pList->n>pCk->nObj ){
+        pik_elem_free(0, pList->a[--pList->n]);
+      }
+      pLast->outDir = pCk->outDir;
+      pLast->ptExit = pCk->ptExit;
+      pik_rebase_elist(pList, pS->x.zText, pS->x.nText, zNew);
+    }
+    for(k=0; k<pS->nCk; k++){
+      PMacro *pMac;
+      for(pMac=pS->aCk[k].pMacros; pMac; pMac=pMac->pNext){
+        pik_rebase_token(&pMac->macroName, pS->x.zText, pS->x.nText, zNew);
+        pik_rebase_token(&pMac->macroBody, pS->x.zText, pS->x.nText, zNew);
+      }
+    }
+  }else{
+    pik_elist_free(0, pList);
+    pList = 0;
+  }
+  pik_free(pS->x.zText);
+  pS->x.zText = zNew;
+  pS->x.nText = nText;
+  pS->x.pList = 0;
+  pik_var_free(pS->x.pVar);
+  pS->x.pVar = 0;
+  pS->bValid = 0;
+
+  memset(&s, 0, sizeof(s));
+  s.sIn.z = zNew;
+  s.sIn.n = nText;
+  s.eDir = DIR_RIGHT;
+  s.mFlags = mFlags;
+  s.bKeepList = 1;
+  s.pSession = pS;
+  if( pCk ){
+    s.eDir = pCk->eDir;
+    s.nToken = pCk->nToken;
+    s.samePath = pCk->samePath;
+    s.mTPath = pCk->mTPath;
+    s.cur = pCk->cur;
+    s.lastRef = pCk->lastRef;
+    s.pVar = pik_var_dup(&s, pCk->pVar);
+    s.pMacros = pik_macro_dup(&s, pCk->pMacros);
+    if( pCk->nOut ) pik_append(&s, pS->x.zPrint, (int)pCk->nOut);
+    s.list = s.pResume = pList;
+    pS->nEditCk = 0;
+  }
+  pik_free(pS->x.zPrint);
+  pS->x.zPrint = 0;
+  pS->x.nPrint = 0;
+
+  pik_parserInit(&sParse, &s);
+  if( s.nErr==0 ){
+    PToken sRest;
+    sRest.z = zNew + (pCk ? pCk->iText : 0);
+    sRest.n = nText - (pCk ? pCk->iText : 0);
+    pik_tokenize(&s, &sRest, &sParse, 0);
+  }
+  if( s.nErr==0 ){
+    memset(&token,0,sizeof(token));
+    token.z = zNew + (nText>0 ? nText-1 : 0);
+    token.n = 1;
+    pik_parser(&sParse, 0, token);
+  }
+  pik_parserFinalize(&sParse);
+  pik_obj_close(&s.pOpen);
+  pik_macro_free(s.pMacros);
+  if( s.pResume ){
+    /* No new top-level objects, so the parser never took the list */
+    pList = s.pResume;
+    if( s.nErr==0 ) pik_render_bbox(&s, pList);
+  }else{
+    pList = s.pKeep;
+  }
+  if( s.nErr ){
+    pik_elist_free(&s, pList);
+    pik_var_free(s.pVar);
+    pik_session_truncate(pS, 0);
+    return pik_finish(&s, pnWidth, pnHeight);
+  }
+  pS->x.pList = pList;
+  pS->x.pVar = s.pVar;
+  pS->x.bbox = s.bbox;
+  pS->x.zPrint = s.zOut;
+  pS->x.nPrint = s.nOut;
+  pS->bValid = 1;
+  return pikchr_layout_render(&pS->x, zClass, mFlags, pnWidth, pnHeight);
+}
+
+/*
+** The session keeps the memory of each render, so all of its memory,
+** and the result, come from the allocator that created the session.
+*/
+char *pikchr_session_render(
+  pikchr_session *pS,    /* The session */
+  const char *zText,     /* Input PIKCHR source text.  zero-terminated */
+  const char *zClass,    /* Add class="%s" to <svg> markup */
+  unsigned int mFlags,   /* Flags used to influence rendering behavior */
+  int *pnWidth,          /* Write width of <svg> here, if not NULL */
+  int *pnHeight          /* Write height here, if not NULL */
+){
+  const pikchr_allocator *pOld = pikchr_use_allocator(pS->x.pAlloc);
+  char *zOut = pik_session_render(pS, zText, zClass, mFlags,
+                                  pnWidth, pnHeight);
+  pikchr_use_allocator(pOld);
+  return zOut;
+}
+
+/* Free a session.  Harmless no-op if pS is NULL. */
+void pikchr_session_free(pikchr_session *pS){
+  const pikchr_allocator *pOld;
+  if( pS==0 ) return;
+  pOld = pikchr_use_allocator(pS->x.pAlloc);
+  pik_session_truncate(pS, 0);
+  pik_free(pS->aCk);
+  pik_elist_free(0, pS->x.pList);
+  pik_var_free(pS->x.pVar);
+  pik_free(pS->x.zPrint);
+  pik_free(pS->x.zText);
+  pik_free(pS);
+  pikchr_use_allocator(pOld);
+}
+
+/*
+** Parse the PIKCHR script contained in zText[].  Return a rendering.  Or
+** if an error is encountered, return the error text.  The error message
+** is HTML formatted.  So regardless of what happens, the return text
+** is safe to be insertd into an HTML output stream.
+**
+** If pnWidth and pnHeight are not NULL, then this routine writes the
+** width and height of the <SVG> object into the integers that they
+** point to.  A value of -1 is written if an error is seen.
+**
+** If zClass is not NULL, then it is a class name to be included in
+** the <SVG> markup.
+**
+** The returned string is contained in memory obtained from malloc()
+** and should be released by the caller.
+*/
+char *pikchr(
   const char *zText,     /* Input PIKCHR source text.  zero-terminated */
   const char *zClass,    /* Add class="%s" to <svg> markup */
   unsigned int mFlags,   /* Flags used to influence rendering behavior */
@@ -8049,26 +10719,1617 @@ char *pikchr(
     pik_parser(&sParse, 0, token);
   }
   pik_parserFinalize(&sParse);
-  if( s.zOut==0 && s.nErr==0 ){
-    pik_append(&s, "<!-- empty pikchr diagram -->\n", -1);
-  }
-  while( s.pVar ){
-    PVar *pNext = s.pVar->pNext;
-    free(s.pVar);
-    s.pVar = pNext;
-  }
+  pik_obj_close(&s.pOpen);
+  pik_var_free(s.pVar);
   while( s.pMacros ){
     PMacro *pNext = s.pMacros->pNext;
-    free(s.pMacros);
+    pik_free(s.pMacros);
     s.pMacros = pNext;
   }
-  if( pnWidth ) *pnWidth = s.nErr ? -1 : s.wSVG;
-  if( pnHeight ) *pnHeight = s.nErr ? -1 : s.hSVG;
-  if( s.zOut ){
-    s.zOut[s.nOut] = 0;
-    s.zOut = realloc(s.zOut, s.nOut+1);
-  }
-  return s.zOut;
+  return pik_finish(&s, pnWidth, pnHeight);
+}
+
+/*
+** Preludes.
+**
+** A prelude is a script of "define" statements and variable assignments
+** that is compiled once and then used by many diagrams.  Each diagram
+** starts with its own copy of the macros and variables of the prelude,
+** so it can change them without affecting the next diagram.  Macro
+** bodies point into the private copy of the prelude text.
+*/
+struct pikchr_prelude {
+  char *zText;            /* Private copy of the prelude text */
+  unsigned int nText;     /* Bytes in zText[] */
+  PVar *pVar;             /* Variables set by the prelude */
+  PMacro *pMacros;        /* Macros defined by the prelude */
+  const pikchr_allocator *pAlloc;  /* Allocator of this prelude */
+};
+
+/*
+** Compile the prelude in zText[].  Return a handle that can be passed
+** to pikchr_prelude_render() for any number of diagrams, or NULL if
+** there is an error, with the error text written into *pzErr in the
+** same way as for pikchr_layout_new().  A prelude may not contain any
+** objects, and may not print anything.
+*/
+pikchr_prelude *pikchr_prelude_new(
+  const char *zText,     /* Text of the prelude.  zero-terminated */
+  unsigned int mFlags,   /* Flags used to influence error messages */
+  char **pzErr           /* Write error text here, if not NULL */
+){
+  Pik s;
+  yyParser sParse;
+  pikchr_prelude *pPrelude;
+
+  if( pzErr ) *pzErr = 0;
+  pPrelude = pik_malloc( sizeof(*pPrelude) );
+  if( pPrelude==0 ) return 0;
+  memset(pPrelude, 0, sizeof(*pPrelude));
+  pPrelude->pAlloc = pik_pAlloc;
+  pPrelude->nText = (unsigned int)strlen(zText);
+  pPrelude->zText = pik_malloc( pPrelude->nText+1 );
+  if( pPrelude->zText==0 ){
+    pik_free(pPrelude);
+    return 0;
+  }
+  memcpy(pPrelude->zText, zText, pPrelude->nText+1);
+
+  memset(&s, 0, sizeof(s));
+  s.sIn.z = pPrelude->zText;
+  s.sIn.n = pPrelude->nText;
+  s.eDir = DIR_RIGHT;
+  s.mFlags = mFlags;
+  s.bKeepList = 1;
+  pik_parserInit(&sParse, &s);
+  pik_tokenize(&s, &s.sIn, &sParse, 0);
+  if( s.nErr==0 ){
+    PToken token;
+    memset(&token,0,sizeof(token));
+    token.z = s.sIn.z + (s.sIn.n>0 ? s.sIn.n-1 : 0);
+    token.n = 1;
+    pik_parser(&sParse, 0, token);
+  }
+  pik_parserFinalize(&sParse);
+  pik_obj_close(&s.pOpen);
+  if( s.nErr==0 && s.pKeep ){
+    PToken *pErr = &s.pKeep->a[0]->errTok;
+    pik_error(&s, pErr->z ? pErr : 0, "objects are not allowed in a prelude");
+  }
+  if( s.nErr==0 && s.nOut>0 ){
+    /* Text from "print" would be lost, so treat it as a mistake */
+    s.nOut = 0;
+    pik_error(&s, 0, "print is not allowed in a prelude");
+  }
+  pik_elist_free(&s, s.pKeep);
+  if( s.nErr ){
+    char *zErr;
+    pik_var_free(s.pVar);
+    pik_macro_free(s.pMacros);
+    zErr = pik_finish(&s, 0, 0);
+    if( pzErr ){
+      *pzErr = zErr;
+    }else{
+      pik_free(zErr);
+    }
+    pik_free(pPrelude->zText);
+    pik_free(pPrelude);
+    return 0;
+  }
+  pik_free(s.zOut);
+  pPrelude->pVar = s.pVar;
+  pPrelude->pMacros = s.pMacros;
+  return pPrelude;
+}
+
+/*
+** Render zText[] following pPrelude, if not NULL, and collect
+** statistics into pStats, if not NULL.  The work of
+** pikchr_prelude_render() and pikchr_stats_render().
+*/
+static char *pik_render_text(
+  const pikchr_prelude *pPrelude,  /* Prelude, or NULL for none */
+  const char *zText,     /* Input PIKCHR source text.  zero-terminated */
+  const char *zClass,    /* Add class="%s" to <svg> markup */
+  unsigned int mFlags,   /* Flags used to influence rendering behavior */
+  pikchr_stats *pStats,  /* Write statistics here, if not NULL */
+  int *pnWidth,          /* Write width of <svg> here, if not NULL */
+  int *pnHeight          /* Write height here, if not NULL */
+){
+  Pik s;
+  yyParser sParse;
+
+  memset(&s, 0, sizeof(s));
+  s.sIn.z = zText;
+  s.sIn.n = (unsigned int)strlen(zText);
+  s.eDir = DIR_RIGHT;
+  s.zClass = zClass;
+  s.mFlags = mFlags;
+  if( pStats ){
+    memset(pStats, 0, sizeof(*pStats));
+    s.pStats = pStats;
+  }
+  if( pPrelude ){
+    s.sPrelude.z = pPrelude->zText;
+    s.sPrelude.n = pPrelude->nText;
+    s.pVar = pik_var_dup(&s, pPrelude->pVar);
+    s.pMacros = pik_macro_dup(&s, pPrelude->pMacros);
+  }
+  pik_parserInit(&sParse, &s);
+  pik_stats_phase(&s, PIK_PHASE_TOKENIZE);
+  if( s.nErr==0 ){
+    pik_tokenize(&s, &s.sIn, &sParse, 0);
+  }
+  pik_stats_phase(&s, PIK_PHASE_PARSE);
+  if( s.nErr==0 ){
+    PToken token;
+    memset(&token,0,sizeof(token));
+    token.z = zText + (s.sIn.n>0 ? s.sIn.n-1 : 0);
+    token.n = 1;
+    pik_parser(&sParse, 0, token);
+  }
+  if( pStats ){
+    /* The context and parser, with the path scratch space and any
+    ** growth of the parser stack, are held throughout */
+    pStats->nPeakEst += sizeof(s) + sizeof(sParse);
+#if YYGROWABLESTACK
+    if( sParse.yystack!=sParse.yystk0 ){
+      pStats->nPeakEst += sizeof(sParse.yystack[0])
+                           *(sParse.yystackEnd - sParse.yystack + 1);
+    }
+#endif
+  }
+  pik_parserFinalize(&sParse);
+  pik_obj_close(&s.pOpen);
+  pik_stats_phase(&s, PIK_PHASE_NONE);
+  pik_var_free(s.pVar);
+  pik_macro_free(s.pMacros);
+  if( pStats ){
+    pStats->nToken = s.nToken;
+    pStats->nOut = s.nOut;
+  }
+  return pik_finish(&s, pnWidth, pnHeight);
+}
+
+/*
+** Render zText[] as if it followed the prelude.  The other parameters and
+** the return value are the same as for pikchr(), which this is
+** equivalent to if pPrelude is NULL.
+*/
+char *pikchr_prelude_render(
+  const pikchr_prelude *pPrelude,  /* Prelude, or NULL for none */
+  const char *zText,     /* Input PIKCHR source text.  zero-terminated */
+  const char *zClass,    /* Add class="%s" to <svg> markup */
+  unsigned int mFlags,   /* Flags used to influence rendering behavior */
+  int *pnWidth,          /* Write width of <svg> here, if not NULL */
+  int *pnHeight          /* Write height here, if not NULL */
+){
+  return pik_render_text(pPrelude, zText, zClass, mFlags, 0,
+                         pnWidth, pnHeight);
+}
+
+/*
+** The same as pikchr_prelude_render(), and also write timings and
+** counters for the call into *pStats.
+*/
+char *pikchr_stats_render(
+  const pikchr_prelude *pPrelude,  /* Prelude, or NULL for none */
+  const char *zText,     /* Input PIKCHR source text.  zero-terminated */
+  const char *zClass,    /* Add class="%s" to <svg> markup */
+  unsigned int mFlags,   /* Flags used to influence rendering behavior */
+  pikchr_stats *pStats,  /* Write statistics here */
+  int *pnWidth,          /* Write width of <svg> here, if not NULL */
+  int *pnHeight          /* Write height here, if not NULL */
+){
+  return pik_render_text(pPrelude, zText, zClass, mFlags, pStats,
+                         pnWidth, pnHeight);
+}
+
+/* Free a prelude.  Harmless no-op if pPrelude is NULL. */
+void pikchr_prelude_free(pikchr_prelude *pPrelude){
+  const pikchr_allocator *pOld;
+  if( pPrelude==0 ) return;
+  pOld = pikchr_use_allocator(pPrelude->pAlloc);
+  pik_var_free(pPrelude->pVar);
+  pik_macro_free(pPrelude->pMacros);
+  pik_free(pPrelude->zText);
+  pik_free(pPrelude);
+  pikchr_use_allocator(pOld);
+}
+
+/****************************************************************************
+** Batch rendering
+**
+** pikchr_batch() renders many independent scripts on a fixed pool of
+** threads.  The jobs are dealt out in contiguous runs, one run for each
+** thread, and each thread works through its own run from the front.  A
+** thread whose run is empty steals the back half of the longest run that
+** remains, so a few slow diagrams do not leave the other threads idle.
+** Every run has its own mutex, so threads only contend when stealing.
+** All other state of a render lives in its own Pik, so nothing else
+** needs to be locked.
+**
+** Without POSIX threads (on platforms other than Unix and macOS, or
+** with -DPIKCHR_NO_THREADS), the jobs are rendered one after another on
+** the calling thread.
+*/
+struct pikchr_job {
+  const char *zText;     /* Input PIKCHR source text.  zero-terminated */
+  const char *zClass;    /* Add class="%s" to <svg> markup */
+  unsigned int mFlags;   /* Flags used to influence rendering behavior */
+  const pikchr_prelude *pPrelude;  /* Prelude, or NULL for none */
+  const pikchr_allocator *pAlloc;  /* Allocator for this job, or NULL */
+};
+struct pikchr_result {
+  char *zOut;            /* SVG or error text, as returned by pikchr() */
+  int nWidth;            /* Width of <svg>, or negative on error */
+  int nHeight;           /* Height of <svg> */
+};
+struct PBatchRun {
+  PBatch *pBatch;        /* The batch that this run belongs to */
+#ifndef PIKCHR_NO_THREADS
+  pthread_mutex_t mutex; /* Guards iNext and iEnd */
+#endif
+  size_t iNext;          /* Next job of this run to render */
+  size_t iEnd;           /* One past the last job of this run */
+};
+struct PBatch {
+  const pikchr_job *aJob;  /* The jobs */
+  pikchr_result *aRes;     /* Results, in the same order as aJob[] */
+  int nRun;                /* Number of runs, one per thread */
+  PBatchRun *aRun;         /* The runs */
+  const pikchr_allocator *pAlloc;  /* Allocator of the calling thread */
+};
+
+/* Render job i of the batch */
+static void pik_batch_one(PBatch *pB, size_t i){
+  const pikchr_job *pJob = &pB->aJob[i];
+  pikchr_result *pRes = &pB->aRes[i];
+  const pikchr_allocator *pOld;
+  pOld = pikchr_use_allocator(pJob->pAlloc ? pJob->pAlloc : pB->pAlloc);
+  pRes->zOut = pikchr_prelude_render(pJob->pPrelude, pJob->zText,
+                   pJob->zClass, pJob->mFlags, &pRes->nWidth, &pRes->nHeight);
+  pikchr_use_allocator(pOld);
+}
+
+#ifndef PIKCHR_NO_THREADS
+/* Take the next job from the front of pRun.  Return 0 if it is empty. */
+static int pik_batch_take(PBatchRun *pRun, size_t *pi){
+  int rc = 0;
+  pthread_mutex_lock(&pRun->mutex);
+  if( pRun->iNext<pRun->iEnd ){
+    *pi = pRun->iNext++;
+    rc = 1;
+  }
+  pthread_mutex_unlock(&pRun->mutex);
+  return rc;
+}
+
+/* Move the back half of the longest other run into the empty run pMine.
+** Return 0 if every run is empty.  At most one mutex is held at a time.
+*/
+static int pik_batch_steal(PBatch *pB, PBatchRun *pMine){
+  for(;;){
+    PBatchRun *pVictim = 0;
+    size_t nMost = 0, n, iEnd;
+    int i;
+    for(i=0; i<pB->nRun; i++){
+      PBatchRun *pRun = &pB->aRun[i];
+      pthread_mutex_lock(&pRun->mutex);
+      n = pRun->iEnd - pRun->iNext;
+      pthread_mutex_unlock(&pRun->mutex);
+      if( n>nMost ){
+        nMost = n;
+        pVictim = pRun;
+      }
+    }
+    if( pVictim==0 ) return 0;
+    pthread_mutex_lock(&pVictim->mutex);
+    n = pVictim->iEnd - pVictim->iNext;
+    iEnd = pVictim->iEnd;
+    pVictim->iEnd -= (n+1)/2;
+    pthread_mutex_unlock(&pVictim->mutex);
+    if( n==0 ) continue;  /* Emptied since it was measured.  Look again. */
+    pthread_mutex_lock(&pMine->mutex);
+    pMine->iNext = iEnd - (n+1)/2;
+    pMine->iEnd = iEnd;
+    pthread_mutex_unlock(&pMine->mutex);
+    return 1;
+  }
+}
+
+/* The body of each batch thread.  The batch already keeps every thread
+** busy, so no job starts threads of its own.
+*/
+static void *pik_batch_worker(void *pArg){
+  PBatchRun *pRun = (PBatchRun*)pArg;
+  size_t i;
+  int bOld = pik_bNoThreads;
+  pik_bNoThreads = 1;
+  do{
+    while( pik_batch_take(pRun, &i) ) pik_batch_one(pRun->pBatch, i);
+  }while( pik_batch_steal(pRun->pBatch, pRun) );
+  pik_bNoThreads = bOld;
+  return 0;
+}
+#endif /* PIKCHR_NO_THREADS */
+
+/*
+** Render nJob independent jobs using nThread threads, including the
+** calling thread.  If nThread is zero or negative, use one thread for
+** each online CPU.  Return an array of nJob results, in the same order
+** as aJob[], or NULL if out of memory.  Free the results and the array
+** with pikchr_batch_free().  Each job is rendered with its own allocator,
+** if it has one, or else with the allocator of the calling thread.
+*/
+pikchr_result *pikchr_batch(
+  const pikchr_job *aJob,  /* The jobs */
+  size_t nJob,             /* Number of jobs */
+  int nThread              /* Threads to use, or <=0 for one per CPU */
+){
+  PBatch b;
+  pikchr_result *aRes;
+  size_t i;
+
+  aRes = pik_calloc(nJob ? nJob : 1, sizeof(aRes[0]));
+  if( aRes==0 ) return 0;
+  memset(&b, 0, sizeof(b));
+  b.aJob = aJob;
+  b.aRes = aRes;
+  b.pAlloc = pik_pAlloc;
+#ifndef PIKCHR_NO_THREADS
+  if( nThread<=0 ) nThread = pik_cpu_count();
+  if( (size_t)nThread>nJob ) nThread = (int)nJob;
+  if( nThread>1 ){
+    b.aRun = pik_malloc( sizeof(b.aRun[0])*nThread );
+  }
+  if( b.aRun ){
+    pthread_t *aThread = pik_malloc( sizeof(aThread[0])*nThread );
+    char *aLive = pik_calloc( nThread, 1 );
+    int k;
+    b.nRun = nThread;
+    for(k=0; k<nThread; k++){
+      PBatchRun *pRun = &b.aRun[k];
+      pRun->pBatch = &b;
+      pthread_mutex_init(&pRun->mutex, 0);
+      pRun->iNext = nJob*k/nThread;
+      pRun->iEnd = nJob*(k+1)/nThread;
+    }
+    /* A run without a thread of its own is stolen by the others */
+    for(k=1; aThread && aLive && k<nThread; k++){
+      aLive[k] = pthread_create(&aThread[k], 0, pik_batch_worker,
+                                &b.aRun[k])==0;
+    }
+    pik_batch_worker(&b.aRun[0]);
+    for(k=1; aThread && aLive && k<nThread; k++){
+      if( aLive[k] ) pthread_join(aThread[k], 0);
+    }
+    for(k=0; k<nThread; k++){
+      pthread_mutex_destroy(&b.aRun[k].mutex);
+    }
+    pik_free(aLive);
+    pik_free(aThread);
+    pik_free(b.aRun);
+    return aRes;
+  }
+#else
+  UNUSED_PARAMETER(nThread);
+#endif
+  for(i=0; i<nJob; i++){
+    pik_batch_one(&b, i);
+  }
+  return aRes;
+}
+
+/* Free the results of pikchr_batch().  Harmless no-op if aRes is NULL.
+** Results of jobs that have their own allocator must be freed, and their
+** zOut set to NULL, before this is called.
+*/
+void pikchr_batch_free(pikchr_result *aRes, size_t nJob){
+  size_t i;
+  if( aRes==0 ) return;
+  for(i=0; i<nJob; i++) pik_free(aRes[i].zOut);
+  pik_free(aRes);
+}
+
+/****************************************************************************
+** PNG output
+**
+** pikchr_png() draws a diagram directly into a PNG image, for places
+** such as e-mail and chat previews that cannot show SVG.  The diagram
+** is first rendered to SVG as usual.  That SVG uses only a few elements
+** and attributes, all of which are written by this file, and they are
+** then drawn by the small anti-aliased rasterizer below.  Working from
+** the SVG keeps the picture identical in geometry to the vector output.
+**
+** Shapes are scan-converted by accumulating the signed area that each
+** edge covers in every pixel and then summing along each row.  Strokes
+** are filled as the union of one quadrilateral per segment plus joins.
+** Text uses a built-in 5x7 pixel font.  The image is compressed using
+** the fixed Huffman codes of deflate, with no outside library.
+*/
+
+/* State of the rasterizer */
+typedef struct PRaster PRaster;
+struct PRaster {
+  int w, h;              /* Size of the image in pixels */
+  PNum sx, sy;           /* Scale from SVG user units to pixels */
+  unsigned char *aPix;   /* w*h RGBA pixels with premultiplied alpha */
+  float *aAcc;           /* Coverage accumulator, h rows of w+2 cells */
+  unsigned char *aCov;   /* Coverage of one row */
+  int xMin, xMax;        /* Columns of aAcc[] that have been touched */
+  int yMin, yMax;        /* Rows of aAcc[] that have been touched */
+  PPoint *aPt;           /* Flattened outline, in pixels */
+  int nPt, nPtAlloc;     /* Used and allocated size of aPt[] */
+  int *aSub;             /* First point of each contour in aPt[] */
+  char *aClose;          /* True if the corresponding contour is closed */
+  int nSub, nSubAlloc;   /* Used and allocated size of aSub[], aClose[] */
+  int bOom;              /* A memory allocation failed */
+};
+
+/* Paint of a shape from its style="..." or fill="..." attributes */
+typedef struct PRStyle PRStyle;
+struct PRStyle {
+  int fill;              /* Fill color as 0xRRGGBB, or -1 for none */
+  int stroke;            /* Stroke color, or -1 for none */
+  PNum sw;               /* Stroke width in user units */
+  PNum aDash[2];         /* Dash and gap lengths, or zeros for solid */
+  int bRound;            /* stroke-linejoin:round */
+};
+
+/* 5x7 font for ASCII 0x20 through 0x7e.  Five columns per character,
+** left to right, least significant bit at the top.
+*/
+static const unsigned char aPikFont[95][5] = {
+  {0x00,0x00,0x00,0x00,0x00}, {0x00,0x00,0x5f,0x00,0x00},
+  {0x00,0x07,0x00,0x07,0x00}, {0x14,0x7f,0x14,0x7f,0x14},
+  {0x24,0x2a,0x7f,0x2a,0x12}, {0x23,0x13,0x08,0x64,0x62},
+  {0x36,0x49,0x55,0x22,0x50}, {0x00,0x05,0x03,0x00,0x00},
+  {0x00,0x1c,0x22,0x41,0x00}, {0x00,0x41,0x22,0x1c,0x00},
+  {0x08,0x2a,0x1c,0x2a,0x08}, {0x08,0x08,0x3e,0x08,0x08},
+  {0x00,0x50,0x30,0x00,0x00}, {0x08,0x08,0x08,0x08,0x08},
+  {0x00,0x60,0x60,0x00,0x00}, {0x20,0x10,0x08,0x04,0x02},
+  {0x3e,0x51,0x49,0x45,0x3e}, {0x00,0x42,0x7f,0x40,0x00},
+  {0x42,0x61,0x51,0x49,0x46}, {0x21,0x41,0x45,0x4b,0x31},
+  {0x18,0x14,0x12,0x7f,0x10}, {0x27,0x45,0x45,0x45,0x39},
+  {0x3c,0x4a,0x49,0x49,0x30}, {0x01,0x71,0x09,0x05,0x03},
+  {0x36,0x49,0x49,0x49,0x36}, {0x06,0x49,0x49,0x29,0x1e},
+  {0x00,0x36,0x36,0x00,0x00}, {0x00,0x56,0x36,0x00,0x00},
+  {0x08,0x14,0x22,0x41,0x00}, {0x14,0x14,0x14,0x14,0x14},
+  {0x00,0x41,0x22,0x14,0x08}, {0x02,0x01,0x51,0x09,0x06},
+  {0x32,0x49,0x79,0x41,0x3e}, {0x7e,0x11,0x11,0x11,0x7e},
+  {0x7f,0x49,0x49,0x49,0x36}, {0x3e,0x41,0x41,0x41,0x22},
+  {0x7f,0x41,0x41,0x22,0x1c}, {0x7f,0x49,0x49,0x49,0x41},
+  {0x7f,0x09,0x09,0x01,0x01}, {0x3e,0x41,0x41,0x51,0x32},
+  {0x7f,0x08,0x08,0x08,0x7f}, {0x00,0x41,0x7f,0x41,0x00},
+  {0x20,0x40,0x41,0x3f,0x01}, {0x7f,0x08,0x14,0x22,0x41},
+  {0x7f,0x40,0x40,0x40,0x40}, {0x7f,0x02,0x04,0x02,0x7f},
+  {0x7f,0x04,0x08,0x10,0x7f}, {0x3e,0x41,0x41,0x41,0x3e},
+  {0x7f,0x09,0x09,0x09,0x06}, {0x3e,0x41,0x51,0x21,0x5e},
+  {0x7f,0x09,0x19,0x29,0x46}, {0x46,0x49,0x49,0x49,0x31},
+  {0x01,0x01,0x7f,0x01,0x01}, {0x3f,0x40,0x40,0x40,0x3f},
+  {0x1f,0x20,0x40,0x20,0x1f}, {0x7f,0x20,0x18,0x20,0x7f},
+  {0x63,0x14,0x08,0x14,0x63}, {0x03,0x04,0x78,0x04,0x03},
+  {0x61,0x51,0x49,0x45,0x43}, {0x00,0x7f,0x41,0x41,0x00},
+  {0x02,0x04,0x08,0x10,0x20}, {0x00,0x41,0x41,0x7f,0x00},
+  {0x04,0x02,0x01,0x02,0x04}, {0x40,0x40,0x40,0x40,0x40},
+  {0x00,0x01,0x02,0x04,0x00}, {0x20,0x54,0x54,0x54,0x78},
+  {0x7f,0x48,0x44,0x44,0x38}, {0x38,0x44,0x44,0x44,0x20},
+  {0x38,0x44,0x44,0x48,0x7f}, {0x38,0x54,0x54,0x54,0x18},
+  {0x08,0x7e,0x09,0x01,0x02}, {0x0c,0x52,0x52,0x52,0x3e},
+  {0x7f,0x08,0x04,0x04,0x78}, {0x00,0x44,0x7d,0x40,0x00},
+  {0x20,0x40,0x44,0x3d,0x00}, {0x7f,0x10,0x28,0x44,0x00},
+  {0x00,0x41,0x7f,0x40,0x00}, {0x7c,0x04,0x18,0x04,0x78},
+  {0x7c,0x08,0x04,0x04,0x78}, {0x38,0x44,0x44,0x44,0x38},
+  {0x7c,0x14,0x14,0x14,0x08}, {0x08,0x14,0x14,0x18,0x7c},
+  {0x7c,0x08,0x04,0x04,0x08}, {0x48,0x54,0x54,0x54,0x20},
+  {0x04,0x3f,0x44,0x40,0x20}, {0x3c,0x40,0x40,0x20,0x7c},
+  {0x1c,0x20,0x40,0x20,0x1c}, {0x3c,0x40,0x30,0x40,0x3c},
+  {0x44,0x28,0x10,0x28,0x44}, {0x0c,0x50,0x50,0x50,0x3c},
+  {0x44,0x64,0x54,0x4c,0x44}, {0x00,0x08,0x36,0x41,0x00},
+  {0x00,0x00,0x7f,0x00,0x00}, {0x00,0x41,0x36,0x08,0x00},
+  {0x08,0x04,0x08,0x10,0x08},
+};
+
+/* Add the signed area covered by the edge from (x0,y0) to (x1,y1), in
+** pixels, to the accumulator.  Edges going down add, edges going up
+** subtract.  Parts of the edge left or right of the image are moved to
+** its border, which leaves the coverage inside the image unchanged.
+*/
+static void pik_png_edge(PRaster *r, PNum x0, PNum y0, PNum x1, PNum y1){
+  int stride = r->w + 2;
+  PNum dir = 1.0;
+  PNum dxdy, x, t;
+  int y, yEnd;
+  if( y0==y1 ) return;
+  if( y0>y1 ){
+    t = x0;  x0 = x1;  x1 = t;
+    t = y0;  y0 = y1;  y1 = t;
+    dir = -1.0;
+  }
+  if( y1<=0.0 || y0>=r->h ) return;
+  dxdy = (x1 - x0)/(y1 - y0);
+  x = x0;
+  if( y0<0.0 ){
+    x -= y0*dxdy;
+    y = 0;
+  }else{
+    y = (int)y0;
+  }
+  yEnd = y1>=r->h ? r->h : (int)ceil(y1);
+  if( y<r->yMin ) r->yMin = y;
+  if( yEnd-1>r->yMax ) r->yMax = yEnd-1;
+  for(; y<yEnd; y++){
+    float *a = r->aAcc + (size_t)y*stride;
+    PNum dy = (y+1<y1 ? y+1 : y1) - (y>y0 ? y : y0);
+    PNum xNext = x + dxdy*dy;
+    PNum d = dy*dir;
+    PNum xa = x<xNext ? x : xNext;
+    PNum xb = x<xNext ? xNext : x;
+    int ia, ib;
+    x = xNext;
+    if( xa<0.0 ) xa = 0.0;
+    if( xb<0.0 ) xb = 0.0;
+    if( xa>r->w ) xa = r->w;
+    if( xb>r->w ) xb = r->w;
+    ia = (int)floor(xa);
+    ib = (int)ceil(xb);
+    if( ia<r->xMin ) r->xMin = ia;
+    if( ib>r->xMax ) r->xMax = ib;
+    if( ib<=ia+1 ){
+      /* The edge stays within one column */
+      PNum xm = 0.5*(xa + xb) - ia;
+      a[ia] += (float)(d - d*xm);
+      a[ia+1] += (float)(d*xm);
+    }else{
+      PNum s = 1.0/(xb - xa);
+      PNum fa = xa - ia;
+      PNum a0 = 0.5*s*(1.0 - fa)*(1.0 - fa);
+      PNum fb = xb - ib + 1.0;
+      PNum am = 0.5*s*fb*fb;
+      int i;
+      a[ia] += (float)(d*a0);
+      if( ib==ia+2 ){
+        a[ia+1] += (float)(d*(1.0 - a0 - am));
+      }else{
+        PNum a1 = s*(1.5 - fa);
+        a[ia+1] += (float)(d*(a1 - a0));
+        for(i=ia+2; i<ib-1; i++) a[i] += (float)(d*s);
+        a[ib-1] += (float)(d*(1.0 - (a1 + (ib-ia-3)*s) - am));
+      }
+      a[ib] += (float)(d*am);
+    }
+  }
+}
+
+/* Add the closed polygon a[] of n points, in pixels, to the accumulator.
+** Every polygon is added with the same orientation so that overlapping
+** polygons make a union.
+*/
+static void pik_png_poly(PRaster *r, const PPoint *a, int n){
+  PNum area = 0.0;
+  int i, j;
+  for(i=0, j=n-1; i<n; j=i++){
+    area += (a[j].x - a[i].x)*(a[j].y + a[i].y);
+  }
+  for(i=0, j=n-1; i<n; j=i++){
+    if( area>=0.0 ){
+      pik_png_edge(r, a[j].x, a[j].y, a[i].x, a[i].y);
+    }else{
+      pik_png_edge(r, a[i].x, a[i].y, a[j].x, a[j].y);
+    }
+  }
+}
+
+/* Blend n pixels of aPix[] toward the opaque color (cr,cg,cb) by the
+** coverage in aCov[].  This is the inner loop of the rasterizer.  It
+** has no branches so that compilers can vectorize it.
+*/
+static void pik_png_span(
+  unsigned char *aPix,          /* Premultiplied RGBA pixels */
+  const unsigned char *aCov,    /* Coverage of each pixel, 0 to 255 */
+  int n,                        /* Number of pixels */
+  unsigned int cr, unsigned int cg, unsigned int cb
+){
+  int i;
+  for(i=0; i<n; i++){
+    unsigned int a = aCov[i];
+    unsigned int ia = 255 - a;
+    unsigned char *px = aPix + 4*i;
+    px[0] = (unsigned char)((cr*a + px[0]*ia + 127)/255);
+    px[1] = (unsigned char)((cg*a + px[1]*ia + 127)/255);
+    px[2] = (unsigned char)((cb*a + px[2]*ia + 127)/255);
+    px[3] = (unsigned char)((255*a + px[3]*ia + 127)/255);
+  }
+}
+
+/* Paint everything in the accumulator with color clr, then clear the
+** accumulator for the next shape.
+*/
+static void pik_png_paint(PRaster *r, int clr){
+  int stride = r->w + 2;
+  int x, y;
+  int x0 = r->xMin;
+  int x1 = r->xMax<r->w ? r->xMax : r->w;
+  for(y=r->yMin; y<=r->yMax; y++){
+    float *a = r->aAcc + (size_t)y*stride;
+    float s = 0.0;
+    for(x=x0; x<x1; x++){
+      float c;
+      s += a[x];
+      a[x] = 0.0;
+      c = s<0.0 ? -s : s;
+      r->aCov[x] = c>=1.0 ? 255 : (unsigned char)(c*255.0 + 0.5);
+    }
+    for(; x<stride; x++) a[x] = 0.0;
+    if( clr>=0 && x1>x0 ){
+      pik_png_span(r->aPix + ((size_t)y*r->w + x0)*4, r->aCov+x0, x1-x0,
+                   (clr>>16)&0xff, (clr>>8)&0xff, clr&0xff);
+    }
+  }
+  r->xMin = r->w;
+  r->xMax = 0;
+  r->yMin = r->h;
+  r->yMax = -1;
+}
+
+/* Append a point, given in user units, to the current outline.  If
+** bNew is true, the point begins a new contour.
+*/
+static void pik_png_point(PRaster *r, PNum x, PNum y, int bNew){
+  if( r->nPt>=r->nPtAlloc ){
+    int nNew = r->nPtAlloc*2 + 64;
+    PPoint *aNew = pik_realloc(r->aPt, sizeof(PPoint)*nNew);
+    if( aNew==0 ){ r->bOom = 1; return; }
+    r->aPt = aNew;
+    r->nPtAlloc = nNew;
+  }
+  if( !bNew && r->nSub>0 && r->nPt>r->aSub[r->nSub-1]
+   && r->aPt[r->nPt-1].x==x*r->sx && r->aPt[r->nPt-1].y==y*r->sy
+  ){
+    return;   /* Same as the previous point */
+  }
+  if( bNew || r->nSub==0 ){
+    if( r->nSub>=r->nSubAlloc ){
+      int nNew = r->nSubAlloc*2 + 8;
+      int *aNew = pik_realloc(r->aSub, sizeof(int)*nNew);
+      char *aNewClose;
+      if( aNew==0 ){ r->bOom = 1; return; }
+      r->aSub = aNew;
+      aNewClose = pik_realloc(r->aClose, nNew);
+      if( aNewClose==0 ){ r->bOom = 1; return; }
+      r->aClose = aNewClose;
+      r->nSubAlloc = nNew;
+    }
+    r->aSub[r->nSub] = r->nPt;
+    r->aClose[r->nSub] = 0;
+    r->nSub++;
+  }
+  r->aPt[r->nPt].x = x*r->sx;
+  r->aPt[r->nPt].y = y*r->sy;
+  r->nPt++;
+}
+
+/* Number of line segments needed to approximate a curve of the given
+** size in pixels so that the error is a small fraction of a pixel.
+*/
+static int pik_png_nseg(PNum rPix){
+  int n = (int)(sqrt(rPix>0.0 ? rPix : 0.0)*2.0) + 2;
+  return n>200 ? 200 : n;
+}
+
+/* Append a quadratic Bezier curve from (x0,y0) through control point
+** (cx,cy) to (x1,y1).  The start point is already in the outline.
+*/
+static void pik_png_quad(
+  PRaster *r, PNum x0, PNum y0, PNum cx, PNum cy, PNum x1, PNum y1
+){
+  PNum len = (hypot(cx-x0, cy-y0) + hypot(x1-cx, y1-cy))*r->sx;
+  int n = pik_png_nseg(len);
+  int i;
+  for(i=1; i<=n; i++){
+    PNum t = (PNum)i/n;
+    PNum u = 1.0 - t;
+    pik_png_point(r, u*u*x0 + 2*u*t*cx + t*t*x1,
+                     u*u*y0 + 2*u*t*cy + t*t*y1, 0);
+  }
+}
+
+/* Append an elliptical arc with radii rx and ry, not rotated, from
+** (x0,y0) to (x1,y1), using the flags of the SVG "A" command.
+*/
+static void pik_png_arc(
+  PRaster *r, PNum x0, PNum y0, PNum rx, PNum ry,
+  int bLarge, int bSweep, PNum x1, PNum y1
+){
+  PNum hx = 0.5*(x0 - x1);
+  PNum hy = 0.5*(y0 - y1);
+  PNum lambda, num, den, coef, cx, cy, t0, dt;
+  int i, n;
+  rx = fabs(rx);
+  ry = fabs(ry);
+  if( rx==0.0 || ry==0.0 || (hx==0.0 && hy==0.0) ){
+    pik_png_point(r, x1, y1, 0);
+    return;
+  }
+  lambda = hx*hx/(rx*rx) + hy*hy/(ry*ry);
+  if( lambda>1.0 ){
+    rx *= sqrt(lambda);
+    ry *= sqrt(lambda);
+  }
+  num = rx*rx*ry*ry - rx*rx*hy*hy - ry*ry*hx*hx;
+  den = rx*rx*hy*hy + ry*ry*hx*hx;
+  coef = num>0.0 ? sqrt(num/den) : 0.0;
+  if( bLarge==bSweep ) coef = -coef;
+  cx = coef*rx*hy/ry + 0.5*(x0 + x1);
+  cy = -coef*ry*hx/rx + 0.5*(y0 + y1);
+  t0 = atan2((y0 - cy)/ry, (x0 - cx)/rx);
+  dt = atan2((y1 - cy)/ry, (x1 - cx)/rx) - t0;
+  if( bSweep && dt<0.0 ) dt += 2*M_PI;
+  if( !bSweep && dt>0.0 ) dt -= 2*M_PI;
+  n = pik_png_nseg((rx>ry ? rx : ry)*r->sx*fabs(dt));
+  for(i=1; i<n; i++){
+    PNum t = t0 + dt*i/n;
+    pik_png_point(r, cx + rx*cos(t), cy + ry*sin(t), 0);
+  }
+  pik_png_point(r, x1, y1, 0);
+}
+
+/* Append a closed ellipse as a new contour */
+static void pik_png_ellipse(PRaster *r, PNum cx, PNum cy, PNum rx, PNum ry){
+  int n = 4*pik_png_nseg((rx>ry ? rx : ry)*r->sx);
+  int i;
+  for(i=0; i<n; i++){
+    PNum t = 2*M_PI*i/n;
+    pik_png_point(r, cx + rx*cos(t), cy + ry*sin(t), i==0);
+  }
+  if( r->nSub ) r->aClose[r->nSub-1] = 1;
+}
+
+/* Add a filled circle of radius rad pixels around a point, for round
+** line joins.
+*/
+static void pik_png_disc(PRaster *r, PPoint c, PNum rad){
+  PPoint a[64];
+  int n = pik_png_nseg(rad)*2;
+  int i;
+  if( n>64 ) n = 64;
+  for(i=0; i<n; i++){
+    a[i].x = c.x + rad*cos(2*M_PI*i/n);
+    a[i].y = c.y + rad*sin(2*M_PI*i/n);
+  }
+  pik_png_poly(r, a, n);
+}
+
+/* Add the stroke of the polyline a[] of n points, in pixels, with half
+** width hw.  Segments have butt ends.  Joins are round if bRound is
+** true and mitered otherwise, with the SVG default miter limit of 4.
+*/
+static void pik_png_stroke_polyline(
+  PRaster *r, const PPoint *a, int n, int bClose, PNum hw, int bRound
+){
+  int i;
+  int nSeg = bClose ? n : n-1;
+  for(i=0; i<nSeg; i++){
+    PPoint q[4];
+    PPoint p0 = a[i];
+    PPoint p1 = a[(i+1)%n];
+    PNum len = hypot(p1.x - p0.x, p1.y - p0.y);
+    PNum nx, ny;
+    if( len<=0.0 ) continue;
+    nx = -(p1.y - p0.y)/len*hw;
+    ny = (p1.x - p0.x)/len*hw;
+    q[0].x = p0.x + nx;  q[0].y = p0.y + ny;
+    q[1].x = p1.x + nx;  q[1].y = p1.y + ny;
+    q[2].x = p1.x - nx;  q[2].y = p1.y - ny;
+    q[3].x = p0.x - nx;  q[3].y = p0.y - ny;
+    pik_png_poly(r, q, 4);
+  }
+  for(i=bClose ? 0 : 1; i<(bClose ? n : n-1); i++){
+    PPoint v = a[i];
+    PPoint pa = a[(i+n-1)%n];
+    PPoint pb = a[(i+1)%n];
+    PNum l1 = hypot(v.x - pa.x, v.y - pa.y);
+    PNum l2 = hypot(pb.x - v.x, pb.y - v.y);
+    PNum n1x, n1y, n2x, n2y, cross, k;
+    PPoint q[4];
+    if( l1<=0.0 || l2<=0.0 ) continue;
+    if( bRound ){
+      pik_png_disc(r, v, hw);
+      continue;
+    }
+    n1x = -(v.y - pa.y)/l1;  n1y = (v.x - pa.x)/l1;
+    n2x = -(pb.y - v.y)/l2;  n2y = (pb.x - v.x)/l2;
+    cross = (v.x - pa.x)*(pb.y - v.y) - (v.y - pa.y)*(pb.x - v.x);
+    if( cross==0.0 ) continue;
+    if( cross>0.0 ){
+      n1x = -n1x;  n1y = -n1y;  n2x = -n2x;  n2y = -n2y;
+    }
+    q[0] = v;
+    q[1].x = v.x + n1x*hw;  q[1].y = v.y + n1y*hw;
+    q[3].x = v.x + n2x*hw;  q[3].y = v.y + n2y*hw;
+    k = 1.0 + n1x*n2x + n1y*n2y;
+    if( k>0.0 && hypot(n1x+n2x, n1y+n2y)/k<=4.0 ){
+      q[2].x = v.x + (n1x+n2x)/k*hw;
+      q[2].y = v.y + (n1y+n2y)/k*hw;
+      pik_png_poly(r, q, 4);
+    }else{
+      q[2] = q[3];
+      pik_png_poly(r, q, 3);
+    }
+  }
+}
+
+/* Add the stroke of every contour of the current outline, with dashes
+** if s->aDash[] is set.
+*/
+static void pik_png_stroke(PRaster *r, const PRStyle *s){
+  PNum hw = 0.5*s->sw*r->sx;
+  PNum dash = s->aDash[0]*r->sx;
+  PNum gap = s->aDash[1]*r->sx;
+  int k;
+  if( hw<=0.0 ) return;
+  for(k=0; k<r->nSub; k++){
+    int iFirst = r->aSub[k];
+    int n = (k+1<r->nSub ? r->aSub[k+1] : r->nPt) - iFirst;
+    int bClose = r->aClose[k];
+    const PPoint *a = r->aPt + iFirst;
+    PPoint aPiece[256];
+    int i, nPiece;
+    PNum pos;      /* Distance into the current dash or gap */
+    int bOn;       /* True while in a dash */
+    if( bClose && n>2 && a[0].x==a[n-1].x && a[0].y==a[n-1].y ) n--;
+    if( n<2 ) continue;
+    if( dash<=0.0 || gap<=0.0 ){
+      pik_png_stroke_polyline(r, a, n, bClose, hw, s->bRound);
+      continue;
+    }
+    nPiece = 0;
+    pos = 0.0;
+    bOn = 1;
+    aPiece[nPiece++] = a[0];
+    for(i=0; i<(bClose ? n : n-1); i++){
+      PPoint p0 = a[i];
+      PPoint p1 = a[(i+1)%n];
+      PNum len = hypot(p1.x - p0.x, p1.y - p0.y);
+      PNum done = 0.0;
+      while( len-done > (bOn ? dash : gap) - pos ){
+        PNum step = (bOn ? dash : gap) - pos;
+        PNum t;
+        done += step;
+        t = done/len;
+        pos = 0.0;
+        if( bOn ){
+          aPiece[nPiece].x = p0.x + t*(p1.x - p0.x);
+          aPiece[nPiece].y = p0.y + t*(p1.y - p0.y);
+          nPiece++;
+          pik_png_stroke_polyline(r, aPiece, nPiece, 0, hw, s->bRound);
+          nPiece = 0;
+        }else{
+          aPiece[0].x = p0.x + t*(p1.x - p0.x);
+          aPiece[0].y = p0.y + t*(p1.y - p0.y);
+          nPiece = 1;
+        }
+        bOn = !bOn;
+      }
+      pos += len - done;
+      if( bOn ){
+        if( nPiece>=(int)count(aPiece) ){
+          pik_png_stroke_polyline(r, aPiece, nPiece, 0, hw, s->bRound);
+          aPiece[0] = aPiece[nPiece-1];
+          nPiece = 1;
+        }
+        aPiece[nPiece++] = p1;
+      }
+    }
+    if( bOn && nPiece>=2 ){
+      pik_png_stroke_polyline(r, aPiece, nPiece, 0, hw, s->bRound);
+    }
+  }
+}
+
+/* Fill and then stroke the current outline, and reset it */
+static void pik_png_draw(PRaster *r, const PRStyle *s){
+  int k;
+  if( s->fill>=0 ){
+    for(k=0; k<r->nSub; k++){
+      int iFirst = r->aSub[k];
+      int n = (k+1<r->nSub ? r->aSub[k+1] : r->nPt) - iFirst;
+      if( n>=3 ) pik_png_poly(r, r->aPt+iFirst, n);
+    }
+    pik_png_paint(r, s->fill);
+  }
+  if( s->stroke>=0 && s->sw>0.0 ){
+    pik_png_stroke(r, s);
+    pik_png_paint(r, s->stroke);
+  }
+  r->nPt = 0;
+  r->nSub = 0;
+}
+
+/* Find the value of attribute zName in the tag z[0..n-1].  Return a
+** pointer to the first character of the value and write its length
+** into *pnVal, or return NULL if there is no such attribute.
+*/
+static const char *pik_png_attr(
+  const char *z, int n, const char *zName, int *pnVal
+){
+  int nName = (int)strlen(zName);
+  int i, j;
+  for(i=1; i+nName+2<n; i++){
+    if( (z[i]=='"' || z[i]=='\'') ){
+      /* Skip over a quoted value */
+      char q = z[i];
+      for(i++; i<n && z[i]!=q; i++){}
+      continue;
+    }
+    if( !IsSpace(z[i-1]) || strncmp(z+i, zName, nName)!=0 ) continue;
+    if( z[i+nName]!='=' ) continue;
+    if( z[i+nName+1]!='"' && z[i+nName+1]!='\'' ) continue;
+    for(j=i+nName+2; j<n && z[j]!=z[i+nName+1]; j++){}
+    *pnVal = j - (i+nName+2);
+    return z+i+nName+2;
+  }
+  return 0;
+}
+
+/* Return the numeric value of attribute zName, or 0.0 if missing */
+static PNum pik_png_num(const char *z, int n, const char *zName){
+  int nVal;
+  const char *zVal = pik_png_attr(z, n, zName, &nVal);
+  return zVal ? strtod(zVal, 0) : 0.0;
+}
+
+/* Parse a color, "rgb(R,G,B)" or "none", at z.  Anything else, such as
+** "currentColor", is taken to be black.
+*/
+static int pik_png_color(const char *z){
+  int r = 0, g = 0, b = 0;
+  if( strncmp(z, "none", 4)==0 ) return -1;
+  if( sscanf(z, "rgb(%d,%d,%d)", &r, &g, &b)!=3 ) return 0;
+  return ((r&0xff)<<16) | ((g&0xff)<<8) | (b&0xff);
+}
+
+/* Fill in *s from the style="..." attribute of tag z[0..n-1] */
+static void pik_png_style(const char *z, int n, PRStyle *s){
+  int nVal, i;
+  const char *zVal = pik_png_attr(z, n, "style", &nVal);
+  memset(s, 0, sizeof(*s));
+  s->fill = 0;
+  s->stroke = -1;
+  if( zVal==0 ) return;
+  for(i=0; i<nVal; ){
+    const char *zDecl = zVal+i;
+    int j;
+    for(j=i; j<nVal && zVal[j]!=';'; j++){}
+    if( strncmp(zDecl, "fill:", 5)==0 ){
+      s->fill = pik_png_color(zDecl+5);
+    }else if( strncmp(zDecl, "stroke:", 7)==0 ){
+      s->stroke = pik_png_color(zDecl+7);
+    }else if( strncmp(zDecl, "stroke-width:", 13)==0 ){
+      s->sw = strtod(zDecl+13, 0);
+    }else if( strncmp(zDecl, "stroke-dasharray:", 17)==0 ){
+      char *zEnd;
+      s->aDash[0] = strtod(zDecl+17, &zEnd);
+      if( *zEnd==',' ) s->aDash[1] = strtod(zEnd+1, 0);
+    }else if( strncmp(zDecl, "stroke-linejoin:round", 21)==0 ){
+      s->bRound = 1;
+    }
+    i = j+1;
+  }
+}
+
+/* Read the next number from path data or a list of points.  Return 0
+** if there is none.
+*/
+static int pik_png_next_num(const char **pz, const char *zEnd, PNum *pv){
+  const char *z = *pz;
+  char *zAfter;
+  while( z<zEnd && (IsSpace(z[0]) || z[0]==',') ) z++;
+  if( z>=zEnd || (!IsDigit(z[0]) && z[0]!='-' && z[0]!='.' && z[0]!='+') ){
+    *pz = z;
+    return 0;
+  }
+  *pv = strtod(z, &zAfter);
+  *pz = zAfter;
+  return 1;
+}
+
+/* Add the outline from the path data z[0..n-1].  Only the commands
+** that Pikchr writes, M, L, Q, A, and Z, and their relative forms, are
+** understood.
+*/
+static void pik_png_path(PRaster *r, const char *z, int n){
+  const char *zEnd = z+n;
+  PNum x = 0.0, y = 0.0;      /* Current point */
+  PNum x0 = 0.0, y0 = 0.0;    /* Start of the current contour */
+  char cmd = 'M';
+  PNum v[7];
+  while( z<zEnd ){
+    int bRel, nArg, i;
+    while( z<zEnd && (IsSpace(z[0]) || z[0]==',') ) z++;
+    if( z>=zEnd ) break;
+    if( isalpha((unsigned char)z[0]) ){
+      cmd = *(z++);
+      if( cmd=='Z' || cmd=='z' ){
+        if( r->nSub ) r->aClose[r->nSub-1] = 1;
+        x = x0;
+        y = y0;
+        continue;
+      }
+    }
+    bRel = islower((unsigned char)cmd);
+    switch( cmd ){
+      case 'M': case 'm': case 'L': case 'l':  nArg = 2;  break;
+      case 'Q': case 'q':                      nArg = 4;  break;
+      case 'A': case 'a':                      nArg = 7;  break;
+      default:                                 return;
+    }
+    for(i=0; i<nArg; i++){
+      if( !pik_png_next_num(&z, zEnd, &v[i]) ) return;
+    }
+    if( bRel ){
+      for(i=nArg-2; i>=0; i-=2){
+        if( nArg==7 && i<5 ) break;
+        v[i] += x;
+        v[i+1] += y;
+      }
+    }
+    switch( cmd ){
+      case 'M': case 'm':
+        pik_png_point(r, v[0], v[1], 1);
+        x0 = v[0];
+        y0 = v[1];
+        cmd = bRel ? 'l' : 'L';
+        break;
+      case 'L': case 'l':
+        pik_png_point(r, v[0], v[1], 0);
+        break;
+      case 'Q': case 'q':
+        pik_png_quad(r, x, y, v[0], v[1], v[2], v[3]);
+        break;
+      default:
+        pik_png_arc(r, x, y, v[0], v[1], v[3]!=0.0, v[4]!=0.0, v[5], v[6]);
+        break;
+    }
+    x = v[nArg-2];
+    y = v[nArg-1];
+  }
+}
+
+/* Draw the text of a <text> element z[0..n-1] whose content is
+** zTxt[0..nTxt-1].  Each lit pixel of the font becomes a small square,
+** so the glyphs scale and rotate smoothly.
+*/
+static void pik_png_text(
+  PRaster *r, const char *z, int n, const char *zTxt, int nTxt
+){
+  char zChar[200];     /* Decoded characters, indexes into aPikFont[] */
+  int nChar = 0;
+  int nVal, i, j, k;
+  const char *zVal;
+  PNum x = pik_png_num(z, n, "x");
+  PNum y = pik_png_num(z, n, "y");
+  PNum g;              /* Size of one font pixel in user units */
+  PNum x0, y0;         /* Top left of the first glyph */
+  PNum ang = 0.0;      /* Rotation in radians */
+  PNum rx = 0.0, ry = 0.0;   /* Center of rotation */
+  PNum rShear;         /* Horizontal shift per unit of height, for italic */
+  PNum wDot;           /* Width of one font pixel, wider for bold */
+  int clr = 0;
+  PRStyle s;
+
+  /* Decode the content.  Entities are those written by
+  ** pik_append_text(), and characters outside of ASCII show as "?". */
+  for(i=0; i<nTxt && nChar<(int)sizeof(zChar); i++){
+    unsigned char c = (unsigned char)zTxt[i];
+    if( c=='&' ){
+      for(j=i+1; j<nTxt && j<i+10 && zTxt[j]!=';'; j++){}
+      if( strncmp(zTxt+i, "&lt;", 4)==0 ) c = '<';
+      else if( strncmp(zTxt+i, "&gt;", 4)==0 ) c = '>';
+      else if( strncmp(zTxt+i, "&amp;", 5)==0 ) c = '&';
+      else if( strncmp(zTxt+i, "&quot;", 6)==0 ) c = '"';
+      else if( zTxt[i+1]=='#' ){
+        long v = zTxt[i+2]=='x' || zTxt[i+2]=='X' ?
+                    strtol(zTxt+i+3, 0, 16) : strtol(zTxt+i+2, 0, 10);
+        c = v>=0x20 && v<0x7f ? (unsigned char)v : '?';
+      }else c = '?';
+      if( j<nTxt && zTxt[j]==';' ) i = j;
+    }else if( c==0xc2 && i+1<nTxt && (unsigned char)zTxt[i+1]==0xa0 ){
+      c = ' ';
+      i++;
+    }else if( c>=0x80 ){
+      while( i+1<nTxt && ((unsigned char)zTxt[i+1]&0xc0)==0x80 ) i++;
+      c = '?';
+    }else if( c<0x20 || c==0x7f ){
+      c = '?';
+    }
+    zChar[nChar++] = (char)(c - 0x20);
+  }
+  if( nChar==0 ) return;
+
+  /* Font size and style */
+  pik_png_style(z, n, &s);
+  zVal = pik_png_attr(z, n, "fill", &nVal);
+  clr = zVal ? pik_png_color(zVal) : s.fill;
+  if( clr<0 ) return;
+  g = 16.0/9.0;
+  zVal = pik_png_attr(z, n, "font-size", &nVal);
+  if( zVal ) g *= strtod(zVal, 0)*0.01;
+  zVal = pik_png_attr(z, n, "font-weight", &nVal);
+  wDot = zVal && strncmp(zVal, "bold", 4)==0 ? 1.4*g : g;
+  zVal = pik_png_attr(z, n, "font-style", &nVal);
+  rShear = zVal && strncmp(zVal, "italic", 6)==0 ? 0.2 : 0.0;
+  zVal = pik_png_attr(z, n, "transform", &nVal);
+  if( zVal && strncmp(zVal, "rotate(", 7)==0 ){
+    const char *zArg = zVal+7;
+    PNum a = 0.0;
+    if( pik_png_next_num(&zArg, zVal+nVal, &a) ){
+      ang = a*M_PI/180.0;
+      pik_png_next_num(&zArg, zVal+nVal, &rx);
+      pik_png_next_num(&zArg, zVal+nVal, &ry);
+    }
+  }
+
+  /* Placement, from text-anchor and dominant-baseline="central" */
+  x0 = x;
+  zVal = pik_png_attr(z, n, "text-anchor", &nVal);
+  if( zVal && strncmp(zVal, "middle", 6)==0 ){
+    x0 -= 0.5*(nChar*6 - 1)*g;
+  }else if( zVal && strncmp(zVal, "end", 3)==0 ){
+    x0 -= (nChar*6 - 1)*g;
+  }
+  y0 = y - 3.5*g;
+
+  for(i=0; i<nChar; i++){
+    const unsigned char *aCol = aPikFont[(int)zChar[i]];
+    for(j=0; j<5; j++){
+      for(k=0; k<7; k++){
+        PPoint q[4];
+        PNum dx, top;
+        int m;
+        if( (aCol[j] & (1<<k))==0 ) continue;
+        dx = x0 + (i*6 + j)*g;
+        top = y0 + k*g;
+        q[0].x = dx;       q[0].y = top;
+        q[1].x = dx+wDot;  q[1].y = top;
+        q[2].x = dx+wDot;  q[2].y = top+g;
+        q[3].x = dx;       q[3].y = top+g;
+        for(m=0; m<4; m++){
+          PNum px = q[m].x + rShear*(y - q[m].y);
+          PNum py = q[m].y;
+          if( ang!=0.0 ){
+            PNum tx = px - rx, ty = py - ry;
+            px = rx + tx*cos(ang) - ty*sin(ang);
+            py = ry + tx*sin(ang) + ty*cos(ang);
+          }
+          q[m].x = px*r->sx;
+          q[m].y = py*r->sy;
+        }
+        pik_png_poly(r, q, 4);
+      }
+    }
+  }
+  pik_png_paint(r, clr);
+}
+
+/* Draw every element of the SVG in zSvg onto the raster */
+static void pik_png_draw_svg(PRaster *r, const char *zSvg){
+  const char *z = zSvg;
+  while( (z = strchr(z, '<'))!=0 && !r->bOom ){
+    int n, nVal;
+    char q = 0;
+    const char *zVal;
+    PRStyle s;
+    for(n=1; z[n] && (q || z[n]!='>'); n++){
+      if( q ){
+        if( z[n]==q ) q = 0;
+      }else if( z[n]=='"' || z[n]=='\'' ){
+        q = z[n];
+      }
+    }
+    if( z[n]==0 ) break;
+    if( strncmp(z, "<path ", 6)==0 ){
+      zVal = pik_png_attr(z, n, "d", &nVal);
+      if( zVal ) pik_png_path(r, zVal, nVal);
+      pik_png_style(z, n, &s);
+      pik_png_draw(r, &s);
+    }else if( strncmp(z, "<polygon ", 9)==0 ){
+      zVal = pik_png_attr(z, n, "points", &nVal);
+      if( zVal ){
+        const char *zEnd = zVal+nVal;
+        PNum px, py;
+        int bFirst = 1;
+        while( pik_png_next_num(&zVal, zEnd, &px)
+            && pik_png_next_num(&zVal, zEnd, &py) ){
+          pik_png_point(r, px, py, bFirst);
+          bFirst = 0;
+        }
+        if( r->nSub ) r->aClose[r->nSub-1] = 1;
+      }
+      pik_png_style(z, n, &s);
+      pik_png_draw(r, &s);
+    }else if( strncmp(z, "<circle ", 8)==0 ){
+      PNum rad = pik_png_num(z, n, "r");
+      pik_png_ellipse(r, pik_png_num(z,n,"cx"), pik_png_num(z,n,"cy"),
+                      rad, rad);
+      pik_png_style(z, n, &s);
+      pik_png_draw(r, &s);
+    }else if( strncmp(z, "<ellipse ", 9)==0 ){
+      pik_png_ellipse(r, pik_png_num(z,n,"cx"), pik_png_num(z,n,"cy"),
+                      pik_png_num(z,n,"rx"), pik_png_num(z,n,"ry"));
+      pik_png_style(z, n, &s);
+      pik_png_draw(r, &s);
+    }else if( strncmp(z, "<text ", 6)==0 ){
+      const char *zTxt = z+n+1;
+      const char *zClose = strstr(zTxt, "</text>");
+      if( zClose==0 ) break;
+      pik_png_text(r, z, n, zTxt, (int)(zClose - zTxt));
+      z = zClose;
+      continue;
+    }
+    z += n;
+  }
+}
+
+/* Append a big-endian 32-bit integer */
+static void pik_png_u32(Pik *p, unsigned int v){
+  char a[4];
+  a[0] = (char)(v>>24);
+  a[1] = (char)(v>>16);
+  a[2] = (char)(v>>8);
+  a[3] = (char)v;
+  pik_append(p, a, 4);
+}
+
+/* Append a PNG chunk */
+static void pik_png_chunk(
+  Pik *p, const char *zType, const char *aData, unsigned int nData
+){
+  unsigned int aCrc[256];
+  unsigned int crc = 0xffffffff;
+  unsigned int i;
+  int k;
+  for(i=0; i<256; i++){
+    unsigned int c = i;
+    for(k=0; k<8; k++) c = c&1 ? 0xedb88320 ^ (c>>1) : c>>1;
+    aCrc[i] = c;
+  }
+  for(i=0; i<4; i++){
+    crc = aCrc[(crc ^ (unsigned char)zType[i]) & 0xff] ^ (crc>>8);
+  }
+  for(i=0; i<nData; i++){
+    crc = aCrc[(crc ^ (unsigned char)aData[i]) & 0xff] ^ (crc>>8);
+  }
+  pik_png_u32(p, nData);
+  pik_append(p, zType, 4);
+  if( nData ) pik_append(p, aData, (int)nData);
+  pik_png_u32(p, crc ^ 0xffffffff);
+}
+
+/* Bit writer for deflate */
+typedef struct PBits PBits;
+struct PBits {
+  Pik *p;                /* Output buffer */
+  unsigned int v;        /* Bits not yet written */
+  int n;                 /* Number of bits in v */
+};
+
+/* Write the low n bits of v, least significant first */
+static void pik_png_bits(PBits *b, unsigned int v, int n){
+  b->v |= v<<b->n;
+  b->n += n;
+  while( b->n>=8 ){
+    char c = (char)(b->v & 0xff);
+    pik_append(b->p, &c, 1);
+    b->v >>= 8;
+    b->n -= 8;
+  }
+}
+
+/* Write an n-bit Huffman code, most significant bit first */
+static void pik_png_code(PBits *b, unsigned int code, int n){
+  unsigned int v = 0;
+  int i;
+  for(i=0; i<n; i++) v |= ((code>>i)&1)<<(n-1-i);
+  pik_png_bits(b, v, n);
+}
+
+/* Write literal/length symbol c using the fixed Huffman code */
+static void pik_png_sym(PBits *b, int c){
+  if( c<144 )      pik_png_code(b, 0x30 + c, 8);
+  else if( c<256 ) pik_png_code(b, 0x190 + c - 144, 9);
+  else if( c<280 ) pik_png_code(b, c - 256, 7);
+  else             pik_png_code(b, 0xc0 + c - 280, 8);
+}
+
+/* Append a zlib stream holding a[0..n-1].  Matches are found with a
+** hash of three bytes and a short chain of earlier positions.
+*/
+static void pik_png_deflate(Pik *p, const unsigned char *a, unsigned int n){
+  static const unsigned short aLenBase[29] = {
+    3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,
+    131,163,195,227,258 };
+  static const unsigned char aLenExtra[29] = {
+    0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0 };
+  static const unsigned short aDistBase[30] = {
+    1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,
+    1537,2049,3073,4097,6145,8193,12289,16385,24577 };
+  static const unsigned char aDistExtra[30] = {
+    0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
+  int *aHead;            /* Most recent position for each hash */
+  int *aPrev;            /* Previous position with the same hash */
+  unsigned int s1 = 1, s2 = 0;   /* Adler-32 checksum */
+  unsigned int i, j;
+  PBits b;
+
+  aHead = pik_malloc( sizeof(int)*0x8000 );
+  aPrev = pik_malloc( sizeof(int)*0x8000 );
+  if( aHead==0 || aPrev==0 ){
+    pik_free(aHead);
+    pik_free(aPrev);
+    pik_error(p, 0, 0);
+    return;
+  }
+  for(i=0; i<0x8000; i++) aHead[i] = -1;
+  pik_append(p, "\170\001", 2);
+  b.p = p;
+  b.v = 0;
+  b.n = 0;
+  pik_png_bits(&b, 1, 1);    /* Final block */
+  pik_png_bits(&b, 1, 2);    /* Fixed Huffman codes */
+  for(i=0; i<n && p->nErr==0; ){
+    int nBest = 0;
+    int iDist = 0;
+    if( i+2<n ){
+      unsigned int h = ((a[i]<<10) ^ (a[i+1]<<5) ^ a[i+2]) & 0x7fff;
+      int iCand = aHead[h];
+      int nDepth = 32;
+      int nMax = n-i<258 ? (int)(n-i) : 258;
+      while( iCand>=0 && i-iCand<=32768 && nDepth-- > 0 ){
+        int k = 0;
+        while( k<nMax && a[iCand+k]==a[i+k] ) k++;
+        if( k>nBest ){
+          nBest = k;
+          iDist = i - iCand;
+          if( k==nMax ) break;
+        }
+        iCand = aPrev[iCand & 0x7fff];
+      }
+    }
+    if( nBest<3 ) nBest = 1;
+    for(j=i; j<i+nBest; j++){
+      if( j+2<n ){
+        unsigned int h = ((a[j]<<10) ^ (a[j+1]<<5) ^ a[j+2]) & 0x7fff;
+        aPrev[j & 0x7fff] = aHead[h];
+        aHead[h] = (int)j;
+      }
+      s1 = (s1 + a[j]) % 65521;
+      s2 = (s2 + s1) % 65521;
+    }
+    if( nBest==1 ){
+      pik_png_sym(&b, a[i]);
+    }else{
+      int k;
+      for(k=28; aLenBase[k]>nBest; k--){}
+      pik_png_sym(&b, 257+k);
+      pik_png_bits(&b, nBest - aLenBase[k], aLenExtra[k]);
+      for(k=29; aDistBase[k]>iDist; k--){}
+      pik_png_code(&b, k, 5);
+      pik_png_bits(&b, iDist - aDistBase[k], aDistExtra[k]);
+    }
+    i += nBest;
+  }
+  pik_png_sym(&b, 256);
+  pik_png_bits(&b, 0, 7);    /* Flush to a byte boundary */
+  pik_png_u32(p, (s2<<16) | s1);
+  pik_free(aHead);
+  pik_free(aPrev);
+}
+
+/* Encode the raster as a PNG file in p->zOut.  Each row is filtered
+** with whichever of the None, Sub, Up, and Paeth filters gives the
+** smallest sum of absolute values.
+*/
+static void pik_png_encode(Pik *p, PRaster *r){
+  size_t nRow = (size_t)r->w*4;
+  unsigned char *aRaw;
+  unsigned char *aPrior;
+  unsigned char *aTry;
+  Pik z;
+  char aHdr[13];
+  int x, y, f;
+
+  /* Convert to straight alpha */
+  for(x=0; x<r->w*r->h; x++){
+    unsigned char *px = r->aPix + (size_t)x*4;
+    unsigned int a = px[3];
+    if( a>0 && a<255 ){
+      for(f=0; f<3; f++){
+        unsigned int c = (px[f]*255 + a/2)/a;
+        px[f] = (unsigned char)(c>255 ? 255 : c);
+      }
+    }
+  }
+  aRaw = pik_malloc( (nRow+1)*r->h );
+  aPrior = pik_calloc( nRow, 1 );
+  aTry = pik_malloc( nRow*4 );
+  if( aRaw==0 || aPrior==0 || aTry==0 ){
+    pik_free(aRaw);
+    pik_free(aPrior);
+    pik_free(aTry);
+    pik_error(p, 0, 0);
+    return;
+  }
+  for(y=0; y<r->h; y++){
+    const unsigned char *aRow = r->aPix + nRow*y;
+    unsigned char *aOut = aRaw + (nRow+1)*y;
+    unsigned long nBest = 0;
+    int iBest = 0;
+    size_t i;
+    for(i=0; i<nRow; i++){
+      int left = i>=4 ? aRow[i-4] : 0;
+      int up = aPrior[i];
+      int ul = i>=4 ? aPrior[i-4] : 0;
+      int pa = abs(up - ul);
+      int pb = abs(left - ul);
+      int pc = abs(left + up - 2*ul);
+      int pred = pa<=pb && pa<=pc ? left : pb<=pc ? up : ul;
+      aTry[i] = aRow[i];
+      aTry[nRow+i] = (unsigned char)(aRow[i] - left);
+      aTry[nRow*2+i] = (unsigned char)(aRow[i] - up);
+      aTry[nRow*3+i] = (unsigned char)(aRow[i] - pred);
+    }
+    for(f=0; f<4; f++){
+      unsigned long nSum = 0;
+      for(i=0; i<nRow; i++){
+        unsigned char c = aTry[nRow*f+i];
+        nSum += c<128 ? c : 256-c;
+      }
+      if( f==0 || nSum<nBest ){
+        nBest = nSum;
+        iBest = f;
+      }
+    }
+    aOut[0] = (unsigned char)(iBest==3 ? 4 : iBest);
+    memcpy(aOut+1, aTry + nRow*iBest, nRow);
+    memcpy(aPrior, aRow, nRow);
+  }
+  pik_free(aPrior);
+  pik_free(aTry);
+
+  memset(&z, 0, sizeof(z));
+  pik_png_deflate(&z, aRaw, (unsigned int)((nRow+1)*r->h));
+  pik_free(aRaw);
+  if( z.nErr ){
+    pik_free(z.zOut);
+    pik_error(p, 0, 0);
+    return;
+  }
+  pik_append(p, "\211PNG\r\n\032\n", 8);
+  memset(aHdr, 0, sizeof(aHdr));
+  aHdr[0] = (char)(r->w>>24);  aHdr[1] = (char)(r->w>>16);
+  aHdr[2] = (char)(r->w>>8);   aHdr[3] = (char)r->w;
+  aHdr[4] = (char)(r->h>>24);  aHdr[5] = (char)(r->h>>16);
+  aHdr[6] = (char)(r->h>>8);   aHdr[7] = (char)r->h;
+  aHdr[8] = 8;       /* Bit depth */
+  aHdr[9] = 6;       /* RGBA */
+  pik_png_chunk(p, "IHDR", aHdr, 13);
+  pik_png_chunk(p, "IDAT", z.zOut, z.nOut);
+  pik_png_chunk(p, "IEND", 0, 0);
+  pik_free(z.zOut);
+}
+
+/* Same as pikchr_png() below, for zText[] following the prelude pPrelude */
+unsigned char *pikchr_prelude_png(
+  const pikchr_prelude *pPrelude,  /* Prelude, or NULL for none */
+  const char *zText,     /* Input PIKCHR source text.  zero-terminated */
+  unsigned int mFlags,   /* Flags used to influence rendering behavior */
+  double rZoom,          /* Image pixels per SVG pixel */
+  int *pnByte,           /* Write the size of the PNG here */
+  int *pnWidth,          /* Write the width in pixels here, if not NULL */
+  int *pnHeight          /* Write the height here, if not NULL */
+){
+  int w, h;
+  char *zSvg;
+  const char *z;
+  PNum wView = 0.0, hView = 0.0;
+  double rW, rH;         /* Image size in pixels */
+  PRaster r;
+  Pik s;
+
+  zSvg = pikchr_prelude_render(pPrelude, zText, 0,
+                mFlags & (PIKCHR_PLAINTEXT_ERRORS|PIKCHR_DARK_MODE), &w, &h);
+  if( zSvg==0 || w<0 ){
+    *pnByte = zSvg ? (int)strlen(zSvg) : 0;
+    if( pnWidth ) *pnWidth = -1;
+    if( pnHeight ) *pnHeight = -1;
+    return (unsigned char*)zSvg;
+  }
+  if( !(rZoom>0.0) ) rZoom = 1.0;
+  memset(&r, 0, sizeof(r));
+  memset(&s, 0, sizeof(s));
+  rW = floor(w*rZoom + 0.5);
+  rH = floor(h*rZoom + 0.5);
+  if( rW<1.0 ) rW = 1.0;
+  if( rH<1.0 ) rH = 1.0;
+  if( !(rW*rH <= 1e8) ){
+    /* Too large, or not a number.  Report it as pik_error() would */
+    s.mFlags = mFlags;
+    if( (mFlags & PIKCHR_PLAINTEXT_ERRORS)==0 ){
+      pik_append(&s, "<div><pre>\n", -1);
+    }
+    pik_append(&s, "ERROR: image too large\n", -1);
+    if( (mFlags & PIKCHR_PLAINTEXT_ERRORS)==0 ){
+      pik_append(&s, "</pre></div>\n", -1);
+    }
+    pik_free(zSvg);
+    *pnByte = (int)s.nOut;
+    if( pnWidth ) *pnWidth = -1;
+    if( pnHeight ) *pnHeight = -1;
+    return (unsigned char*)s.zOut;
+  }
+  r.w = (int)rW;   /* Both are at most 1e8, so they fit */
+  r.h = (int)rH;
+  z = strstr(zSvg, "<svg");
+  if( z && (z = strstr(z, "viewBox=\""))!=0 ){
+    sscanf(z+9, "%*f %*f %lf %lf", &wView, &hView);
+  }
+  r.sx = wView>0.0 ? r.w/wView : 1.0;
+  r.sy = hView>0.0 ? r.h/hView : 1.0;
+  r.xMin = r.w;
+  r.yMin = r.h;
+  r.yMax = -1;
+  r.aPix = pik_calloc( (size_t)r.w*r.h, 4 );
+  r.aAcc = pik_calloc( (size_t)(r.w+2)*r.h, sizeof(float) );
+  r.aCov = pik_malloc( r.w+2 );
+  if( r.aPix && r.aAcc && r.aCov ){
+    if( z ) pik_png_draw_svg(&r, z);
+    if( !r.bOom ) pik_png_encode(&s, &r);
+  }else{
+    r.bOom = 1;
+  }
+  pik_free(zSvg);
+  pik_free(r.aPix);
+  pik_free(r.aAcc);
+  pik_free(r.aCov);
+  pik_free(r.aPt);
+  pik_free(r.aSub);
+  pik_free(r.aClose);
+  if( r.bOom || s.nErr ){
+    pik_free(s.zOut);
+    *pnByte = 0;
+    if( pnWidth ) *pnWidth = -1;
+    if( pnHeight ) *pnHeight = -1;
+    return 0;
+  }
+  *pnByte = (int)s.nOut;
+  if( pnWidth ) *pnWidth = r.w;
+  if( pnHeight ) *pnHeight = r.h;
+  return (unsigned char*)s.zOut;
+}
+
+/*
+** Draw Pikchr source text into a PNG image.  The return value is the
+** PNG file in memory obtained from malloc(), its size is written into
+** *pnByte, and the size of the image in pixels into *pnWidth and
+** *pnHeight.  rZoom is the number of image pixels for each pixel of the
+** SVG that pikchr() would make, for example 2.0 for high density
+** screens.
+**
+** On an error, *pnWidth is negative and the return value is the error
+** message text, just as for pikchr().  Only the PIKCHR_PLAINTEXT_ERRORS
+** and PIKCHR_DARK_MODE bits of mFlags are used.
+*/
+unsigned char *pikchr_png(
+  const char *zText,     /* Input PIKCHR source text.  zero-terminated */
+  unsigned int mFlags,   /* Flags used to influence rendering behavior */
+  double rZoom,          /* Image pixels per SVG pixel */
+  int *pnByte,           /* Write the size of the PNG here */
+  int *pnWidth,          /* Write the width in pixels here, if not NULL */
+  int *pnHeight          /* Write the height here, if not NULL */
+){
+  return pikchr_prelude_png(0, zText, mFlags, rZoom, pnByte, pnWidth, pnHeight);
 }
 
 #if defined(PIKCHR_FUZZ)
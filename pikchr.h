@@ -38,6 +38,255 @@ char *pikchr(
 */
 #define PIKCHR_CURRENTCOLOR_FOR_BLACK 0x0004
 
+/* Include PIKCHR_CSS_COLORS among the bits of mFlags on the 3rd
+** argument to pikchr() to render a single image that adapts to the
+** viewer's light or dark color scheme.  Colors that change in dark mode
+** become CSS custom properties, and a <style> element in the SVG sets
+** their dark values in a prefers-color-scheme media query.  This takes
+** precedence over PIKCHR_DARK_MODE.
+*/
+#define PIKCHR_CSS_COLORS       0x0008
+
+/* Include PIKCHR_CSS_CLASSES among the bits of mFlags on the 3rd
+** argument to pikchr() to write each distinct shape style and text style
+** once, as a CSS class in a <style> element at the top of the SVG, and
+** refer to it with class="..." instead of repeating an inline style on
+** every element.  Class names are derived from the style text, so they
+** mean the same thing in every diagram on a page.
+*/
+#define PIKCHR_CSS_CLASSES      0x0010
+
+/* Include PIKCHR_ARROW_MARKERS among the bits of mFlags on the 3rd
+** argument to pikchr() to draw arrowheads with one shared SVG <marker>
+** for each distinct arrowhead color and size, attached to the lines
+** with marker-start and marker-end, instead of a separate <polygon> for
+** every arrowhead.  The drawing looks the same.
+*/
+#define PIKCHR_ARROW_MARKERS    0x0020
+
+/* Include PIKCHR_SYMBOLS among the bits of mFlags on the 3rd argument
+** to pikchr() to draw objects (including [...] groups) that appear more
+** than once, identical except for position, only once inside <defs>, and
+** to place each copy with <use>.  This is most useful for diagrams built
+** by calling the same macro many times.  Ignored when "debug" is set.
+*/
+#define PIKCHR_SYMBOLS          0x0040
+
+/* Include PIKCHR_COMPACT among the bits of mFlags on the 3rd argument
+** to pikchr() to make the SVG as small as possible.  Numbers are rounded
+** to a fixed number of decimal places, path data uses relative "l", "q",
+** and "a" commands, and whitespace between and inside tags is removed.
+** Also include PIKCHR_COMPACT_DECIMALS(N), for N from 0 to 6, to round to
+** N decimal places instead of the default of 2.
+*/
+#define PIKCHR_COMPACT          0x0080
+#define PIKCHR_COMPACT_DECIMALS(N)  ((((N)&7)+1)<<8)
+
+/* Query or change one of the run-time limits identified by the
+** PIKCHR_LIMIT_* codes below.  The prior value of the limit is returned.
+** If iNewVal is negative the limit is left unchanged, so the current
+** value can be read with pikchr_limit(eLimit, -1).  Limits are
+** process-wide; set them before rendering in multi-threaded programs.
+*/
+int pikchr_limit(int eLimit, int iNewVal);
+
+/* Maximum number of entries on the parser stack.  The stack starts small
+** and grows on demand up to this depth.  Deeply nested [...] blocks need
+** a larger value.  The default is 10000.
+*/
+#define PIKCHR_LIMIT_STACK_DEPTH 0
+
+/* Most threads used to render one large diagram.  Lists of many objects
+** are rendered, and their bounding box computed, in chunks on several
+** threads, with the same output as rendering on one thread.  The default
+** is 1, which never starts threads.  0 means one thread per online CPU.
+** Only used with the default allocator, and not while pikchr_batch() is
+** running jobs on several threads.
+*/
+#define PIKCHR_LIMIT_RENDER_THREADS 1
+
+/* Parse once, render many times.  pikchr_layout_new() parses zText and
+** computes the layout of the diagram, returning a handle, or NULL with
+** the error text (from malloc()) in *pzErr if pzErr is not NULL.
+** pikchr_layout_render() then produces SVG from the handle exactly as
+** pikchr() would, and may be called any number of times with different
+** zClass and mFlags values.  Free the handle with pikchr_layout_free().
+*/
+typedef struct pikchr_layout pikchr_layout;
+pikchr_layout *pikchr_layout_new(
+  const char *zText,     /* Input PIKCHR source text.  zero-terminated */
+  unsigned int mFlags,   /* Only PIKCHR_PLAINTEXT_ERRORS matters here */
+  char **pzErr           /* OUT: Error message text, if not NULL */
+);
+char *pikchr_layout_render(
+  const pikchr_layout*,  /* Layout from pikchr_layout_new() */
+  const char *zClass,    /* Add class="%s" to <svg> markup */
+  unsigned int mFlags,   /* Flags used to influence rendering behavior */
+  int *pnWidth,          /* OUT: Write width of <svg> here, if not NULL */
+  int *pnHeight          /* OUT: Write height here, if not NULL */
+);
+void pikchr_layout_free(pikchr_layout*);
+
+/* Convert a layout to and from a compact binary blob, so that a laid-out
+** diagram can be cached on disk or passed to another process.  The blob
+** from pikchr_layout_serialize() is obtained from malloc() and its size
+** is written into *pnByte.  pikchr_layout_deserialize() returns NULL if
+** the blob is malformed.  The format may change between versions.
+*/
+void *pikchr_layout_serialize(const pikchr_layout*, size_t *pnByte);
+pikchr_layout *pikchr_layout_deserialize(const void *pBlob, size_t nByte);
+
+/* Re-render a script that is being edited.  A session remembers the
+** text and layout from the previous call to pikchr_session_render(),
+** with a checkpoint after each top-level statement.  The next call
+** resumes parsing at the last checkpoint before the first changed
+** byte, so an edit near the end of a long script is cheap.  The
+** arguments and result are the same as for pikchr(), and so is the
+** output.  A session must not be used by two threads at once.
+*/
+typedef struct pikchr_session pikchr_session;
+pikchr_session *pikchr_session_new(void);
+char *pikchr_session_render(
+  pikchr_session*,       /* Session from pikchr_session_new() */
+  const char *zText,     /* Input PIKCHR source text.  zero-terminated */
+  const char *zClass,    /* Add class="%s" to <svg> markup */
+  unsigned int mFlags,   /* Flags used to influence rendering behavior */
+  int *pnWidth,          /* OUT: Write width of <svg> here, if not NULL */
+  int *pnHeight          /* OUT: Write height here, if not NULL */
+);
+void pikchr_session_free(pikchr_session*);
+
+/* Compile shared macros and variables once.  pikchr_prelude_new() parses
+** a script that has only "define" statements and assignments, returning
+** a handle, or NULL with the error text in *pzErr as for
+** pikchr_layout_new().  An object or a "print" statement in the prelude
+** is an error.  pikchr_prelude_render() is the same as pikchr()
+** except that zText starts with a copy of the macros and variables of the
+** prelude.  A prelude may be used by any number of diagrams, from any
+** number of threads.  Free it with pikchr_prelude_free().
+*/
+typedef struct pikchr_prelude pikchr_prelude;
+pikchr_prelude *pikchr_prelude_new(
+  const char *zText,     /* Text of the prelude.  zero-terminated */
+  unsigned int mFlags,   /* Only PIKCHR_PLAINTEXT_ERRORS matters here */
+  char **pzErr           /* OUT: Error message text, if not NULL */
+);
+char *pikchr_prelude_render(
+  const pikchr_prelude*, /* Prelude, or NULL for none */
+  const char *zText,     /* Input PIKCHR source text.  zero-terminated */
+  const char *zClass,    /* Add class="%s" to <svg> markup */
+  unsigned int mFlags,   /* Flags used to influence rendering behavior */
+  int *pnWidth,          /* OUT: Write width of <svg> here, if not NULL */
+  int *pnHeight          /* OUT: Write height here, if not NULL */
+);
+void pikchr_prelude_free(pikchr_prelude*);
+
+/* Where the time goes.  pikchr_stats_render() is the same as
+** pikchr_prelude_render(), and also fills in *pStats with the time spent
+** in each phase of the work, in seconds, and some counts.  nPeakEst
+** adds up the sizes of the objects, names, output, and working storage
+** held while rendering.  It is not a count of the bytes allocated.
+*/
+typedef struct pikchr_stats pikchr_stats;
+struct pikchr_stats {
+  double rTokenize;        /* Splitting the input into tokens */
+  double rParse;           /* Parser actions, other than layout */
+  double rLayout;          /* Sizing and placing each object */
+  double rBbox;            /* Computing the bounding box of the diagram */
+  double rRender;          /* Writing the SVG */
+  unsigned int nToken;     /* Tokens sent to the parser */
+  unsigned int nObj;       /* Objects created, including inside [...] */
+  unsigned int nMacro;     /* Macro expansions */
+  unsigned int nVarLookup; /* Lookups of variables by name */
+  size_t nOut;             /* Bytes of output */
+  size_t nPeakEst;         /* Estimate of the most bytes held at once */
+};
+char *pikchr_stats_render(
+  const pikchr_prelude*, /* Prelude, or NULL for none */
+  const char *zText,     /* Input PIKCHR source text.  zero-terminated */
+  const char *zClass,    /* Add class="%s" to <svg> markup */
+  unsigned int mFlags,   /* Flags used to influence rendering behavior */
+  pikchr_stats *pStats,  /* OUT: Timings and counters */
+  int *pnWidth,          /* OUT: Write width of <svg> here, if not NULL */
+  int *pnHeight          /* OUT: Write height here, if not NULL */
+);
+
+/* Use a custom memory allocator.  pikchr_use_allocator() makes pAlloc
+** the allocator for all memory used by Pikchr on the calling thread, or
+** restores malloc() if pAlloc is NULL, and returns the prior allocator.
+** Results returned by Pikchr, such as the SVG text, must then be freed
+** with pAlloc->xFree().  Layouts, sessions, and preludes remember the
+** allocator that created them, and a session also returns its results
+** from that allocator.  *pAlloc must remain valid while it is in use.
+*/
+typedef struct pikchr_allocator pikchr_allocator;
+struct pikchr_allocator {
+  void *(*xMalloc)(void *pCtx, size_t nByte);
+  void *(*xRealloc)(void *pCtx, void *pOld, size_t nByte);
+  void (*xFree)(void *pCtx, void *pOld);
+  void *pCtx;              /* First argument to each of the above */
+};
+const pikchr_allocator *pikchr_use_allocator(const pikchr_allocator *pAlloc);
+
+/* Render many independent scripts in parallel.  Each job is rendered
+** as by pikchr_prelude_render().  pikchr_batch() uses nThreads threads,
+** including the calling thread, or one per online CPU if nThreads is
+** zero or negative, and returns when all jobs are done.  The result is
+** an array of nJobs results in the same order as the jobs, or NULL if
+** out of memory.  Free it with pikchr_batch_free().  A job with its own
+** allocator is rendered with it, and others with the allocator of the
+** calling thread.  Free results that have their own allocator, and set
+** their zOut to NULL, before calling pikchr_batch_free().  Where
+** pikchr.c is built without threads (see PIKCHR_NO_THREADS there), the
+** jobs are rendered one after another on the calling thread.
+*/
+typedef struct pikchr_job pikchr_job;
+struct pikchr_job {
+  const char *zText;     /* Input PIKCHR source text.  zero-terminated */
+  const char *zClass;    /* Add class="%s" to <svg> markup */
+  unsigned int mFlags;   /* Flags used to influence rendering behavior */
+  const pikchr_prelude *pPrelude;  /* Prelude, or NULL for none */
+  const pikchr_allocator *pAlloc;  /* Allocator for this job, or NULL */
+};
+typedef struct pikchr_result pikchr_result;
+struct pikchr_result {
+  char *zOut;            /* SVG or error text, as returned by pikchr() */
+  int nWidth;            /* Width of <svg>, or negative on error */
+  int nHeight;           /* Height of <svg> */
+};
+pikchr_result *pikchr_batch(
+  const pikchr_job *aJobs,  /* The jobs */
+  size_t nJobs,             /* Number of jobs */
+  int nThreads              /* Threads to use, or <=0 for one per CPU */
+);
+void pikchr_batch_free(pikchr_result*, size_t nJobs);
+
+/* Draw a diagram directly into a PNG image, with no outside SVG renderer.
+** The PNG is returned in memory obtained from malloc() and its size is
+** written into *pnByte.  rZoom is the number of image pixels for each
+** pixel of the SVG that pikchr() would make, such as 2.0 for high density
+** screens.  If an error occurs, *pnWidth is negative and the return value
+** is the error message text, as for pikchr().  Only the
+** PIKCHR_PLAINTEXT_ERRORS and PIKCHR_DARK_MODE flags have any effect.
+*/
+unsigned char *pikchr_png(
+  const char *zText,     /* Input PIKCHR source text.  zero-terminated */
+  unsigned int mFlags,   /* Flags used to influence rendering behavior */
+  double rZoom,          /* Image pixels per SVG pixel */
+  int *pnByte,           /* OUT: Size of the PNG in bytes */
+  int *pnWidth,          /* OUT: Width in pixels, if not NULL */
+  int *pnHeight          /* OUT: Height in pixels, if not NULL */
+);
+unsigned char *pikchr_prelude_png(
+  const pikchr_prelude*, /* Prelude, or NULL for none */
+  const char *zText,     /* Input PIKCHR source text.  zero-terminated */
+  unsigned int mFlags,   /* Flags used to influence rendering behavior */
+  double rZoom,          /* Image pixels per SVG pixel */
+  int *pnByte,           /* OUT: Size of the PNG in bytes */
+  int *pnWidth,          /* OUT: Width in pixels, if not NULL */
+  int *pnHeight          /* OUT: Height in pixels, if not NULL */
+);
+
 /* Return a static string that describes the current version of pikchr
 */
 const char *pikchr_version(void);